@@ -0,0 +1,259 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Authors
+ *
+ * Every distinct sender gets an author number, so that the same few
+ * thousand addresses are not stored over and over again. Senders are
+ * identified by the normalized address of their From header field.
+ *
+ * smak/author starts with a 32 byte header: the magic "smakaut\0", a 32 bit
+ * format version, 32 reserved bits, the 64 bit number of authors (counting
+ * the header as author zero) and 64 reserved bits. Each author is 32 bytes:
+ * a 64 bit check hash of the address and 192 reserved bits.
+ *
+ * smak/authorid is a hash table (see hashtab.c) that maps addresses to
+ * authors. Its mark is the log offset up to which all records are filed.
+ *
+ * smak/authors/NNNNNNNN holds the messages of an author, sorted by time, in
+ * the same format as the monthly reports (see smakdir.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "mail.h"
+#include "hashtab.h"
+#include "smakdir.h"
+#include "author.h"
+
+#define AUT_MAGIC    "smakaut"
+#define AUT_VERSION  1
+#define AUTHOR_SIZE  32
+#define MIN_AUTHORS  256
+/* seed of the check hash, so it is independent of the table hash */
+#define CHECK_SEED   0x5eed
+
+#define AUTHORP(a)   (authors + (size_t) (a) * AUTHOR_SIZE)
+#define CHECK(a)     get_le64(AUTHORP(a))
+
+extern _Thread_local char *aether_cursor;
+
+/* an entry of an author list that still has to be merged */
+struct authorent {
+	AUTHOR author;
+	struct repent ent;
+};
+
+static unsigned char *authors;
+static size_t capacity;
+static int authors_fd = -1;
+static struct hashtab ids;
+
+static size_t
+num_authors(void)
+{
+	return get_le64(authors + 16);
+}
+
+static void
+map_authors(size_t count)
+{
+	if (authors)
+		munmap(authors, capacity * AUTHOR_SIZE);
+	authors = mmap(NULL, count * AUTHOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, authors_fd, 0);
+	if (authors == MAP_FAILED)
+		die("mmap():");
+	capacity = count;
+}
+
+static AUTHOR
+new_author(uint64_t check)
+{
+	AUTHOR a = num_authors();
+
+	if (a == capacity) {
+		if (ftruncate(authors_fd, 2 * capacity * AUTHOR_SIZE) < 0)
+			die("ftruncate():");
+		map_authors(2 * capacity);
+	}
+	memset(AUTHORP(a), 0, AUTHOR_SIZE);
+	put_le64(AUTHORP(a), check);
+	put_le64(authors + 16, a + 1);
+	return a;
+}
+
+/* Returns the author of a From header field, creating one if create is
+ * set. Returns zero if the field holds no address at all. */
+static AUTHOR
+find_author(const char *from, size_t len, bool create)
+{
+	struct htiter it = HTITER_INIT;
+	char *checkpoint = aether_cursor, *norm;
+	uint64_t hash, check, value;
+	AUTHOR a = 0;
+
+	norm = aether_alloc(len);
+	if (!(len = normalize_address(from, len, norm)))
+		goto out;
+	hash  = hash_bytes(norm, len, 0);
+	check = hash_bytes(norm, len, CHECK_SEED);
+	while (hashtab_find(&ids, hash, &it, &value)) {
+		if (CHECK(value) == check) {
+			a = value;
+			goto out;
+		}
+	}
+	if (create) {
+		a = new_author(check);
+		hashtab_insert(&ids, hash, a);
+	}
+out:
+	aether_cursor = checkpoint;
+	return a;
+}
+
+void
+open_authors(void)
+{
+	unsigned char hdr[AUTHOR_SIZE] = { 0 };
+	struct stat meta;
+
+	if (authors) return;
+
+	if (mkdir("smak/authors", 0750) < 0 && errno != EEXIST)
+		die("cannot create 'smak/authors':");
+	if ((authors_fd = open("smak/author", O_RDWR | O_CREAT, 0640)) < 0)
+		die("cannot open 'smak/author':");
+	if (fstat(authors_fd, &meta) < 0)
+		die("fstat():");
+	if (!meta.st_size) {
+		memcpy(hdr, AUT_MAGIC, 8);
+		put_le32(hdr + 8, AUT_VERSION);
+		put_le64(hdr + 16, 1);
+		check_write(authors_fd, hdr, sizeof hdr);
+		if (ftruncate(authors_fd, MIN_AUTHORS * AUTHOR_SIZE) < 0)
+			die("ftruncate():");
+		meta.st_size = MIN_AUTHORS * AUTHOR_SIZE;
+	}
+	if (meta.st_size < AUTHOR_SIZE || meta.st_size % AUTHOR_SIZE)
+		die("'smak/author' is corrupt.");
+	map_authors(meta.st_size / AUTHOR_SIZE);
+	if (memcmp(authors, AUT_MAGIC, 8) || get_le32(authors + 8) != AUT_VERSION)
+		die("'smak/author' has an unknown format.");
+	if (num_authors() < 1 || num_authors() > capacity)
+		die("'smak/author' is corrupt.");
+
+	hashtab_open(&ids, "smak/authorid");
+}
+
+void
+close_authors(void)
+{
+	if (!authors) return;
+	munmap(authors, capacity * AUTHOR_SIZE);
+	authors = NULL;
+	capacity = 0;
+	close(authors_fd);
+	authors_fd = -1;
+	hashtab_close(&ids);
+}
+
+/* Returns the number of authors. They are numbered from one. */
+size_t
+count_authors(void)
+{
+	open_authors();
+	return num_authors() - 1;
+}
+
+AUTHOR
+lookup_author(const char *from, size_t len)
+{
+	open_authors();
+	return find_author(from, len, false);
+}
+
+void
+open_author_report(struct report *rpt, AUTHOR author)
+{
+	char filename[100];
+
+	snprintf(filename, sizeof filename, "smak/authors/%08u", (unsigned) author);
+	open_report_file(rpt, filename);
+}
+
+static int
+compare_authorents(const void *a, const void *b)
+{
+	const struct authorent *x = a, *y = b;
+	if (x->author != y->author) return x->author < y->author ? -1 : 1;
+	if (x->ent.time != y->ent.time) return x->ent.time < y->ent.time ? -1 : 1;
+	return x->ent.msg < y->ent.msg ? -1 : x->ent.msg > y->ent.msg;
+}
+
+/* Files all records that were logged since the last call into the lists
+ * of their authors. Returns the authors whose lists changed. Like the
+ * monthly reports, every touched list is updated exactly once. The mark
+ * only moves once all of them are, so an interrupted run may have merged
+ * some of the entries already. */
+AUTHOR *
+update_authors(bool recovered, size_t *count)
+{
+	struct authorent *batch = NULL;
+	struct record rec;
+	struct report rpt;
+	struct repent *ents;
+	AUTHOR *touched;
+	size_t nbatch = 0, capbatch = 0, ntouched = 0, i, j, n;
+	MSG msg;
+
+	open_authors();
+	map_log();
+	if (!(msg = hashtab_mark(&ids)))
+		msg = first_in_log();
+	for (; msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		if (nbatch == capbatch) {
+			capbatch = capbatch ? 2 * capbatch : 64;
+			if (!(batch = realloc(batch, capbatch * sizeof *batch)))
+				die("realloc():");
+		}
+		batch[nbatch].author = find_author(rec.info[MFROM].str, rec.info[MFROM].len, true);
+		batch[nbatch].ent = (struct repent) { rec.time, msg };
+		if (batch[nbatch].author)
+			nbatch++;
+	}
+
+	qsort(batch, nbatch, sizeof *batch, compare_authorents);
+	if (!(touched = malloc((nbatch + 1) * sizeof *touched)))
+		die("malloc():");
+	if (!(ents = malloc((nbatch + 1) * sizeof *ents)))
+		die("malloc():");
+	for (i = 0; i < nbatch; i = j) {
+		for (j = i; j < nbatch && batch[j].author == batch[i].author; j++)
+			ents[j - i] = batch[j].ent;
+		open_author_report(&rpt, batch[i].author);
+		n = j - i;
+		if (recovered)
+			n = drop_merged(&rpt, ents, n);
+		merge_into_report(&rpt, ents, n);
+		close_report(&rpt);
+		touched[ntouched++] = batch[i].author;
+	}
+	hashtab_set_mark(&ids, msg);
+
+	free(ents);
+	free(batch);
+	*count = ntouched;
+	return touched;
+}
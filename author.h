@@ -0,0 +1,18 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t AUTHOR;
+
+void open_authors(void);
+void close_authors(void);
+/* Files all records that were logged since the last call into the lists
+ * of their authors. Returns the authors whose lists changed. After an
+ * interrupted run, the entries that it has merged already are skipped. */
+AUTHOR *update_authors(bool recovered, size_t *count);
+/* Returns the number of authors. They are numbered from one. */
+size_t count_authors(void);
+/* Returns the author of a From header field, or zero if it is unknown. */
+AUTHOR lookup_author(const char *from, size_t len);
+void open_author_report(struct report *rpt, AUTHOR author);
@@ -0,0 +1,244 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Microbenchmark for the base64 and quoted-printable decoders.
+ *
+ * usage: decodebench
+ *
+ * Decodes a synthetic base64 body and a quoted-printable body of mostly
+ * non-ASCII text with every implementation of the inner loops, and with
+ * the byte-at-a-time decoders that mail.c used before, and prints the
+ * throughput of each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mail.h"
+#include "../util.h"
+#include "../simd.h"
+
+#define MIN_SECONDS 0.5
+#define CORPUS_SIZE (4 * 1024 * 1024)
+
+char *argv0;
+_Thread_local char *aether_base;
+_Thread_local char *aether_cursor;
+
+typedef char *(*decoder)(char *rhead, char *whead, size_t length);
+
+static int
+old_hex_digit(char c)
+{
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= '0' && c <= '9') return c - '0';
+	return -1;
+}
+
+static char *
+old_qprintable(char *rhead, char *whead, size_t length)
+{
+	char *end = rhead + length, *eq;
+	int lo, hi;
+
+	while ((eq = memchr(rhead, '=', end - rhead))) {
+		memmove(whead, rhead, eq - rhead);
+		whead  += eq - rhead;
+		rhead   = eq + 1;
+
+		if (end - rhead >= 2
+		&& (hi = old_hex_digit(rhead[0])) >= 0
+		&& (lo = old_hex_digit(rhead[1])) >= 0) {
+			*whead++ = hi * 16 + lo;
+			rhead += 2;
+		} else if (end - rhead >= 2 && rhead[0] == '\r' && rhead[1] == '\n') {
+			rhead += 2;
+		} else if (end - rhead >= 1 && rhead[0] == '\n') {
+			rhead += 1;
+		} else return NULL;
+	}
+	memmove(whead, rhead, end - rhead);
+	whead += end - rhead;
+	return whead;
+}
+
+static int
+old_base64_digit(char c)
+{
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+static char *
+old_base64(char *rhead, char *whead, size_t length)
+{
+	char *end = rhead + length;
+	unsigned long value = 0;
+	int digit, bits = 0;
+
+	while (rhead < end && *rhead != '=') {
+		if (*rhead == '\n' || *rhead == '\r' || *rhead == ' ' || *rhead == '\t') {
+			rhead++;
+			continue;
+		}
+		digit = old_base64_digit(*rhead);
+		if (digit < 0) return NULL;
+		value <<= 6;
+		value |= digit;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			*whead++ = value >> bits;
+			value &= (1u << bits) - 1u;
+		}
+		rhead++;
+	}
+	return whead;
+}
+
+/* random binary data, encoded in lines of 76 characters like an attachment */
+static char *
+make_base64(size_t *length)
+{
+	const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *corpus, *w;
+	size_t i;
+
+	if (!(corpus = malloc(CORPUS_SIZE + 2)))
+		die("malloc():");
+	w = corpus;
+	for (i = 0; (size_t) (w - corpus) < CORPUS_SIZE; i++) {
+		*w++ = digits[rand() % 64];
+		if (i % 76 == 75) *w++ = '\n';
+	}
+	*length = w - corpus;
+	return corpus;
+}
+
+/* Cyrillic text with some ASCII in between, encoded like a mail client would */
+static char *
+make_qprintable(size_t *length)
+{
+	const char *words[] = {
+		"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82", ",", " ",
+		"\xd1\x81\xd0\xbf\xd0\xb0\xd1\x81\xd0\xb8\xd0\xb1\xd0\xbe", " ",
+		"patch", " ", "v2", " ", "=", " ", "\xd0\xb4\xd0\xb0", ".", " ",
+	};
+	const char *hex = "0123456789ABCDEF";
+	const unsigned char *c;
+	char *corpus, *w;
+	size_t col = 0;
+
+	if (!(corpus = malloc(CORPUS_SIZE + 16)))
+		die("malloc():");
+	w = corpus;
+	while ((size_t) (w - corpus) < CORPUS_SIZE) {
+		for (c = (const unsigned char *) words[rand() % 14]; *c; c++) {
+			if (*c >= 0x80 || *c == '=') {
+				*w++ = '=';
+				*w++ = hex[*c >> 4];
+				*w++ = hex[*c & 15];
+				col += 3;
+			} else {
+				*w++ = *c;
+				col++;
+			}
+		}
+		if (col >= 72) {
+			*w++ = '=';
+			*w++ = '\n';
+			col = 0;
+		}
+	}
+	*length = w - corpus;
+	return corpus;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of input bytes decoded per second. */
+static double
+bench(decoder decode, char *corpus, size_t length, char *out, size_t *outlen)
+{
+	double start = now(), elapsed;
+	size_t rounds = 0;
+	char *end;
+
+	do {
+		if (!(end = decode(corpus, out, length)))
+			die("cannot decode corpus.");
+		rounds++;
+	} while ((elapsed = now() - start) < MIN_SECONDS);
+	*outlen = end - out;
+	return rounds * length / elapsed;
+}
+
+static void
+run(const char *title, decoder old, decoder decode, size_t (**kernel)(const char *, size_t, char *),
+	size_t (*const impls[3])(const char *, size_t, char *), char *corpus, size_t length)
+{
+	const char *names[] = { "scalar", "sse", "avx2" };
+	char *expected, *out;
+	size_t explen, outlen, i;
+	double base, rate;
+
+	if (!(expected = malloc(length)) || !(out = malloc(length)))
+		die("malloc():");
+	printf("%s: %zu bytes\n", title, length);
+	printf("%-10s %12s %8s\n", "impl", "MB/s", "speedup");
+	base = bench(old, corpus, length, expected, &explen);
+	printf("%-10s %12.1f %7.2fx\n", "old", base / 1e6, 1.0);
+
+	for (i = 0; i < 3; i++) {
+		if (!impls[i]) continue;
+		if (i == 2 && !__builtin_cpu_supports("avx2")) continue;
+		*kernel = impls[i];
+		rate = bench(decode, corpus, length, out, &outlen);
+		if (outlen != explen || memcmp(out, expected, explen))
+			die("%s disagrees with the old decoder.", names[i]);
+		printf("%-10s %12.1f %7.2fx\n", names[i], rate / 1e6, rate / base);
+	}
+	free(expected);
+	free(out);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t (*const base64_impls[3])(const char *, size_t, char *) = {
+		base64_run_scalar, base64_run_ssse3, base64_run_avx2 };
+	size_t (*const qp_impls[3])(const char *, size_t, char *) = {
+		qp_run_scalar, qp_run_sse2, qp_run_avx2 };
+	char *corpus;
+	size_t length;
+
+	argv0 = argv[0];
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s\n", argv0);
+		return 1;
+	}
+	__builtin_cpu_init();
+	srand(1);
+
+	corpus = make_base64(&length);
+	run("base64", old_base64, decode_base64, &base64_run, base64_impls, corpus, length);
+	free(corpus);
+
+	printf("\n");
+	corpus = make_qprintable(&length);
+	run("quoted-printable", old_qprintable, decode_qprintable, &qp_run, qp_impls, corpus, length);
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,469 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Deterministic generator of synthetic mailing list archives.
+ *
+ * usage: mkmaildir [-n messages] [-s seed] maildir
+ *
+ * Creates maildir with new/, cur/, tmp/ and www/, and fills new/ with
+ * messages that look like those of a busy development mailing list: a few
+ * senders write most of the messages, most messages are replies in long
+ * threads, some months are much busier than others, and there is a mix of
+ * RFC 2047 encoded words, quoted-printable and base64 bodies, and multipart
+ * messages with attachments. The same seed always gives the same maildir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../arg.h"
+#include "../util.h"
+
+#define NAUTHORS  300
+#define NMONTHS   48
+/* messages can only reply to one of the last RECENT messages */
+#define RECENT    512
+#define MAX_MSG   (256 * 1024)
+
+char *argv0;
+_Thread_local char *aether_base;
+_Thread_local char *aether_cursor;
+
+static const char *first_names[] = {
+	"Anselm", "Hiltjo", "Laslo", "Quentin", "Evil", "Jörg", "Søren", "Łukasz",
+	"Ramón", "Chloé", "Mikael", "Tobias", "Ivan", "Yuki", "Ana", "Kris",
+};
+static const char *last_names[] = {
+	"Garbe", "Perkins", "Hunger", "Rameau", "Bob", "Schäfer", "Øster", "Wójcik",
+	"Núñez", "Dupré", "Berg", "Roth", "Petrov", "Tanaka", "Silva", "Maker",
+};
+static const char *words[] = {
+	"patch", "fix", "the", "a", "of", "in", "build", "warning", "config", "memory",
+	"leak", "crash", "when", "with", "font", "render", "utf-8", "input", "bug",
+	"release", "update", "manpage", "typo", "remove", "unused", "variable", "add",
+	"support", "for", "option", "dmenu", "st", "dwm", "slock", "surf", "sbase",
+	"ubase", "question", "about", "license", "mailing", "list", "archive", "and",
+	"is", "it", "not", "this", "that", "should", "would", "could", "because",
+	"über", "größe", "naïve", "façade",
+};
+static const char *agents[] = {
+	"User-Agent: Mutt/2.2.7 (2022-08-07)",
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:102.0) Gecko/20100101 Thunderbird/102.4.0",
+	"X-Mailer: git-send-email 2.38.1",
+	"User-Agent: aerc/0.13.0",
+};
+
+/* the messages that later ones can reply to */
+struct sent {
+	unsigned id;
+	unsigned author;
+	char subject[160];
+	char references[1024];
+};
+
+static uint64_t state;
+
+/* xorshift64* */
+static uint64_t
+rnd(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned
+below(unsigned n)
+{
+	return rnd() % n;
+}
+
+static double
+uniform(void)
+{
+	return (rnd() >> 11) / 9007199254740992.0;
+}
+
+/* Picks 0..n-1, where small numbers are much more likely. */
+static unsigned
+skewed(unsigned n)
+{
+	double u = uniform();
+	return (unsigned) (n * u * u * u);
+}
+
+static char *
+append(char *w, const char *str)
+{
+	size_t len = strlen(str);
+	memcpy(w, str, len);
+	return w + len;
+}
+
+static char *
+encode_base64(char *w, const unsigned char *mem, size_t length)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned long v;
+	size_t i, col = 0;
+
+	for (i = 0; i < length; i += 3) {
+		v = (unsigned long) mem[i] << 16;
+		if (i + 1 < length) v |= mem[i+1] << 8;
+		if (i + 2 < length) v |= mem[i+2];
+		*w++ = digits[v >> 18 & 63];
+		*w++ = digits[v >> 12 & 63];
+		*w++ = i + 1 < length ? digits[v >> 6 & 63] : '=';
+		*w++ = i + 2 < length ? digits[v & 63] : '=';
+		if ((col += 4) == 76) {
+			*w++ = '\n';
+			col = 0;
+		}
+	}
+	if (col) *w++ = '\n';
+	return w;
+}
+
+static char *
+encode_qp(char *w, const char *mem, size_t length)
+{
+	size_t i, col = 0;
+	unsigned char c;
+
+	for (i = 0; i < length; i++) {
+		c = mem[i];
+		if (c == '\n') {
+			*w++ = '\n';
+			col = 0;
+			continue;
+		}
+		if (col >= 72) {
+			w = append(w, "=\n");
+			col = 0;
+		}
+		if (c >= 0x80 || c == '=') {
+			w += sprintf(w, "=%02X", c);
+			col += 3;
+		} else {
+			*w++ = c;
+			col++;
+		}
+	}
+	return w;
+}
+
+/* Converts UTF-8 to Latin-1, which covers all the words above. */
+static size_t
+to_latin1(char *out, const char *in)
+{
+	const unsigned char *c = (const unsigned char *) in;
+	char *w = out;
+
+	for (; *c; c++) {
+		if (*c < 0x80) {
+			*w++ = *c;
+		} else if ((*c & 0xE0) == 0xC0 && c[1]) {
+			*w++ = (char) ((*c & 0x1F) << 6 | (c[1] & 0x3F));
+			c++;
+		} else {
+			*w++ = '?';
+			while ((c[1] & 0xC0) == 0x80) c++;
+		}
+	}
+	*w = '\0';
+	return w - out;
+}
+
+/* Writes str as an RFC 2047 encoded word if it is not plain ASCII. */
+static char *
+header_text(char *w, const char *str)
+{
+	char latin[256];
+	const char *c;
+	size_t len;
+
+	for (c = str; *c && !(*c & 0x80); c++);
+	if (!*c)
+		return append(w, str);
+	/* an encoded word must not be broken across lines */
+	if (strlen(str) <= 45 && below(2)) {
+		w = append(w, "=?UTF-8?B?");
+		w = encode_base64(w, (const unsigned char *) str, strlen(str));
+		w[-1] = '?'; /* the line break */
+		return append(w, "=");
+	}
+	len = to_latin1(latin, str);
+	w = append(w, "=?ISO-8859-1?Q?");
+	for (c = latin; c < latin + len; c++) {
+		if (*c == ' ')
+			*w++ = '_';
+		else if (*c & 0x80 || *c == '=' || *c == '?' || *c == '_')
+			w += sprintf(w, "=%02X", (unsigned char) *c);
+		else
+			*w++ = *c;
+	}
+	return append(w, "?=");
+}
+
+static void
+make_subject(char *subject, size_t size)
+{
+	unsigned n = 2 + below(8), i;
+	size_t len = 0;
+
+	for (i = 0; i < n && len + 16 < size; i++)
+		len += snprintf(subject + len, size - len, "%s%s", i ? " " : "", words[below(sizeof words / sizeof *words)]);
+}
+
+static char *
+make_text(char *w, size_t length)
+{
+	char *start = w;
+	size_t col = 0;
+	const char *word;
+
+	while ((size_t) (w - start) < length) {
+		word = words[skewed(sizeof words / sizeof *words)];
+		if (col + strlen(word) > 70) {
+			*w++ = '\n';
+			col = 0;
+			if (!below(6)) {
+				*w++ = '\n';
+				if (!below(4)) w = append(w, "> ");
+			}
+		} else if (col) {
+			*w++ = ' ';
+			col++;
+		}
+		w = append(w, word);
+		col += strlen(word);
+	}
+	*w++ = '\n';
+	return w;
+}
+
+/* Most messages are short, a few are huge. */
+static size_t
+body_length(void)
+{
+	double u = uniform();
+	return 200 + (size_t) (40000 * u * u * u * u);
+}
+
+static char *
+make_body(char *w, const char *boundary)
+{
+	char text[64 * 1024], latin[64 * 1024];
+	unsigned char blob[32 * 1024];
+	size_t len, i;
+	unsigned kind = below(20);
+
+	len = make_text(text, body_length()) - text;
+	text[len] = '\0';
+	if (kind < 12) {
+		w = append(w, "Content-Type: text/plain; charset=utf-8\n\n");
+		memcpy(w, text, len);
+		return w + len;
+	}
+	if (kind < 16) {
+		w = append(w, "Content-Type: text/plain; charset=iso-8859-1\n"
+			"Content-Transfer-Encoding: quoted-printable\n\n");
+		len = to_latin1(latin, text);
+		return encode_qp(w, latin, len);
+	}
+	if (kind < 18) {
+		w = append(w, "Content-Type: text/plain; charset=utf-8\n"
+			"Content-Transfer-Encoding: base64\n\n");
+		return encode_base64(w, (unsigned char *) text, len);
+	}
+
+	w += sprintf(w, "Content-Type: multipart/mixed; boundary=\"%s\"\n\n", boundary);
+	w += sprintf(w, "This is a multi-part message in MIME format.\n--%s\n", boundary);
+	w = append(w, "Content-Type: text/plain; charset=utf-8\n"
+		"Content-Transfer-Encoding: quoted-printable\n\n");
+	w = encode_qp(w, text, len);
+	w += sprintf(w, "--%s\n", boundary);
+	if (below(2)) {
+		w = append(w, "Content-Type: text/x-diff; charset=us-ascii\n"
+			"Content-Disposition: inline; filename=\"fix.diff\"\n\n");
+		w = append(w, "diff --git a/config.def.h b/config.def.h\n"
+			"--- a/config.def.h\n+++ b/config.def.h\n@@ -1,3 +1,3 @@\n"
+			"-static int borderpx = 1;\n+static int borderpx = 2;\n");
+	} else {
+		len = 1024 + below(sizeof blob - 1024);
+		for (i = 0; i < len; i++)
+			blob[i] = rnd();
+		w = append(w, "Content-Type: application/octet-stream\n"
+			"Content-Disposition: attachment; filename=\"data.bin\"\n"
+			"Content-Transfer-Encoding: base64\n\n");
+		w = encode_base64(w, blob, len);
+	}
+	w += sprintf(w, "--%s--\n", boundary);
+	return w;
+}
+
+/* Months get very different numbers of messages, like a list whose
+ * activity comes in bursts. Returns cumulative weights. */
+static void
+month_weights(double *cum)
+{
+	double total = 0;
+	int m;
+
+	for (m = 0; m < NMONTHS; m++) {
+		total += 0.2 + uniform() * uniform() * 4;
+		cum[m] = total;
+	}
+	for (m = 0; m < NMONTHS; m++)
+		cum[m] /= total;
+}
+
+static time_t
+pick_time(const double *cum)
+{
+	double u = uniform();
+	struct tm tm = { 0 };
+	int m = 0;
+
+	while (m < NMONTHS - 1 && cum[m] < u) m++;
+	tm.tm_year = 2019 - 1900 + m / 12;
+	tm.tm_mon  = m % 12;
+	tm.tm_mday = 1 + below(28);
+	tm.tm_hour = below(24);
+	tm.tm_min  = below(60);
+	tm.tm_sec  = below(60);
+	return mkutctime(&tm);
+}
+
+static void
+write_msg(const char *dir, unsigned i, const char *mem, size_t length)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof path, "%s/new/%u.bench%s", dir, i, i % 3 ? "" : ":2,");
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		die("cannot create '%s':", path);
+	check_write(fd, mem, length);
+	close(fd);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n messages] [-s seed] maildir\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct sent recent[RECENT];
+	static const char *sub[] = { "new", "cur", "tmp", "www" };
+	char names[NAUTHORS][64], path[4096], subject[160], date[64], boundary[32];
+	char *msg, *w;
+	double cum[NMONTHS];
+	struct sent *parent, *s;
+	struct tm tm;
+	time_t t;
+	unsigned long count = 1000, seed = 1, i;
+	size_t len;
+	char *end;
+	unsigned a;
+	int d;
+
+	ARGBEGIN {
+	case 'n':
+		count = strtoul(EARGF(usage()), &end, 10);
+		if (*end) usage();
+		break;
+	case 's':
+		seed = strtoul(EARGF(usage()), &end, 10);
+		if (*end) usage();
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1)
+		usage();
+
+	state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	if (mkdir(argv[0], 0755) < 0 && errno != EEXIST)
+		die("cannot create '%s':", argv[0]);
+	for (d = 0; d < 4; d++) {
+		snprintf(path, sizeof path, "%s/%s", argv[0], sub[d]);
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			die("cannot create '%s':", path);
+	}
+	for (a = 0; a < NAUTHORS; a++) {
+		snprintf(names[a], sizeof names[a], "%s %s",
+			first_names[below(sizeof first_names / sizeof *first_names)],
+			last_names[below(sizeof last_names / sizeof *last_names)]);
+	}
+	month_weights(cum);
+	if (!(msg = malloc(MAX_MSG)))
+		die("malloc():");
+
+	for (i = 0; i < count; i++) {
+		a = skewed(NAUTHORS);
+		parent = i && below(10) < 7 ? &recent[(i - 1 - skewed(i < RECENT ? i : RECENT - 1)) % RECENT] : NULL;
+		s = &recent[i % RECENT];
+		t = pick_time(cum);
+		gmtime_r(&t, &tm);
+		strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S +0000", &tm);
+		snprintf(boundary, sizeof boundary, "=_%016llx", (unsigned long long) rnd());
+
+		w = msg;
+		w += sprintf(w, "Return-Path: <user%u@example.org>\n", a);
+		w += sprintf(w, "Received: from mail.example.org (mail.example.org [192.0.2.%u])\n"
+			"\tby lists.example.org with ESMTP id %08lx\n\tfor <dev@lists.example.org>; %s\n",
+			a % 250, i, date);
+		w = append(w, "From: ");
+		w = header_text(w, names[a]);
+		w += sprintf(w, " <user%u@example.org>\nTo: dev@lists.example.org\n", a);
+		if (parent) {
+			snprintf(subject, sizeof subject, "%s%.150s",
+				strncmp(parent->subject, "Re: ", 4) ? "Re: " : "", parent->subject);
+		} else {
+			len = below(4) ? 0 : (size_t) sprintf(subject, "[PATCH] ");
+			make_subject(subject + len, sizeof subject - len);
+		}
+		w = append(w, "Subject: ");
+		w = header_text(w, subject);
+		w += sprintf(w, "\nDate: %s\nMessage-ID: <%lu.%u@example.org>\n", date, i, a);
+		if (parent) {
+			w += sprintf(w, "In-Reply-To: <%u.%u@example.org>\n", parent->id, parent->author);
+			w += sprintf(w, "References:%s <%u.%u@example.org>\n", parent->references, parent->id, parent->author);
+		}
+		w += sprintf(w, "%s\nList-Id: <dev.lists.example.org>\nMIME-Version: 1.0\n", agents[a % 4]);
+		w = make_body(w, boundary);
+		write_msg(argv[0], i, msg, w - msg);
+
+		s->id = i;
+		s->author = a;
+		snprintf(s->subject, sizeof s->subject, "%s", subject);
+		s->references[0] = '\0';
+		if (parent) {
+			/* keep the References of deep threads bounded */
+			len = strlen(parent->references);
+			if (len > 700)
+				snprintf(s->references, sizeof s->references, "%s", strchr(parent->references + len - 700, ' '));
+			else
+				memcpy(s->references, parent->references, len + 1);
+			len = strlen(s->references);
+			snprintf(s->references + len, sizeof s->references - len, " <%u.%u@example.org>", parent->id, parent->author);
+		}
+	}
+
+	free(msg);
+	return 0;
+}
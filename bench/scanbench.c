@@ -0,0 +1,141 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Microbenchmark for the HTML escape scanner.
+ *
+ * usage: scanbench [file ...]
+ *
+ * Scans the given files (e.g. the messages in a maildir's cur/) the same
+ * way encode_html() does, once with every implementation, and prints the
+ * throughput of each. Without files, a synthetic plain-text corpus is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../util.h"
+#include "../simd.h"
+
+#define MIN_SECONDS 0.5
+
+char *argv0;
+_Thread_local char *aether_base;
+_Thread_local char *aether_cursor;
+
+static size_t
+scan_html_cspn(const char *mem, size_t length)
+{
+	return mem_cspn(mem, length, "<>&\"\0", 5);
+}
+
+static char *
+load_corpus(int argc, char **argv, size_t *length)
+{
+	/* roughly what a reply on a development mailing list looks like */
+	const char *lines[] = {
+		"On Mon, Jan 3, 2022 at 10:00 AM Someone <someone@example.org> wrote:\n",
+		"> I tried the patch on my machine, and it seems to work fine so far.\n",
+		"\n",
+		"Thanks for testing! I agree that the function could be a bit simpler,\n",
+		"but the old version had the same problem, so I would rather fix that\n",
+		"in a separate commit. Also, I think we should keep the buffer size at\n",
+		"4096 bytes for now, since nobody has complained about it yet.\n",
+		"\n",
+		"Regards,\n",
+		"Someone else\n",
+	};
+	struct stat meta;
+	char *corpus = NULL;
+	size_t size = 0, len;
+	int fd, i;
+
+	for (i = 0; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY)) < 0)
+			die("cannot open '%s':", argv[i]);
+		if (fstat(fd, &meta) < 0)
+			die("fstat():");
+		if (!(corpus = realloc(corpus, size + meta.st_size)))
+			die("realloc():");
+		check_read(fd, corpus + size, meta.st_size);
+		size += meta.st_size;
+		close(fd);
+	}
+	for (i = 0; !argc && i < 64 * 1024; i++) {
+		len = strlen(lines[i % 10]);
+		if (!(corpus = realloc(corpus, size + len)))
+			die("realloc():");
+		memcpy(corpus + size, lines[i % 10], len);
+		size += len;
+	}
+	*length = size;
+	return corpus;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of bytes scanned per second. */
+static double
+bench(size_t (*scan)(const char *, size_t), const char *corpus, size_t length, size_t *specials)
+{
+	double start = now(), elapsed;
+	size_t idx, rounds = 0;
+
+	do {
+		*specials = 0;
+		for (idx = 0; idx < length; idx++) {
+			idx += scan(corpus + idx, length - idx);
+			if (idx < length) ++*specials;
+		}
+		rounds++;
+	} while ((elapsed = now() - start) < MIN_SECONDS);
+	return rounds * length / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct { const char *name; size_t (*scan)(const char *, size_t); } impls[] = {
+		{ "mem_cspn", scan_html_cspn },
+		{ "scalar",   scan_html_scalar },
+		{ "sse2",     scan_html_sse2 },
+		{ "avx2",     scan_html_avx2 },
+	};
+	char *corpus;
+	size_t length, specials, expected = 0, i;
+	double base = 0, rate;
+
+	argv0 = argv[0];
+	corpus = load_corpus(argc - 1, argv + 1, &length);
+	printf("corpus: %zu bytes\n", length);
+	printf("%-10s %12s %8s\n", "impl", "MB/s", "speedup");
+
+	for (i = 0; i < sizeof impls / sizeof *impls; i++) {
+		if (!impls[i].scan) continue;
+		if (!strcmp(impls[i].name, "avx2")) {
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("avx2")) continue;
+		}
+		rate = bench(impls[i].scan, corpus, length, &specials);
+		if (!i) {
+			base = rate;
+			expected = specials;
+		} else if (specials != expected) {
+			die("%s disagrees with mem_cspn.", impls[i].name);
+		}
+		printf("%-10s %12.1f %7.2fx\n", impls[i].name, rate / 1e6, rate / base);
+	}
+
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,295 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * End-to-end benchmark driver.
+ *
+ * usage: smakbench [-c] [-j jobs] [-r runs] smak maildir
+ *
+ * Runs the smak binary over fresh copies of the messages in maildir/new/
+ * (e.g. made by mkmaildir), and prints the throughput in messages and bytes
+ * per second and the peak RSS of every run, and the best run. The copies
+ * are hard links next to maildir, so nothing is read from or written to
+ * maildir itself. With -c, one more run is traced with ptrace() to count
+ * the system calls that smak issues, which makes it much slower, so it
+ * is not timed.
+ */
+
+#define _GNU_SOURCE /* __WALL */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+#include "../arg.h"
+#include "../util.h"
+
+#define MAX_SYSCALL 512
+#define TOP_SYSCALLS 8
+
+char *argv0;
+_Thread_local char *aether_base;
+_Thread_local char *aether_cursor;
+
+static const char *maildir;
+static char **names;
+static size_t nnames;
+static unsigned long long total_bytes;
+
+static void
+scan_messages(void)
+{
+	char path[4096];
+	struct dirent *ent;
+	struct stat meta;
+	DIR *dir;
+	size_t cap = 0;
+
+	snprintf(path, sizeof path, "%s/new", maildir);
+	if (!(dir = opendir(path)))
+		die("cannot open '%s':", path);
+	while ((errno = 0, ent = readdir(dir))) {
+		if (ent->d_name[0] == '.') continue;
+		if (nnames == cap) {
+			cap = cap ? 2 * cap : 1024;
+			if (!(names = realloc(names, cap * sizeof *names)))
+				die("realloc():");
+		}
+		if (!(names[nnames++] = strdup(ent->d_name)))
+			die("strdup():");
+		snprintf(path, sizeof path, "%s/new/%s", maildir, ent->d_name);
+		if (stat(path, &meta) < 0)
+			die("cannot stat '%s':", path);
+		total_bytes += meta.st_size;
+	}
+	if (errno)
+		die("readdir():");
+	closedir(dir);
+	if (!nnames)
+		die("'%s/new' holds no messages.", maildir);
+}
+
+/* Makes a fresh maildir out of hard links to the messages. */
+static void
+make_run_dir(char *dir, size_t size)
+{
+	static const char *sub[] = { "new", "cur", "tmp", "www" };
+	char src[4096], dst[4096];
+	size_t i;
+
+	snprintf(dir, size, "%s.run.XXXXXX", maildir);
+	if (!mkdtemp(dir))
+		die("mkdtemp():");
+	for (i = 0; i < 4; i++) {
+		snprintf(dst, sizeof dst, "%s/%s", dir, sub[i]);
+		if (mkdir(dst, 0755) < 0)
+			die("cannot create '%s':", dst);
+	}
+	for (i = 0; i < nnames; i++) {
+		snprintf(src, sizeof src, "%s/new/%s", maildir, names[i]);
+		snprintf(dst, sizeof dst, "%s/new/%s", dir, names[i]);
+		if (link(src, dst) < 0)
+			die("cannot link '%s':", src);
+	}
+}
+
+static int
+remove_entry(const char *path, const struct stat *meta, int flag, struct FTW *ftw)
+{
+	(void) meta, (void) flag, (void) ftw;
+	if (remove(path) < 0)
+		die("cannot remove '%s':", path);
+	return 0;
+}
+
+static void
+remove_run_dir(const char *dir)
+{
+	if (nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) < 0)
+		die("nftw():");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t
+spawn(const char *smak, const char *jobs, const char *dir, int trace)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		die("fork():");
+	if (pid)
+		return pid;
+	if (trace) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			die("ptrace():");
+		raise(SIGSTOP);
+	}
+	execl(smak, smak, "-j", jobs, dir, (char *) NULL);
+	die("cannot execute '%s':", smak);
+	return -1;
+}
+
+static void
+check_status(int status)
+{
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		die("smak failed.");
+}
+
+/* Returns the wall clock time, and the peak RSS in KiB in *rss. */
+static double
+timed_run(const char *smak, const char *jobs, long *rss)
+{
+	char dir[4096];
+	struct rusage usage;
+	double start, elapsed;
+	pid_t pid;
+	int status;
+
+	make_run_dir(dir, sizeof dir);
+	start = now();
+	pid = spawn(smak, jobs, dir, 0);
+	if (wait4(pid, &status, 0, &usage) < 0)
+		die("wait4():");
+	elapsed = now() - start;
+	check_status(status);
+	*rss = usage.ru_maxrss;
+	remove_run_dir(dir);
+	return elapsed;
+}
+
+/* Counts the system calls of smak and all of its threads. */
+static unsigned long long
+traced_run(const char *smak, const char *jobs, unsigned long long *counts)
+{
+	struct ptrace_syscall_info info;
+	char dir[4096];
+	unsigned long long total = 0;
+	pid_t pid, tid;
+	int status, sig, event;
+
+	make_run_dir(dir, sizeof dir);
+	pid = spawn(smak, jobs, dir, 1);
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid():");
+	if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0)
+		die("ptrace():");
+	if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0)
+		die("ptrace():");
+
+	for (;;) {
+		if ((tid = waitpid(-1, &status, __WALL)) < 0)
+			die("waitpid():");
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == pid) break;
+			continue;
+		}
+		sig = WSTOPSIG(status);
+		event = status >> 16;
+		if (sig == (SIGTRAP | 0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) < 0)
+				die("ptrace():");
+			if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				total++;
+				if (info.entry.nr < MAX_SYSCALL)
+					counts[info.entry.nr]++;
+			}
+			sig = 0;
+		} else if (event || sig == SIGSTOP || sig == SIGTRAP) {
+			/* clone events, and new threads starting up */
+			sig = 0;
+		}
+		/* the thread may have been killed meanwhile */
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) sig);
+	}
+	check_status(status);
+	remove_run_dir(dir);
+	return total;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c] [-j jobs] [-r runs] smak maildir\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static unsigned long long counts[MAX_SYSCALL];
+	const char *jobs = "1", *smak;
+	unsigned long long total;
+	double elapsed, best = 0;
+	long rss, bestrss = 0;
+	int runs = 3, trace = 0, r, i, top;
+	char *end;
+
+	ARGBEGIN {
+	case 'c':
+		trace = 1;
+		break;
+	case 'j':
+		jobs = EARGF(usage());
+		break;
+	case 'r':
+		runs = strtol(EARGF(usage()), &end, 10);
+		if (*end || runs < 1) usage();
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 2)
+		usage();
+	smak = argv[0];
+	maildir = argv[1];
+
+	scan_messages();
+	printf("%zu messages, %.1f MB, %s jobs\n", nnames, total_bytes / 1e6, jobs);
+	printf("%-6s %10s %10s %10s %10s\n", "run", "seconds", "msgs/s", "MB/s", "RSS MB");
+	for (r = 0; r < runs; r++) {
+		elapsed = timed_run(smak, jobs, &rss);
+		printf("%-6d %10.3f %10.0f %10.2f %10.1f\n", r + 1, elapsed,
+			nnames / elapsed, total_bytes / elapsed / 1e6, rss / 1024.0);
+		if (!r || elapsed < best) best = elapsed;
+		if (rss > bestrss) bestrss = rss;
+	}
+	printf("%-6s %10.3f %10.0f %10.2f %10.1f\n", "best", best,
+		nnames / best, total_bytes / best / 1e6, bestrss / 1024.0);
+
+	if (trace) {
+		total = traced_run(smak, jobs, counts);
+		printf("\n%llu system calls, %.1f per message\n", total, (double) total / nnames);
+		printf("%-6s %10s\n", "nr", "calls");
+		/* selection of the most frequent ones */
+		for (i = 0; i < TOP_SYSCALLS; i++) {
+			top = 0;
+			for (r = 1; r < MAX_SYSCALL; r++) {
+				if (counts[r] > counts[top]) top = r;
+			}
+			if (!counts[top]) break;
+			printf("%-6d %10llu\n", top, counts[top]);
+			counts[top] = 0;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Conversion of declared charsets to UTF-8
+ *
+ * Every thread keeps the iconv descriptors it opened in a small cache, so
+ * that a batch of messages in the same few charsets only pays for
+ * iconv_open() once per charset.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <iconv.h>
+
+#include "charset.h"
+
+#define NCACHED 8
+
+struct charset {
+	char    name[32]; /* normalized name, see normalize() */
+	iconv_t cd;       /* (iconv_t) -1 if iconv doesn't know the charset */
+	bool    ascii;    /* ASCII text is the same in this charset */
+};
+
+static _Thread_local struct charset cache[NCACHED];
+static _Thread_local unsigned ncached, victim;
+
+/* Lowercases name and drops punctuation, so that e.g. "ISO-8859-1" and
+ * "iso8859_1" are found under the same key. */
+static void
+normalize(const char *name, char *key, size_t size)
+{
+	char *w = key;
+
+	for (; *name && *name != '*' && w < key + size - 1; name++) {
+		if (*name >= 'A' && *name <= 'Z') {
+			*w++ = *name - 'A' + 'a';
+		} else if ((*name >= 'a' && *name <= 'z') || (*name >= '0' && *name <= '9')) {
+			*w++ = *name;
+		}
+	}
+	*w = '\0';
+}
+
+/* Charsets in which bytes below 0x80 always are ASCII characters. */
+static bool
+is_ascii_compatible(const char *key)
+{
+	const char *prefixes[] = {
+		"iso8859", "windows", "cp125", "koi8", "latin", "gb", "big5",
+		"euc", "shiftjis", "sjis", "tis620",
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof prefixes / sizeof *prefixes; i++) {
+		if (!strncmp(key, prefixes[i], strlen(prefixes[i]))) return true;
+	}
+	return false;
+}
+
+const struct charset *
+find_charset(const char *name)
+{
+	struct charset *cs;
+	char key[sizeof cs->name];
+	unsigned i;
+
+	normalize(name, key, sizeof key);
+	if (!*key || !strcmp(key, "utf8") || !strcmp(key, "usascii") || !strcmp(key, "ascii"))
+		return NULL;
+
+	for (i = 0; i < ncached; i++) {
+		if (!strcmp(cache[i].name, key)) {
+			cs = &cache[i];
+			goto found;
+		}
+	}
+	if (ncached < NCACHED) {
+		cs = &cache[ncached++];
+	} else {
+		cs = &cache[victim];
+		victim = (victim + 1) % NCACHED;
+		if (cs->cd != (iconv_t) -1)
+			iconv_close(cs->cd);
+	}
+	memcpy(cs->name, key, sizeof key);
+	cs->cd = iconv_open("UTF-8", name);
+	cs->ascii = is_ascii_compatible(key);
+
+found:
+	if (cs->cd == (iconv_t) -1)
+		return NULL;
+	/* forget the shift state of the previous text */
+	iconv(cs->cd, NULL, NULL, NULL, NULL);
+	return cs;
+}
+
+bool
+must_convert(const struct charset *cs, const char *mem, size_t length)
+{
+	uint64_t word, bits = 0;
+	size_t i;
+
+	if (!cs->ascii) return true;
+	for (i = 0; length - i >= 8; i += 8) {
+		memcpy(&word, mem + i, 8);
+		bits |= word;
+	}
+	for (; i < length; i++)
+		bits |= (unsigned char) mem[i];
+	return (bits & UINT64_C(0x8080808080808080)) != 0;
+}
+
+/* Returns 0 once all input is converted, EINVAL at an incomplete
+ * character at the end of the input, and E2BIG when out is full. */
+static int
+run_iconv(const struct charset *cs, char **ip, size_t *il, char **op, size_t *ol)
+{
+	while (*il && iconv(cs->cd, ip, il, op, ol) == (size_t) -1) {
+		if (errno != EILSEQ) return errno;
+		if (!*ol) return E2BIG;
+		*(*op)++ = '?';
+		(*ol)--;
+		(*ip)++;
+		(*il)--;
+	}
+	return 0;
+}
+
+size_t
+convert_charset(const struct charset *cs, const char *in, size_t length,
+	char *out, size_t outsize, size_t *consumed)
+{
+	char *ip = (char *) in, *op = out;
+	size_t il = length, ol = outsize;
+
+	run_iconv(cs, &ip, &il, &op, &ol);
+	*consumed = ip - in;
+	return op - out;
+}
+
+bool
+convert_all(const struct charset *cs, const char *in, size_t length,
+	char *out, size_t outsize, size_t *written)
+{
+	char *ip = (char *) in, *op = out;
+	size_t il = length, ol = outsize;
+
+	/* text that was cut off before may have left a shift state behind */
+	iconv(cs->cd, NULL, NULL, NULL, NULL);
+	switch (run_iconv(cs, &ip, &il, &op, &ol)) {
+	case 0:
+		break;
+	case EINVAL:
+		if (!ol) return false;
+		*op++ = '?';
+		break;
+	default:
+		return false;
+	}
+	*written = op - out;
+	return true;
+}
+
+void
+close_charsets(void)
+{
+	unsigned i;
+
+	for (i = 0; i < ncached; i++) {
+		if (cache[i].cd != (iconv_t) -1)
+			iconv_close(cache[i].cd);
+	}
+	ncached = victim = 0;
+}
@@ -0,0 +1,28 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct charset;
+
+/* Returns how to convert text in the named charset to UTF-8, or NULL if it
+ * can be used as it is, either because it already is UTF-8 or ASCII, or
+ * because iconv() doesn't know the charset. The iconv descriptors are
+ * cached per thread and stay valid until the next call. */
+const struct charset *find_charset(const char *name);
+/* Whether text in cs has to go through convert_charset() at all.
+ * Pure ASCII text doesn't, in most charsets. */
+bool must_convert(const struct charset *cs, const char *mem, size_t length);
+/* Converts up to length bytes at in to UTF-8, writing at most outsize bytes
+ * to out, and returns the number of bytes written. Invalid input becomes
+ * '?'. Stops early at an incomplete character at the end of in, or when
+ * out is full, and sets *consumed to the number of bytes that were used. */
+size_t convert_charset(const struct charset *cs, const char *in, size_t length,
+	char *out, size_t outsize, size_t *consumed);
+/* Converts all length bytes at in, like convert_charset(), and sets
+ * *written. An incomplete character at the end becomes '?' as well.
+ * Returns false if out is too small to take all of it. */
+bool convert_all(const struct charset *cs, const char *in, size_t length,
+	char *out, size_t outsize, size_t *written);
+/* Closes the iconv descriptors of the calling thread. */
+void close_charsets(void);
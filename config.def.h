@@ -8,23 +8,162 @@
  * MAX_AETHER_MEMORY specifies the maximum number of bytes in the aether. */
 #define MAX_AETHER_MEMORY (256 * 1024 * 1024)
 
+/* Messages bigger than STREAM_THRESHOLD bytes are not loaded into memory
+ * as a whole. Their body is decoded and written out in pieces of
+ * STREAM_CHUNK bytes instead, which keeps memory usage bounded. */
+#define STREAM_THRESHOLD (16 * 1024 * 1024)
+#define STREAM_CHUNK     (1024 * 1024)
+
+/* Messages of mbox files are looked for in windows of at least
+ * MBOX_WINDOW bytes, which are mapped into memory one at a time. */
+#define MBOX_WINDOW (1024 * 1024)
+
+/* MIME parts of a message beyond the first MAX_MIME_PARTS are ignored. */
+#define MAX_MIME_PARTS 64
+
+/* Postings of the search index are collected in memory and written out
+ * as a new segment once there are INDEX_BATCH of them. */
+#define INDEX_BATCH (1 << 22)
+
+/* Processed messages are only moved to cur/ once everything that was
+ * written for them is on disk. To keep the number of disk flushes low,
+ * they are moved in batches of up to COMMIT_BATCH messages, or whenever
+ * the oldest message of a batch has waited COMMIT_LATENCY milliseconds. */
+#define COMMIT_BATCH   256
+#define COMMIT_LATENCY 1000
+
+/* With -d, messages that arrive in new/ are collected until DAEMON_LATENCY
+ * milliseconds passed since the first one, or until there are COMMIT_BATCH
+ * of them, and then processed together. */
+#define DAEMON_LATENCY 2
+
+/* The Atom feed shows the FEED_ENTRIES newest messages. */
+#define FEED_ENTRIES 50
+
+/* The pages of messages and their attachments are spread over
+ * subdirectories of www/, so that no directory gets too big:
+ * LAYOUT_HASH puts them into www/xx/yy/ after a hash of their name,
+ * LAYOUT_MONTH into www/YYYY/MM/ after their date, and LAYOUT_FLAT
+ * leaves them all in www/. After changing it, run "smak maildir relayout"
+ * to move the existing pages. */
+#define LAYOUT LAYOUT_HASH
+
 #ifdef CONFIG_HTML /* This section is specific to HTML generation. */
 
-static const char *html_header1 =
-	"<!DOCTYPE html>\n"
-	"<html>\n"
-	"<head>\n"
-	"<meta charset=\"utf-8\"/>\n"
-	"<title>";
-static const char *html_header2 =
-	"</title>\n"
-	"</head>\n"
-	"<body>\n";
-static const char *html_footer =
-	"<hr/>\n"
-	"<small>Generated by smak " VERSION "</small>\n"
-	"</body>\n"
-	"</html>\n";
+/* Pages are generated from these templates. A template is plain text with
+ * slots of the form {{name}}, which are filled in for each page. Slots
+ * that hold a list, like {{items}} or {{replies}}, are filled in with
+ * another template once per item. {{page}} is the link to the page of a
+ * message from the page it is on, without the file extension, and the
+ * attachments of a message are in the directory {{uniq}} next to it. */
+#define HTML_HEAD(title) \
+	"<!DOCTYPE html>\n" \
+	"<html>\n" \
+	"<head>\n" \
+	"<meta charset=\"utf-8\"/>\n" \
+	"<title>" title "</title>\n" \
+	"</head>\n" \
+	"<body>\n"
+#define HTML_FOOT \
+	"<hr/>\n" \
+	"<small>Generated by smak " VERSION "</small>\n" \
+	"</body>\n" \
+	"</html>\n"
+
+static const char *html_templates[NUMTEMPLATES] = {
+	[TMSG] = HTML_HEAD("{{subject}}")
+		"<h1>{{subject}}</h1>\n"
+		"<b>From:</b> {{from}}<br/>\n"
+		"<b>Date:</b> {{date}}<br/>\n"
+		"{{parent}}{{body}}{{attachments}}{{replies}}"
+		HTML_FOOT,
+	[TPARENT] = "<b>In reply to:</b> <a href=\"{{page}}.html\">{{subject}}</a><br/>\n",
+	[TTEXT] = "<hr/>\n<pre>{{text}}</pre>\n",
+	[TATTACHMENTS] = "<hr/>\n<b>Attachments:</b>\n<ul>\n{{items}}</ul>\n",
+	[TATTACHMENT] = "<li><a href=\"{{uniq}}/{{name}}\">{{name}}</a></li>\n",
+	[TREPLIES] = "<hr/>\n<b>Replies:</b>\n<ul>\n{{items}}</ul>\n",
+	[TREPLY] = "<li><a href=\"{{page}}.html\">{{subject}}</a></li>\n",
+	[TREPORT] = HTML_HEAD("{{title}}")
+		"<table>\n"
+		"<tr>\n<th>Date</th>\n<th>Subject</th>\n<th>Author</th>\n</tr>\n"
+		"{{items}}"
+		"</table>\n"
+		HTML_FOOT,
+	[TREPORTROW] =
+		"<tr>\n"
+		"<td>{{date}}</td>\n"
+		"<td><a href=\"{{page}}.html\">{{subject}}</a></td>\n"
+		"<td>{{author}}</td>\n"
+		"</tr>\n",
+	[TAUTHORLINK] = "<a href=\"author-{{id}}.html\">{{from}}</a>",
+	[TAUTHOR] = HTML_HEAD("{{from}}")
+		"<h1>{{from}}</h1>\n"
+		"<p>{{count}} messages</p>\n"
+		"<table>\n"
+		"<tr>\n<th>Date</th>\n<th>Subject</th>\n</tr>\n"
+		"{{items}}"
+		"</table>\n"
+		HTML_FOOT,
+	[TAUTHORROW] =
+		"<tr>\n"
+		"<td>{{date}}</td>\n"
+		"<td><a href=\"{{page}}.html\">{{subject}}</a></td>\n"
+		"</tr>\n",
+	[TOVERVIEW] = HTML_HEAD("Archive")
+		"<table>\n"
+		"<tr>\n<th>Month</th>\n<th>Messages</th>\n<th>Last update</th>\n</tr>\n"
+		"{{items}}"
+		"</table>\n"
+		HTML_FOOT,
+	[TMONTH] =
+		"<tr>\n"
+		"<td><a href=\"{{month}}.html\">{{month}}</a></td>\n"
+		"<td>{{count}}</td>\n"
+		"<td>{{date}}</td>\n"
+		"</tr>\n",
+};
+
+/* Set gopher to 1 to generate .gph pages for geomyidae next to the HTML
+ * pages. Lines that start with 't' are printed without the 't', which
+ * keeps text from being taken for a link. */
+static const int gopher = 0;
+
+static const char *gph_templates[NUMTEMPLATES] = {
+	[TMSG] =
+		"t{{subject}}\n"
+		"\n"
+		"From: {{from}}\n"
+		"Date: {{date}}\n"
+		"{{parent}}{{body}}{{attachments}}{{replies}}"
+		"\n"
+		"Generated by smak " VERSION "\n",
+	[TPARENT] = "[1|In reply to: {{subject}}|{{page}}.gph|server|port]\n",
+	[TTEXT] = "\nt{{text}}\n",
+	[TATTACHMENTS] = "\nAttachments:\n{{items}}",
+	[TATTACHMENT] = "[9|{{name}}|{{uniq}}/{{name}}|server|port]\n",
+	[TREPLIES] = "\nReplies:\n{{items}}",
+	[TREPLY] = "[1|{{subject}}|{{page}}.gph|server|port]\n",
+	[TREPORT] = "{{title}}\n\n{{items}}",
+	[TREPORTROW] = "[1|{{date}}  {{subject}} ({{from}})|{{page}}.gph|server|port]\n",
+	[TAUTHORLINK] = "{{from}}",
+	[TAUTHOR] = "t{{from}}\n{{count}} messages\n\n{{items}}",
+	[TAUTHORROW] = "[1|{{date}}  {{subject}}|{{page}}.gph|server|port]\n",
+	[TOVERVIEW] = "Archive\n\n{{items}}",
+	[TMONTH] = "[1|{{month}}  {{count}} messages, last update {{date}}|{{month}}.gph|server|port]\n",
+};
+
+/* The feed needs absolute links, so it has to know where www/ is served. */
+static const char *feed_url   = "http://localhost/";
+static const char *feed_title = "Mailing list archive";
+
+/* Attachments only keep the extension that their sender gave them if it
+ * is one of these. All others get ".bin" appended, so that a web server
+ * never serves an attachment as a page, e.g. HTML with scripts, from the
+ * origin of the archive. */
+static const char *safe_extensions[] = {
+	"txt", "diff", "patch", "asc", "sig", "pdf", "png", "jpg", "jpeg",
+	"gif", "webp", "zip", "gz", "tgz", "bz2", "xz", "tar", "bin", NULL
+};
 
 #endif
 
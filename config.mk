@@ -13,6 +13,6 @@ MANPREFIX = $(PREFIX)/share/man
 
 # compiler flags
 CPPFLAGS = -DVERSION=\"$(VERSION)\"
-CFLAGS   = -g -Wall
-LDFLAGS  = -g
+CFLAGS   = -g -O2 -Wall -pthread
+LDFLAGS  = -g -pthread
 
@@ -0,0 +1,241 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Atom feed
+ *
+ * The feed only ever shows the FEED_ENTRIES newest messages, by Date. They
+ * are kept in smak/feed together with everything the feed needs to show
+ * about them, so that it can be written without looking at the log or the
+ * reports. Updating it costs time proportional to FEED_ENTRIES, no matter
+ * how big the archive is.
+ *
+ * smak/feed begins with a 24 byte header: the magic "smakfed\0", a 32 bit
+ * format version, 32 reserved bits and the 64 bit entry count. The entries
+ * follow, newest first: the 64 bit signed time, and then the file name,
+ * subject and sender, each as a 32 bit length followed by the bytes and a
+ * terminating NUL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "out.h"
+#include "feed.h"
+#include "config.h"
+
+#define FEED_MAGIC       "smakfed"
+#define FEED_VERSION     1
+#define FEED_HEADER_SIZE 24
+
+extern void generate_feed(const struct feedent *ents, size_t count);
+
+/* the newest messages of this run, newest first */
+static struct feedent fresh[FEED_ENTRIES];
+static size_t nfresh;
+
+static void
+free_entry(struct feedent *ent)
+{
+	free(ent->uniq);
+	free(ent->subject);
+	free(ent->from);
+}
+
+static char *
+copy_string(const char *str)
+{
+	char *copy;
+
+	if (!(copy = strdup(str)))
+		die("strdup():");
+	return copy;
+}
+
+/* Returns where an entry of the given time goes in a list that is sorted
+ * newest first. Equal times keep the order of arrival. */
+static size_t
+insertion_point(const struct feedent *ents, size_t count, time_t time)
+{
+	size_t lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ents[mid].time >= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+add_to_feed(time_t time, const char *uniq, const char *subject, const char *from)
+{
+	size_t at = insertion_point(fresh, nfresh, time);
+
+	if (at == FEED_ENTRIES) return;
+	if (nfresh == FEED_ENTRIES)
+		free_entry(&fresh[--nfresh]);
+	memmove(fresh + at + 1, fresh + at, (nfresh - at) * sizeof *fresh);
+	fresh[at] = (struct feedent) { time, copy_string(uniq), copy_string(subject), copy_string(from) };
+	nfresh++;
+}
+
+static unsigned char *
+read_string(unsigned char *p, unsigned char *end, char **str)
+{
+	size_t len;
+
+	if (end - p < 4)
+		die("'smak/feed' is corrupt.");
+	len = get_le32(p);
+	if ((size_t) (end - p - 4) < len + 1 || p[4 + len])
+		die("'smak/feed' is corrupt.");
+	if (!(*str = malloc(len + 1)))
+		die("malloc():");
+	memcpy(*str, p + 4, len + 1);
+	return p + 4 + len + 1;
+}
+
+/* Loads smak/feed into ents, which has room for FEED_ENTRIES entries. */
+static size_t
+load_feed(struct feedent *ents)
+{
+	unsigned char *buf, *p, *end;
+	struct stat meta;
+	size_t count, i;
+	int fd;
+
+	if ((fd = open("smak/feed", O_RDONLY)) < 0) {
+		if (errno == ENOENT) return 0;
+		die("cannot open 'smak/feed':");
+	}
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (meta.st_size < FEED_HEADER_SIZE)
+		die("'smak/feed' is corrupt.");
+	if (!(buf = malloc(meta.st_size)))
+		die("malloc():");
+	for (p = buf; p < buf + meta.st_size; p += check_read(fd, p, buf + meta.st_size - p));
+	close(fd);
+	if (memcmp(buf, FEED_MAGIC, 8) || get_le32(buf + 8) != FEED_VERSION)
+		die("'smak/feed' has an unknown format.");
+
+	count = get_le64(buf + 16);
+	/* FEED_ENTRIES may have been lowered since */
+	if (count > FEED_ENTRIES)
+		count = FEED_ENTRIES;
+	end = buf + meta.st_size;
+	for (i = 0, p = buf + FEED_HEADER_SIZE; i < count; i++) {
+		if (end - p < 8)
+			die("'smak/feed' is corrupt.");
+		ents[i].time = (int64_t) get_le64(p);
+		p = read_string(p + 8, end, &ents[i].uniq);
+		p = read_string(p, end, &ents[i].subject);
+		p = read_string(p, end, &ents[i].from);
+	}
+	free(buf);
+	return count;
+}
+
+static void
+save_feed(const struct feedent *ents, size_t count)
+{
+	unsigned char hdr[FEED_HEADER_SIZE] = { 0 }, num[8];
+	const char *strs[3];
+	struct outbuf *ob;
+	size_t i, j, len;
+	int fd;
+
+	if ((fd = open("smak/feed.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot create 'smak/feed.tmp':");
+	if (!(ob = malloc(sizeof *ob)))
+		die("malloc():");
+	out_init(ob, fd);
+	memcpy(hdr, FEED_MAGIC, 8);
+	put_le32(hdr + 8, FEED_VERSION);
+	put_le64(hdr + 16, count);
+	out_write(ob, hdr, sizeof hdr);
+	for (i = 0; i < count; i++) {
+		put_le64(num, ents[i].time);
+		out_write(ob, num, 8);
+		strs[0] = ents[i].uniq;
+		strs[1] = ents[i].subject;
+		strs[2] = ents[i].from;
+		for (j = 0; j < 3; j++) {
+			len = strlen(strs[j]);
+			put_le32(num, len);
+			out_write(ob, num, 4);
+			out_write(ob, strs[j], len + 1);
+		}
+	}
+	out_flush(ob);
+	free(ob);
+	close(fd);
+	if (rename("smak/feed.tmp", "smak/feed") < 0)
+		die("rename():");
+}
+
+void
+update_feed(void)
+{
+	struct feedent old[FEED_ENTRIES], merged[FEED_ENTRIES];
+	size_t nold, nmerged = 0, i, j, n;
+	bool changed = false;
+
+	if (!nfresh) return;
+	nold = load_feed(old);
+
+	/* a run that finishes an interrupted one may offer messages again */
+	for (j = n = 0; j < nfresh; j++) {
+		for (i = 0; i < nold && strcmp(old[i].uniq, fresh[j].uniq); i++);
+		if (i < nold)
+			free_entry(&fresh[j]);
+		else
+			fresh[n++] = fresh[j];
+	}
+	nfresh = n;
+	i = j = 0;
+
+	/* Both lists are sorted newest first. On equal times,
+	 * the messages that were in the feed before come first. */
+	while (nmerged < FEED_ENTRIES && (i < nold || j < nfresh)) {
+		if (j == nfresh || (i < nold && old[i].time >= fresh[j].time)) {
+			merged[nmerged++] = old[i++];
+		} else {
+			merged[nmerged++] = fresh[j++];
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		save_feed(merged, nmerged);
+		generate_feed(merged, nmerged);
+	}
+
+	for (i = 0; i < nold; i++)
+		free_entry(&old[i]);
+	for (j = 0; j < nfresh; j++)
+		free_entry(&fresh[j]);
+	nfresh = 0;
+}
+
+/* Writes the feed from smak/feed alone, e.g. after its settings changed. */
+void
+rebuild_feed(void)
+{
+	struct feedent ents[FEED_ENTRIES];
+	size_t count, i;
+
+	if ((count = load_feed(ents)))
+		generate_feed(ents, count);
+	for (i = 0; i < count; i++)
+		free_entry(&ents[i]);
+}
@@ -0,0 +1,20 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <time.h>
+
+/* A message in the feed. The strings are owned by the feed. */
+struct feedent {
+	time_t time;
+	char  *uniq;
+	char  *subject;
+	char  *from;
+};
+
+/* Offers a freshly archived message to the feed. Only the FEED_ENTRIES
+ * newest messages of a run are kept. Not thread-safe. */
+void add_to_feed(time_t time, const char *uniq, const char *subject, const char *from);
+/* Merges the messages of this run into smak/feed and regenerates
+ * the feed if it changed. */
+void update_feed(void);
+/* Regenerates the feed from smak/feed. */
+void rebuild_feed(void);
@@ -0,0 +1,261 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Persistent hash tables
+ *
+ * A hash table file is mapped into memory and uses open addressing with
+ * linear probing. It only stores hashes and values, never the keys, so
+ * several values may share a hash. There is no removal.
+ *
+ * Once a table is half full, a table of twice the size is created next to
+ * it, with ".grow" appended to its name. From then on, all insertions go
+ * to the new table, and every insertion also moves a few slots of the old
+ * table over. Lookups consult both tables until the old one is empty and
+ * the new one is renamed over it. This way, growing the table never stalls
+ * a run, and an interrupted growth simply continues the next time.
+ *
+ * The file begins with a 64 byte header: the magic "smakhtb\0", a 32 bit
+ * format version, 32 reserved bits, the 64 bit slot count, the 64 bit
+ * number of used slots, the 64 bit growth cursor, i.e. the number of old
+ * slots that have already been moved to this table, and the 64 bit mark
+ * that the caller may use as it likes. Each slot is a
+ * 64 bit hash (zero for empty slots) followed by a 64 bit value. Like
+ * everything in smak/, the integers are stored in little-endian order.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "hashtab.h"
+
+#define HT_MAGIC     "smakhtb"
+#define HT_VERSION   1
+#define HT_HEADER    64
+#define HT_SLOT      16
+#define HT_MINSLOTS  1024
+/* Old slots moved to the growing table per insertion. Anything above 2
+ * guarantees that the move is finished before the new table is half full. */
+#define HT_MOVESLOTS 8
+
+#define NSLOTS(t)  get_le64((t) + 16)
+#define NUSED(t)   get_le64((t) + 24)
+#define CURSOR(t)  get_le64((t) + 32)
+#define MARK(t)    get_le64((t) + 40)
+#define SLOT(t, i) ((t) + HT_HEADER + (i) * HT_SLOT)
+
+static size_t
+table_size(const unsigned char *t)
+{
+	return HT_HEADER + NSLOTS(t) * HT_SLOT;
+}
+
+static unsigned char *
+map_table(const char *path)
+{
+	struct stat meta;
+	unsigned char *t;
+	int fd;
+
+	if ((fd = open(path, O_RDWR)) < 0) {
+		if (errno == ENOENT) return NULL;
+		die("cannot open '%s':", path);
+	}
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (meta.st_size < HT_HEADER)
+		die("hash table '%s' is corrupt.", path);
+	t = mmap(NULL, meta.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (t == MAP_FAILED)
+		die("mmap():");
+	close(fd);
+
+	if (memcmp(t, HT_MAGIC, 8) || get_le32(t + 8) != HT_VERSION)
+		die("hash table '%s' has an unknown format.", path);
+	if ((size_t) meta.st_size != table_size(t) || NSLOTS(t) & (NSLOTS(t) - 1))
+		die("hash table '%s' is corrupt.", path);
+	return t;
+}
+
+/* The table is prepared under a temporary name, so that
+ * it never becomes visible only partially initialized. */
+static unsigned char *
+create_table(const char *path, size_t nslots, uint64_t mark)
+{
+	unsigned char hdr[HT_HEADER] = { 0 };
+	char tmppath[80];
+	int fd;
+
+	if (snprintf(tmppath, sizeof tmppath, "%s.tmp", path) >= (int) sizeof tmppath)
+		die("file path is too long.");
+	if ((fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot create '%s':", tmppath);
+	memcpy(hdr, HT_MAGIC, 8);
+	put_le32(hdr + 8, HT_VERSION);
+	put_le64(hdr + 16, nslots);
+	put_le64(hdr + 40, mark);
+	check_write(fd, hdr, sizeof hdr);
+	if (ftruncate(fd, HT_HEADER + nslots * HT_SLOT) < 0)
+		die("ftruncate():");
+	close(fd);
+	if (rename(tmppath, path) < 0)
+		die("rename():");
+	return map_table(path);
+}
+
+static void
+grow_path(const struct hashtab *ht, char *buf, size_t size)
+{
+	if (snprintf(buf, size, "%s.grow", ht->path) >= (int) size)
+		die("file path is too long.");
+}
+
+bool
+hashtab_open(struct hashtab *ht, const char *path)
+{
+	char gpath[80];
+	bool created = false;
+
+	if (snprintf(ht->path, sizeof ht->path, "%s", path) >= (int) sizeof ht->path)
+		die("file path is too long.");
+	if (!(ht->main = map_table(path))) {
+		ht->main = create_table(path, HT_MINSLOTS, 0);
+		created = true;
+	}
+	grow_path(ht, gpath, sizeof gpath);
+	ht->grow = map_table(gpath);
+	return created;
+}
+
+void
+hashtab_close(struct hashtab *ht)
+{
+	munmap(ht->main, table_size(ht->main));
+	if (ht->grow)
+		munmap(ht->grow, table_size(ht->grow));
+	ht->main = ht->grow = NULL;
+}
+
+static bool
+probe(const unsigned char *t, uint64_t hash, size_t *step, size_t skip, uint64_t *value)
+{
+	size_t mask = NSLOTS(t) - 1, pos;
+	const unsigned char *s;
+	uint64_t h;
+
+	for (;; (*step)++) {
+		pos = (hash + *step) & mask;
+		s = SLOT(t, pos);
+		if (!(h = get_le64(s)))
+			return false;
+		if (h == hash && pos >= skip) {
+			*value = get_le64(s + 8);
+			(*step)++;
+			return true;
+		}
+	}
+}
+
+static void
+put(unsigned char *t, uint64_t hash, uint64_t value)
+{
+	size_t mask = NSLOTS(t) - 1, pos = hash & mask;
+	unsigned char *s;
+
+	while (get_le64(s = SLOT(t, pos)))
+		pos = (pos + 1) & mask;
+	put_le64(s + 8, value);
+	put_le64(s, hash);
+	put_le64(t + 24, NUSED(t) + 1);
+}
+
+static bool
+contains(const unsigned char *t, uint64_t hash, uint64_t value)
+{
+	size_t step = 0;
+	uint64_t v;
+	while (probe(t, hash, &step, 0, &v)) {
+		if (v == value) return true;
+	}
+	return false;
+}
+
+/* Moves slots from the old table into the growing one. A slot that got
+ * copied right before an interruption may be seen twice, hence contains(). */
+static void
+move_slots(struct hashtab *ht, size_t count)
+{
+	char gpath[80];
+	const unsigned char *s;
+	size_t cursor = CURSOR(ht->grow);
+
+	for (; count && cursor < NSLOTS(ht->main); count--, cursor++) {
+		s = SLOT(ht->main, cursor);
+		if (get_le64(s) && !contains(ht->grow, get_le64(s), get_le64(s + 8)))
+			put(ht->grow, get_le64(s), get_le64(s + 8));
+	}
+	put_le64(ht->grow + 32, cursor);
+
+	if (cursor == NSLOTS(ht->main)) {
+		grow_path(ht, gpath, sizeof gpath);
+		if (rename(gpath, ht->path) < 0)
+			die("rename():");
+		munmap(ht->main, table_size(ht->main));
+		ht->main = ht->grow;
+		ht->grow = NULL;
+		put_le64(ht->main + 32, 0);
+	}
+}
+
+void
+hashtab_insert(struct hashtab *ht, uint64_t hash, uint64_t value)
+{
+	char gpath[80];
+
+	if (!hash) hash = 1; /* zero marks empty slots */
+
+	if (!ht->grow && 2 * NUSED(ht->main) >= NSLOTS(ht->main)) {
+		grow_path(ht, gpath, sizeof gpath);
+		ht->grow = create_table(gpath, 2 * NSLOTS(ht->main), MARK(ht->main));
+	}
+	if (ht->grow) {
+		put(ht->grow, hash, value);
+		move_slots(ht, HT_MOVESLOTS);
+	} else {
+		put(ht->main, hash, value);
+	}
+}
+
+uint64_t
+hashtab_mark(const struct hashtab *ht)
+{
+	return MARK(ht->main);
+}
+
+void
+hashtab_set_mark(struct hashtab *ht, uint64_t mark)
+{
+	put_le64(ht->main + 40, mark);
+	if (ht->grow)
+		put_le64(ht->grow + 40, mark);
+}
+
+bool
+hashtab_find(const struct hashtab *ht, uint64_t hash, struct htiter *it, uint64_t *value)
+{
+	if (!hash) hash = 1;
+
+	if (it->stage == 0) {
+		if (ht->grow && probe(ht->grow, hash, &it->step, 0, value))
+			return true;
+		it->stage = 1;
+		it->step = 0;
+	}
+	/* old slots below the cursor are already in the growing table */
+	return probe(ht->main, hash, &it->step, ht->grow ? CURSOR(ht->grow) : 0, value);
+}
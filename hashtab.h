@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HTITER_INIT (struct htiter) { 0, 0 }
+
+/* A persistent hash table that maps 64 bit hashes to 64 bit values. */
+struct hashtab {
+	char path[64];
+	unsigned char *main;
+	unsigned char *grow;
+};
+
+/* Position of a lookup, so that all values of a hash can be visited. */
+struct htiter {
+	int    stage;
+	size_t step;
+};
+
+/* Returns true if the table did not exist yet and was created empty. */
+bool hashtab_open(struct hashtab *ht, const char *path);
+void hashtab_close(struct hashtab *ht);
+void hashtab_insert(struct hashtab *ht, uint64_t hash, uint64_t value);
+/* Every table carries one number for the caller's own bookkeeping. */
+uint64_t hashtab_mark(const struct hashtab *ht);
+void hashtab_set_mark(struct hashtab *ht, uint64_t mark);
+/* Yields the next value stored under hash. Keys are not stored,
+ * so callers have to verify that the value is really what they want. */
+bool hashtab_find(const struct hashtab *ht, uint64_t hash, struct htiter *it, uint64_t *value);
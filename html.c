@@ -1,143 +1,843 @@
 /* See LICENSE file for copyright and license details. */
 
+#define _GNU_SOURCE /* copy_file_range() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
+#include "mail.h"
+#include "charset.h"
 #include "util.h"
+#include "out.h"
+#include "simd.h"
+#include "stats.h"
 #include "smakdir.h"
+#include "author.h"
+#include "feed.h"
+#include "thread.h"
+#include "tmpl.h"
+
+enum {
+	TMSG,
+	TPARENT,
+	TTEXT,
+	TATTACHMENTS,
+	TATTACHMENT,
+	TREPLIES,
+	TREPLY,
+	TREPORT,
+	TREPORTROW,
+	TAUTHORLINK,
+	TAUTHOR,
+	TAUTHORROW,
+	TOVERVIEW,
+	TMONTH,
+	NUMTEMPLATES
+};
+
+enum {
+	STITLE,
+	SSUBJECT,
+	SFROM,
+	SDATE,
+	SUNIQ,
+	SNAME,
+	SID,
+	SCOUNT,
+	SMONTH,
+	SPARENT,
+	SBODY,
+	STEXT,
+	SATTACHMENTS,
+	SREPLIES,
+	SITEMS,
+	SAUTHOR,
+	SPAGE,
+	NUMSLOTS
+};
+
+static const char *const slot_names[NUMSLOTS] = {
+	[STITLE]       = "title",
+	[SSUBJECT]     = "subject",
+	[SFROM]        = "from",
+	[SDATE]        = "date",
+	[SUNIQ]        = "uniq",
+	[SNAME]        = "name",
+	[SID]          = "id",
+	[SCOUNT]       = "count",
+	[SMONTH]       = "month",
+	[SPARENT]      = "parent",
+	[SBODY]        = "body",
+	[STEXT]        = "text",
+	[SATTACHMENTS] = "attachments",
+	[SREPLIES]     = "replies",
+	[SITEMS]       = "items",
+	[SAUTHOR]      = "author",
+	[SPAGE]        = "page",
+};
 
 #define CONFIG_HTML
 #include "config.h"
 
-extern char *aether_base;
-extern char *aether_cursor;
+extern _Thread_local char *aether_base;
+extern _Thread_local char *aether_cursor;
 
+/* Runs at least this long are referenced in place instead of being copied. */
+#define REF_THRESHOLD 512
+/* longest character that can be cut off at the end of a piece */
+#define CARRY 16
+/* Bumped whenever smak changes its pages in a way that the templates
+ * don't show, so that all of them are rebuilt. */
+#define PAGE_FORMAT 2
+
+/* Long runs of mem are only referenced by ob, so mem has to stay
+ * unchanged until the next out_flush(). */
 static void
-encode_html(int fd, const char *mem, size_t length)
+encode_html(struct outbuf *ob, const char *mem, size_t length)
 {
-	char buf[4096];
-	char *w = buf;
 	size_t idx = 0, run;
 
 	for (;;) {
-		run = mem_cspn(mem + idx, length - idx, "<>&\"\0", 5);
-		if ((w - buf) + run > sizeof buf - 16) {
-			check_write(fd, buf, w - buf);
-			w = buf;
-		}
-		if (run > sizeof buf - 16) {
-			check_write(fd, mem + idx, run);
+		run = scan_html(mem + idx, length - idx);
+		if (run >= REF_THRESHOLD) {
+			out_ref(ob, mem + idx, run);
 		} else {
-			memcpy(w, mem + idx, run);
-			w += run;
+			out_write(ob, mem + idx, run);
 		}
 		idx += run;
 		if (idx == length) break;
 
 		switch (mem[idx++]) {
-		case '<': w = stpcpy(w, "&lt;"); break;
-		case '>': w = stpcpy(w, "&gt;"); break;
-		case '&': w = stpcpy(w, "&amp;"); break;
-		case '"': w = stpcpy(w, "&quot;"); break;
-		default:  w = stpcpy(w, "?");
+		case '<': out_write(ob, "&lt;", 4); break;
+		case '>': out_write(ob, "&gt;", 4); break;
+		case '&': out_write(ob, "&amp;", 5); break;
+		case '"': out_write(ob, "&quot;", 6); break;
+		default:  out_write(ob, "?", 1);
 		}
 	}
-	if (w > buf) check_write(fd, buf, w - buf);
 }
 
+/* In the links of gph files, '|' separates the fields. */
+static void
+encode_gph(struct outbuf *ob, const char *mem, size_t length)
+{
+	const char *bar;
+
+	while ((bar = memchr(mem, '|', length))) {
+		out_write(ob, mem, bar - mem);
+		out_write(ob, "\\|", 2);
+		length -= bar + 1 - mem;
+		mem = bar + 1;
+	}
+	out_write(ob, mem, length);
+}
+
+/* Text is shown in 't' lines, so every line after a newline gets a 't'.
+ * The template has to supply the one of the first line. */
+static void
+encode_gph_text(struct outbuf *ob, const char *mem, size_t length)
+{
+	const char *nl;
+
+	while ((nl = memchr(mem, '\n', length))) {
+		out_write(ob, mem, nl + 1 - mem);
+		out_write(ob, "t", 1);
+		length -= nl + 1 - mem;
+		mem = nl + 1;
+	}
+	out_write(ob, mem, length);
+}
+
+/* An output format: the file extension of its pages, how it escapes
+ * fields and text, and its templates. */
+struct backend {
+	const char *ext;
+	encoder field;
+	encoder text;
+	const char **src;
+	struct template tmpl[NUMTEMPLATES];
+};
+
+static struct backend backends[] = {
+	{ ".html", encode_html, encode_html, html_templates, { { 0 } } },
+	{ ".gph",  encode_gph,  encode_gph_text, gph_templates, { { 0 } } },
+};
+static int nbackends;
+
 void
-generate_html(const char *uniq, const char *info[], char *body, size_t length)
+init_templates(void)
+{
+	int b, t;
+
+	nbackends = gopher ? 2 : 1;
+	for (b = 0; b < nbackends; b++) {
+		for (t = 0; t < NUMTEMPLATES; t++)
+			compile_template(&backends[b].tmpl[t], backends[b].src[t], slot_names, NUMSLOTS);
+	}
+}
+
+/* The templates that the pages of each kind are made of.
+ * The feed is not made from templates. */
+static const int page_templates[NUMPAGEKINDS][8] = {
+	[PMESSAGES] = { TMSG, TPARENT, TTEXT, TATTACHMENTS, TATTACHMENT, TREPLIES, TREPLY, -1 },
+	[PREPORTS]  = { TREPORT, TREPORTROW, TAUTHORLINK, -1 },
+	[PAUTHORS]  = { TAUTHOR, TAUTHORROW, TAUTHORLINK, -1 },
+	[POVERVIEW] = { TOVERVIEW, TMONTH, -1 },
+};
+
+static const char *const layout_names[] = {
+	[LAYOUT_FLAT]  = "flat",
+	[LAYOUT_HASH]  = "hash",
+	[LAYOUT_MONTH] = "month",
+};
+
+/* Hashes everything that the pages of a kind depend on, other than the
+ * records and reports: their templates, the backends and the settings. */
+uint64_t
+page_version(enum pagekind kind)
+{
+	uint64_t hash = PAGE_FORMAT;
+	const char *src;
+	int b, i;
+
+	/* all but the overview link to message pages */
+	if (kind != POVERVIEW)
+		hash = hash_bytes(layout_names[LAYOUT], strlen(layout_names[LAYOUT]) + 1, hash);
+	if (kind == PFEED) {
+		hash = hash_bytes(feed_url, strlen(feed_url) + 1, hash);
+		return hash_bytes(feed_title, strlen(feed_title) + 1, hash);
+	}
+	for (b = 0; b < nbackends; b++) {
+		hash = hash_bytes(backends[b].ext, strlen(backends[b].ext) + 1, hash);
+		for (i = 0; page_templates[kind][i] >= 0; i++) {
+			src = backends[b].src[page_templates[kind][i]];
+			hash = hash_bytes(src, strlen(src) + 1, hash);
+		}
+	}
+	return hash;
+}
+
+/* Writes the directory of the page of a message under www/, with a
+ * trailing slash, or nothing if it is right in www/. */
+void
+page_dir(char *dir, enum layout layout, const char *uniq, time_t time)
+{
+	uint64_t hash;
+	struct tm tm;
+
+	switch (layout) {
+	case LAYOUT_HASH:
+		/* the upper bits of FNV-1a are mixed best */
+		hash = hash_bytes(uniq, strlen(uniq), 0);
+		snprintf(dir, PAGE_DIR_MAX, "%02x/%02x/", (unsigned) (hash >> 56), (unsigned) (hash >> 48 & 0xff));
+		break;
+	case LAYOUT_MONTH:
+		gmtime_r(&time, &tm);
+		snprintf(dir, PAGE_DIR_MAX, "%04d/%02d/", tm.tm_year + 1900, tm.tm_mon + 1);
+		break;
+	default:
+		*dir = '\0';
+	}
+}
+
+static void
+render(struct outbuf *ob, const struct backend *be, int tmpl, const struct slot *slots)
+{
+	render_template(ob, &be->tmpl[tmpl], slots, be->field, be);
+}
+
+static struct slot
+field(const char *str, size_t len)
+{
+	return (struct slot) { str, len, NULL, NULL };
+}
+
+static struct slot
+string(const char *str)
+{
+	return field(str, strlen(str));
+}
+
+/* The link to the page of a message, from a message page if from_msg is
+ * set, or from a page right in www/ otherwise. buf holds the link. */
+static struct slot
+page_link(char *buf, const char *uniq, time_t time, bool from_msg)
+{
+	char dir[PAGE_DIR_MAX];
+	int len;
+
+	page_dir(dir, LAYOUT, uniq, time);
+	len = snprintf(buf, MAX_FILENAME_LENGTH, "%s%s%s", from_msg && *dir ? "../../" : "", dir, uniq);
+	if (len >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	return field(buf, len);
+}
+
+static struct slot
+list(void (*render)(struct outbuf *, const void *, const void *), const void *arg)
+{
+	return (struct slot) { NULL, 0, render, arg };
+}
+
+/* Parts that are still in the file are read and decoded in pieces of
+ * STREAM_CHUNK bytes, so they never have to be in memory all at once.
+ * Text parts are converted to UTF-8 as well, which makes a piece at most
+ * four times longer.
+ * A part that turns out to be malformed just ends early, because its
+ * message has been archived already at this point. */
+struct pieces {
+	int    fd;
+	const char *mem;  /* where to read from instead, if fd is -1 */
+	char  *buf;       /* CARRY bytes into a buffer of STREAM_CHUNK */
+	char  *conv;      /* output of the charset conversion */
+	size_t left, fill, rest;
+	struct bodydec dec;
+	const struct charset *cs;
+	char   carry[CARRY]; /* start of a character cut off by the last piece */
+	size_t ncarry;
+};
+
+static void
+open_pieces(struct pieces *pc, const struct body *body, const struct part *part, char **buf)
+{
+	if (body->fd >= 0 && lseek(body->fd, part->offset, SEEK_SET) < 0)
+		die("lseek():");
+	if (!*buf) *buf = aether_alloc(CARRY + STREAM_CHUNK + 4 * STREAM_CHUNK);
+	pc->fd   = body->fd;
+	pc->mem  = body->fd < 0 ? body->text + part->offset : NULL;
+	pc->buf  = *buf + CARRY;
+	pc->conv = pc->buf + STREAM_CHUNK;
+	pc->left = part->length;
+	pc->fill = pc->rest = 0;
+	pc->dec  = (struct bodydec) { .tenc = part->tenc };
+	pc->cs   = part->text ? find_charset(part->charset) : NULL;
+	pc->ncarry = 0;
+}
+
+static bool
+next_piece(struct pieces *pc, char **mem, size_t *length)
+{
+	char *end, *start;
+	size_t n, used;
+
+	if (!pc->left) return false;
+	memmove(pc->buf, pc->buf + pc->fill - pc->rest, pc->rest);
+	pc->fill = pc->rest;
+	n = pc->left < STREAM_CHUNK - pc->fill ? pc->left : STREAM_CHUNK - pc->fill;
+	if (pc->mem) {
+		memcpy(pc->buf + pc->fill, pc->mem, n);
+		pc->mem += n;
+		pc->fill += n;
+	} else {
+		pc->fill += check_read(pc->fd, pc->buf + pc->fill, n);
+	}
+	pc->left -= n;
+	if (!(end = decode_piece(&pc->dec, pc->buf, pc->fill, !pc->left, &pc->rest)))
+		return false;
+	*mem = pc->buf;
+	*length = end - pc->buf;
+	count_stat(CTDECODED, *length);
+	if (!pc->cs || (!pc->ncarry && !must_convert(pc->cs, *mem, *length)))
+		return true;
+
+	/* the decoder leaves the CARRY bytes in front of buf alone */
+	start = pc->buf - pc->ncarry;
+	memcpy(start, pc->carry, pc->ncarry);
+	*mem = pc->conv;
+	*length = convert_charset(pc->cs, start, end - start, pc->conv, 4 * STREAM_CHUNK, &used);
+	pc->ncarry = end - start - used < CARRY ? end - start - used : 0;
+	memcpy(pc->carry, start + used, pc->ncarry);
+	return true;
+}
+
+static void
+encode_part(struct outbuf *ob, encoder encode, const struct body *body, const struct part *part, char **buf)
+{
+	struct pieces pc;
+	char *mem;
+	size_t length;
+
+	if (part->mem) {
+		encode(ob, part->mem, part->length);
+		return;
+	}
+	open_pieces(&pc, body, part, buf);
+	while (next_piece(&pc, &mem, &length)) {
+		encode(ob, mem, length);
+		/* the encoder may still refer to the buffer */
+		out_flush(ob);
+	}
+}
+
+static bool
+safe_extension(const char *ext)
+{
+	int i;
+
+	for (i = 0; safe_extensions[i]; i++) {
+		if (!strcasecmp(ext, safe_extensions[i])) return true;
+	}
+	return false;
+}
+
+/* Attachments are saved as www/<uniq>/<n>-<filename>, where n counts the
+ * attachments of the message. Only a safe subset of the characters of the
+ * given filename is used, and of its dots only the last one, which has
+ * to start a safe extension. Otherwise, ".bin" is appended. */
+static void
+attachment_name(const struct part *part, size_t n, char *name)
+{
+	const char *fn = part->filename, *c;
+	char *w, *dot = NULL;
+
+	if (fn && (c = strrchr(fn, '/')))  fn = c + 1;
+	if (fn && (c = strrchr(fn, '\\'))) fn = c + 1;
+	if (!fn || !*fn) fn = "part";
+
+	w = name + sprintf(name, "%zu-", n);
+	for (c = fn; *c && w - name < 100; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')
+		|| *c == '-' || *c == '_' || *c == '+') {
+			*w++ = *c;
+		} else if (*c == '.') {
+			if (dot) *dot = '_';
+			dot = w;
+			*w++ = *c;
+		} else {
+			*w++ = '_';
+		}
+	}
+	*w = '\0';
+	if (!dot || !safe_extension(dot + 1))
+		strcpy(w, ".bin");
+}
+
+static int
+create_page(char *tmppath)
 {
-	char tmppath[MAX_FILENAME_LENGTH];
-	char wwwpath[MAX_FILENAME_LENGTH];
-	time_t time;
-	char date[100];
 	int fd;
 
 	strcpy(tmppath, "tmp_www_XXXXXX");
 	if ((fd = mkstemp(tmppath)) < 0)
 		die("cannot create temporary file:");
-	if (chmod(tmppath, 0640) < 0)
-		die("chmod():");
-	if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%s.html", uniq) >= MAX_FILENAME_LENGTH)
-		die("file path is too long.");
+	if (fchmod(fd, 0640) < 0)
+		die("fchmod():");
+	return fd;
+}
 
-	time = atoll(info[MTIME]);
-	strftime(date, sizeof date, "%Y-%m-%d %T", gmtime(&time));
-
-	dprintf(fd, "%s", html_header1);
-	encode_html(fd, info[MSUBJECT], strlen(info[MSUBJECT]));
-	dprintf(fd, "%s", html_header2);
-	dprintf(fd, "<h1>");
-	encode_html(fd, info[MSUBJECT], strlen(info[MSUBJECT]));
-	dprintf(fd, "</h1>\n");
-	dprintf(fd, "<b>From:</b> ");
-	encode_html(fd, info[MFROM], strlen(info[MFROM]));
-	dprintf(fd, "<br/>\n<b>Date:</b> ");
-	encode_html(fd, date, strlen(date));
-	dprintf(fd, "<br/>\n<hr/>\n<pre>");
-	encode_html(fd, body, length);
-	dprintf(fd, "</pre>\n%s", html_footer);
-
-	close(fd);
+/* The directory of a page is only made once it turns out to be missing. */
+static void
+move_page(const char *tmppath, char *wwwpath)
+{
+	char *slash;
+
+	if (!rename(tmppath, wwwpath)) return;
+	if (errno != ENOENT || !(slash = strrchr(wwwpath, '/')))
+		die("rename():");
+	*slash = '\0';
+	make_dir(wwwpath);
+	*slash = '/';
 	if (rename(tmppath, wwwpath) < 0)
 		die("rename():");
 }
 
+static void
+finish_page(struct outbuf *ob, const char *tmppath, char *wwwpath)
+{
+	out_flush(ob);
+	close(ob->fd);
+	move_page(tmppath, wwwpath);
+}
+
+/* what the list slots of a message page need */
+struct msgctx {
+	const char *uniq;
+	const struct threadnav *nav;
+	const struct body *body;
+	const struct part *part; /* the text part that is being rendered */
+	char **buf;
+};
+
+static void
+render_text(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct backend *be = ctx;
+	const struct msgctx *mc = arg;
+
+	encode_part(ob, be->text, mc->body, mc->part, mc->buf);
+}
+
+static void
+render_body(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	struct msgctx mc = *(const struct msgctx *) arg;
+	struct slot slots[NUMSLOTS] = { 0 };
+	size_t i;
+
+	slots[STEXT] = list(render_text, &mc);
+	for (i = 0; i < mc.body->nparts; i++) {
+		if (!mc.body->parts[i].text) continue;
+		mc.part = &mc.body->parts[i];
+		render(ob, ctx, TTEXT, slots);
+	}
+}
+
+static void
+render_attachments(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct msgctx *mc = arg;
+	struct slot slots[NUMSLOTS] = { 0 };
+	char name[MAX_FILENAME_LENGTH];
+	size_t i, n;
+
+	slots[SUNIQ] = string(mc->uniq);
+	for (i = 0, n = 0; i < mc->body->nparts; i++) {
+		if (mc->body->parts[i].text) continue;
+		attachment_name(&mc->body->parts[i], ++n, name);
+		slots[SNAME] = string(name);
+		render(ob, ctx, TATTACHMENT, slots);
+	}
+}
+
+static void
+render_replies(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct msgctx *mc = arg;
+	const struct navlink *reply;
+	struct slot slots[NUMSLOTS] = { 0 };
+	char page[MAX_FILENAME_LENGTH];
+	size_t i;
+
+	for (i = 0; i < mc->nav->nreplies; i++) {
+		reply = &mc->nav->replies[i];
+		slots[SUNIQ] = string(reply->uniq);
+		slots[SPAGE] = page_link(page, reply->uniq, reply->time, true);
+		slots[SSUBJECT] = string(reply->subject);
+		render(ob, ctx, TREPLY, slots);
+	}
+}
+
+static void
+render_parent(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct navlink *parent = arg;
+	struct slot slots[NUMSLOTS] = { 0 };
+	char page[MAX_FILENAME_LENGTH];
+
+	slots[SUNIQ] = string(parent->uniq);
+	slots[SPAGE] = page_link(page, parent->uniq, parent->time, true);
+	slots[SSUBJECT] = string(parent->subject);
+	render(ob, ctx, TPARENT, slots);
+}
+
+/* a template that only consists of a list */
+static void
+render_wrapped(struct outbuf *ob, const void *ctx, int tmpl, struct slot items)
+{
+	struct slot slots[NUMSLOTS] = { 0 };
+
+	slots[SITEMS] = items;
+	render(ob, ctx, tmpl, slots);
+}
+
+static void
+render_attachment_list(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	render_wrapped(ob, ctx, TATTACHMENTS, list(render_attachments, arg));
+}
+
+static void
+render_reply_list(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	render_wrapped(ob, ctx, TREPLIES, list(render_replies, arg));
+}
+
 void
-generate_html_report(const struct report *rpt)
+generate_html(const char *uniq, const char *info[], const struct threadnav *nav, const struct body *body)
+{
+	char tmppath[MAX_FILENAME_LENGTH];
+	char wwwpath[MAX_FILENAME_LENGTH];
+	char dir[PAGE_DIR_MAX];
+	char *mark = aether_cursor, *buf = NULL;
+	time_t time = atoll(info[MTIME]);
+	struct msgctx mc = { uniq, nav, body, NULL, &buf };
+	struct slot slots[NUMSLOTS] = { 0 };
+	struct outbuf ob;
+	struct tm tm;
+	char date[100];
+	size_t i, nattach = 0;
+	int b;
+
+	page_dir(dir, LAYOUT, uniq, time);
+	strftime(date, sizeof date, "%Y-%m-%d %T", gmtime_r(&time, &tm));
+	for (i = 0; i < body->nparts; i++)
+		nattach += !body->parts[i].text;
+
+	slots[SSUBJECT] = string(info[MSUBJECT]);
+	slots[SFROM] = string(info[MFROM]);
+	slots[SDATE] = string(date);
+	if (nav->parent.uniq)
+		slots[SPARENT] = list(render_parent, &nav->parent);
+	slots[SBODY] = list(render_body, &mc);
+	if (nattach)
+		slots[SATTACHMENTS] = list(render_attachment_list, &mc);
+	if (nav->nreplies)
+		slots[SREPLIES] = list(render_reply_list, &mc);
+
+	for (b = 0; b < nbackends; b++) {
+		if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%s%s%s", dir, uniq, backends[b].ext) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		out_init(&ob, create_page(tmppath));
+		render(&ob, &backends[b], TMSG, slots);
+		finish_page(&ob, tmppath, wwwpath);
+	}
+	aether_cursor = mark;
+}
+
+/* Copies length bytes at offset of one file to another, without going
+ * through userspace. */
+static void
+copy_range(int in, off_t offset, size_t length, int out)
+{
+	ssize_t ret;
+
+	while (length) {
+		ret = copy_file_range(in, &offset, out, NULL, length, 0);
+		/* not supported between these files, e.g. on old kernels */
+		if (ret < 0 && errno != EINTR)
+			ret = sendfile(out, in, &offset, length);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			die("sendfile():");
+		}
+		if (!ret)
+			die("message file got shorter.");
+		length -= ret;
+	}
+}
+
+/* Saves all parts that are not shown on the page of the message. Parts
+ * without a transfer encoding are copied between the files directly.
+ * Unless replace is set, attachments that exist already are kept. */
+void
+generate_attachments(const char *uniq, time_t time, const struct body *body, bool replace)
 {
 	char tmppath[MAX_FILENAME_LENGTH];
 	char wwwpath[MAX_FILENAME_LENGTH];
-	const char *info[MNUMINFO];
+	char name[MAX_FILENAME_LENGTH];
+	char dir[PAGE_DIR_MAX];
+	char *mark = aether_cursor, *buf = NULL, *mem;
+	const struct part *part;
+	struct pieces pc;
+	size_t i, n, length;
 	int fd;
+
+	for (i = 0, n = 0; i < body->nparts; i++) {
+		part = &body->parts[i];
+		if (part->text) continue;
+		if (!n++) {
+			page_dir(dir, LAYOUT, uniq, time);
+			if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%s%s", dir, uniq) >= MAX_FILENAME_LENGTH)
+				die("file path is too long.");
+			make_dir(wwwpath);
+		}
+		attachment_name(part, n, name);
+		if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%s%s/%s", dir, uniq, name) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		if (!replace && !access(wwwpath, F_OK))
+			continue;
+		fd = create_page(tmppath);
+
+		if (!part->tenc && body->fd < 0) {
+			check_write(fd, body->text + part->offset, part->length);
+		} else if (!part->tenc) {
+			copy_range(body->fd, part->offset, part->length, fd);
+		} else {
+			open_pieces(&pc, body, part, &buf);
+			while (next_piece(&pc, &mem, &length))
+				check_write(fd, mem, length);
+		}
+
+		close(fd);
+		move_page(tmppath, wwwpath);
+	}
+	aether_cursor = mark;
+}
+
+/* what the rows of a report page need */
+struct rowctx {
+	const struct report *rpt;
+	int tmpl;
+};
+
+static void
+render_author(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct backend *be = ctx;
+	const struct field *from = arg;
+	struct slot slots[NUMSLOTS] = { 0 };
+	char id[32];
+	AUTHOR author;
+
+	if (!(author = lookup_author(from->str, from->len))) {
+		be->field(ob, from->str, from->len);
+		return;
+	}
+	snprintf(id, sizeof id, "%u", (unsigned) author);
+	slots[SID] = string(id);
+	slots[SFROM] = field(from->str, from->len);
+	render(ob, ctx, TAUTHORLINK, slots);
+}
+
+/* The rows are rendered newest first. */
+static void
+render_rows(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct rowctx *rc = arg;
+	struct slot slots[NUMSLOTS] = { 0 };
+	struct record rec;
+	struct tm tm;
+	char date[200], page[MAX_FILENAME_LENGTH];
 	size_t i;
-	MSG msg;
-	char *aether_checkpoint;
-	time_t time;
-	struct tm *tm;
-	char date[200];
 
-	strcpy(tmppath, "tmp_www_XXXXXX");
-	if ((fd = mkstemp(tmppath)) < 0)
-		die("cannot create temporary file:");
-	if (chmod(tmppath, 0640) < 0)
-		die("chmod():");
-	if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%04d-%02d.html", rpt->year, rpt->month) >= MAX_FILENAME_LENGTH)
-		die("file path is too long.");
+	for (i = rc->rpt->count; i--;) {
+		read_from_log(report_msg(rc->rpt, i), &rec);
+		strftime(date, sizeof date, "%Y-%m-%d %T", gmtime_r(&rec.time, &tm));
+		slots[SDATE] = string(date);
+		slots[SUNIQ] = field(rec.info[MUNIQ].str, rec.info[MUNIQ].len);
+		slots[SPAGE] = page_link(page, rec.info[MUNIQ].str, rec.time, false);
+		slots[SSUBJECT] = field(rec.info[MSUBJECT].str, rec.info[MSUBJECT].len);
+		slots[SFROM] = field(rec.info[MFROM].str, rec.info[MFROM].len);
+		slots[SAUTHOR] = list(render_author, &rec.info[MFROM]);
+		render(ob, ctx, rc->tmpl, slots);
+	}
+}
+
+/* Writes a page with every backend. name is the path under www/ without
+ * the extension. */
+static void
+generate_pages(const char *name, int tmpl, const struct slot *slots)
+{
+	char tmppath[MAX_FILENAME_LENGTH];
+	char wwwpath[MAX_FILENAME_LENGTH];
+	struct outbuf ob;
+	int b;
+
+	for (b = 0; b < nbackends; b++) {
+		if (snprintf(wwwpath, MAX_FILENAME_LENGTH, "www/%s%s", name, backends[b].ext) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		out_init(&ob, create_page(tmppath));
+		render(&ob, &backends[b], tmpl, slots);
+		finish_page(&ob, tmppath, wwwpath);
+	}
+}
 
-	dprintf(fd, "%s%04d-%02d", html_header1, rpt->year, rpt->month);
-	dprintf(fd, "%s\n<table>\n", html_header2);
-	dprintf(fd, "<tr>\n<th>Date</th>\n<th>Subject</th>\n<th>Author</th>\n</tr>\n");
-	for (i = rpt->count; i--;) { /* count backwards so newest msgs are on top */
-		aether_checkpoint = aether_cursor;
+void
+generate_html_report(const struct report *rpt)
+{
+	struct rowctx rc = { rpt, TREPORTROW };
+	struct slot slots[NUMSLOTS] = { 0 };
+	char title[32];
 
-		msg = rpt->entries[i].msg;
-		read_from_log(msg, info);
+	snprintf(title, sizeof title, "%04d-%02d", rpt->year, rpt->month);
+	slots[STITLE] = string(title);
+	slots[SITEMS] = list(render_rows, &rc);
+	generate_pages(title, TREPORT, slots);
+}
 
-		time = atoll(info[MTIME]);
-		tm = gmtime(&time);
-		strftime(date, sizeof date, "%Y-%m-%d %T", tm);
+/* Writes the Atom feed from the entries alone. There is at least one. */
+void
+generate_feed(const struct feedent *ents, size_t count)
+{
+	char tmppath[MAX_FILENAME_LENGTH];
+	char wwwpath[] = "www/feed.atom";
+	char page[MAX_FILENAME_LENGTH];
+	struct outbuf ob;
+	struct tm tm;
+	char date[100];
+	size_t i;
 
-		dprintf(fd, "<tr>\n<td>%s", date);
-		dprintf(fd, "</td>\n<td><a href=\"");
-		dprintf(fd, "%s.html\">", info[MUNIQ]);
-		encode_html(fd, info[MSUBJECT], strlen(info[MSUBJECT]));
-		dprintf(fd, "</a></td>\n<td>");
-		encode_html(fd, info[MFROM], strlen(info[MFROM]));
-		dprintf(fd, "</td>\n</tr>\n");
+	out_init(&ob, create_page(tmppath));
 
-		aether_cursor = aether_checkpoint;
+	out_puts(&ob, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>");
+	encode_html(&ob, feed_title, strlen(feed_title));
+	out_printf(&ob, "</title>\n<id>%s</id>\n", feed_url);
+	out_printf(&ob, "<link href=\"%s\"/>\n", feed_url);
+	out_printf(&ob, "<link rel=\"self\" href=\"%sfeed.atom\"/>\n", feed_url);
+	strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&ents[0].time, &tm));
+	out_printf(&ob, "<updated>%s</updated>\n", date);
+	for (i = 0; i < count; i++) {
+		strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&ents[i].time, &tm));
+		out_puts(&ob, "<entry>\n<title>");
+		encode_html(&ob, ents[i].subject, strlen(ents[i].subject));
+		page_link(page, ents[i].uniq, ents[i].time, false);
+		out_printf(&ob, "</title>\n<id>%s%s.html</id>\n", feed_url, page);
+		out_printf(&ob, "<link href=\"%s%s.html\"/>\n", feed_url, page);
+		out_printf(&ob, "<updated>%s</updated>\n<author><name>", date);
+		encode_html(&ob, ents[i].from, strlen(ents[i].from));
+		out_puts(&ob, "</name></author>\n</entry>\n");
 	}
-	dprintf(fd, "</table>\n%s", html_footer);
+	out_puts(&ob, "</feed>\n");
 
-	close(fd);
-	if (rename(tmppath, wwwpath) < 0)
-		die("rename():");
+	finish_page(&ob, tmppath, wwwpath);
+}
+
+static void
+render_months(struct outbuf *ob, const void *ctx, const void *arg)
+{
+	const struct summary *sum = arg;
+	const struct monthsum *m;
+	struct slot slots[NUMSLOTS] = { 0 };
+	struct tm tm;
+	char month[32], count[32], date[200];
+	size_t i;
+
+	for (i = sum->count; i--;) {
+		m = &sum->months[i];
+		if (!m->count) continue;
+		snprintf(month, sizeof month, "%04d-%02d", m->year, m->month);
+		snprintf(count, sizeof count, "%zu", m->count);
+		strftime(date, sizeof date, "%Y-%m-%d %T", gmtime_r(&m->updated, &tm));
+		slots[SMONTH] = string(month);
+		slots[SCOUNT] = string(count);
+		slots[SDATE] = string(date);
+		render(ob, ctx, TMONTH, slots);
+	}
+}
+
+/* Lists all months, newest first. Only the summary is read. */
+void
+generate_html_overview(const struct summary *sum)
+{
+	struct slot slots[NUMSLOTS] = { 0 };
+
+	slots[SITEMS] = list(render_months, sum);
+	generate_pages("index", TOVERVIEW, slots);
 }
 
+/* The page of an author is named after the sender of their newest message. */
+void
+generate_html_author(const struct report *rpt, AUTHOR author)
+{
+	struct rowctx rc = { rpt, TAUTHORROW };
+	struct slot slots[NUMSLOTS] = { 0 };
+	struct record rec;
+	char name[32], count[32];
+
+	if (!rpt->count) return;
+	read_from_log(report_msg(rpt, rpt->count - 1), &rec);
+	snprintf(name, sizeof name, "author-%u", (unsigned) author);
+	snprintf(count, sizeof count, "%zu", rpt->count);
+	slots[SFROM] = field(rec.info[MFROM].str, rec.info[MFROM].len);
+	slots[SCOUNT] = string(count);
+	slots[SITEMS] = list(render_rows, &rc);
+	generate_pages(name, TAUTHOR, slots);
+}
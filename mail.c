@@ -12,17 +12,25 @@
  * Every time whead is incremented, rhead is also moved by at least one byte.
  */
 
+#define _GNU_SOURCE /* memmem(), memrchr() */
+
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <iconv.h>
+
+#include <unistd.h>
 
 #include "mail.h"
+#include "charset.h"
+#include "simd.h"
 #include "util.h"
 #include "config.h"
 
-extern char *aether_base;
-extern char *aether_cursor;
+/* multipart bodies nested deeper than this are saved as attachments */
+#define MAX_MIME_DEPTH 8
+
+extern _Thread_local char *aether_base;
+extern _Thread_local char *aether_cursor;
 
 static inline bool
 is_ws(char c)
@@ -189,29 +197,329 @@ restart:
 	return TOKEN_ERROR;
 }
 
-static int
-decode_hex_digit(char c)
+void
+init_mimehdr(struct mimehdr *mh)
+{
+	mh->type = "";
+	mh->boundary = NULL;
+	mh->filename = NULL;
+	mh->charset = "";
+	mh->tenc = '\0';
+	mh->attachment = false;
+}
+
+/* Reads the parameters of a Content-Type or Content-Disposition field.
+ * Anything after a malformed parameter is ignored. */
+static void
+parse_mime_params(struct token *tok, struct mimehdr *mh)
+{
+	char *name, *value, *eq;
+
+	while (tokenize(tok) == ';') {
+		if (tokenize(tok) != TOKEN_ATOM) return;
+		/* '=' is an atom character, so name=value is a single atom,
+		 * unless the value is a quoted string. */
+		name = tok->atom;
+		if (!(eq = strchr(name, '='))) return;
+		*eq = '\0';
+		value = eq + 1;
+		if (!*value) {
+			if (tokenize(tok) != TOKEN_ATOM) return;
+			value = tok->atom;
+		}
+		if (!strcasecmp(name, "boundary")) {
+			mh->boundary = value;
+		} else if (!strcasecmp(name, "charset")) {
+			mh->charset = value;
+		} else if (!strcasecmp(name, "filename")) {
+			mh->filename = value;
+		} else if (!strcasecmp(name, "name") && !mh->filename) {
+			mh->filename = value;
+		}
+	}
+}
+
+bool
+parse_mime_field(const char *key, char *value, struct mimehdr *mh)
 {
-	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-	if (c >= '0' && c <= '9') return c - '0';
+	struct token token = TOKEN_INIT(value);
+	char *c;
+
+	if (!strcasecmp(key, "Content-Type")) {
+		if (tokenize(&token) != TOKEN_ATOM) return true;
+		for (c = token.atom; *c; c++) {
+			if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+		}
+		mh->type = token.atom;
+		parse_mime_params(&token, mh);
+	} else if (!strcasecmp(key, "Content-Disposition")) {
+		if (tokenize(&token) != TOKEN_ATOM) return true;
+		mh->attachment = !strcasecmp(token.atom, "attachment");
+		parse_mime_params(&token, mh);
+	} else if (!strcasecmp(key, "Content-Transfer-Encoding")) {
+		if (tokenize(&token) != TOKEN_ATOM) return false;
+		if (!strcasecmp(token.atom, "7bit")) {
+			mh->tenc = '\0';
+		} else if (!strcasecmp(token.atom, "8bit")) {
+			mh->tenc = '\0';
+		} else if (!strcasecmp(token.atom, "binary")) {
+			mh->tenc = '\0';
+		} else if (!strcasecmp(token.atom, "quoted-printable")) {
+			mh->tenc = 'Q';
+		} else if (!strcasecmp(token.atom, "base64")) {
+			mh->tenc = 'B';
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* State of split_mime(). All positions are offsets into the message.
+ * A message that is not in memory is read in windows of STREAM_CHUNK
+ * bytes instead, so that only the headers of its parts are kept. */
+struct mimewalk {
+	char *base;   /* the message, or NULL if it is only in the file */
+	int   fd;
+	char *buf;    /* the window into the file */
+	struct part *parts;
+	size_t max, count;
+};
+
+static void walk_body(struct mimewalk *w, off_t off, size_t length, const struct mimehdr *mh, int depth);
+
+static size_t
+read_at(int fd, off_t off, char *buf, size_t n)
+{
+	if (lseek(fd, off, SEEK_SET) < 0)
+		die("lseek():");
+	return check_read(fd, buf, n);
+}
+
+/* Points *mem to the bytes from off on, and returns how many of them
+ * up to end are there. */
+static size_t
+window(struct mimewalk *w, off_t off, off_t end, char **mem)
+{
+	if (w->base) {
+		*mem = w->base + off;
+		return end - off;
+	}
+	*mem = w->buf;
+	return read_at(w->fd, off, w->buf, end - off < STREAM_CHUNK ? end - off : STREAM_CHUNK);
+}
+
+/* Finds the next delimiter line of a multipart body, which starts either
+ * at off itself or right after a line break. Returns -1 if there is none.
+ * Windows overlap by the length of a delimiter, so none is cut in half. */
+static off_t
+find_delimiter(struct mimewalk *w, off_t off, off_t end, const char *boundary, size_t blen)
+{
+	char *mem, *pos;
+	off_t from = off;
+	size_t n;
+
+	for (;;) {
+		n = window(w, off, end, &mem);
+		if (off == from && n >= blen + 2 && !memcmp(mem, "--", 2) && !memcmp(mem + 2, boundary, blen))
+			return off;
+		for (pos = mem; (pos = memmem(pos, mem + n - pos, "\n--", 3)); pos++) {
+			if ((size_t) (mem + n - pos) < blen + 3) break;
+			if (!memcmp(pos + 3, boundary, blen))
+				return off + (pos - mem) + 1;
+		}
+		if (off + (off_t) n == end || n < blen + 3)
+			return -1;
+		off += n - (blen + 2);
+	}
+}
+
+static off_t
+find_line_end(struct mimewalk *w, off_t off, off_t end)
+{
+	char *mem, *pos;
+	size_t n;
+
+	for (; off < end; off += n) {
+		n = window(w, off, end, &mem);
+		if ((pos = memchr(mem, '\n', n)))
+			return off + (pos - mem);
+	}
 	return -1;
 }
 
+/* Splits a body part into its header and content, and walks the content.
+ * The header of a part that is only in the file is read into the aether. */
+static void
+walk_entity(struct mimewalk *w, off_t off, size_t length, int depth)
+{
+	struct mimehdr mh;
+	char *mem, *header, *body, *key, *value;
+	size_t n = length;
+
+	if (w->base) {
+		mem = w->base + off;
+	} else {
+		n = length < STREAM_CHUNK ? length : STREAM_CHUNK;
+		mem = aether_alloc(n);
+		n = read_at(w->fd, off, mem, n);
+	}
+
+	init_mimehdr(&mh);
+	if (n >= 1 && mem[0] == '\n') {
+		header = "";
+		body = mem + 1;
+	} else if (n >= 2 && mem[0] == '\r' && mem[1] == '\n') {
+		header = "";
+		body = mem + 2;
+	} else if (split_header_from_body(mem, n, &body)) {
+		header = mem;
+	} else {
+		/* without the blank line, all of it is taken as plain text */
+		header = "";
+		body = mem;
+	}
+	if (!w->base)
+		aether_cursor = body;
+
+	/* A malformed part header doesn't make the whole message unreadable. */
+	while (*header && next_header_field(&header, &key, &value)) {
+		if (!parse_mime_field(key, value, &mh)) return;
+	}
+	walk_body(w, off + (body - mem), length - (body - mem), &mh, depth);
+}
+
+static bool
+has_text(const struct mimewalk *w, size_t from)
+{
+	for (; from < w->count; from++) {
+		if (w->parts[from].text) return true;
+	}
+	return false;
+}
+
+static void
+walk_multipart(struct mimewalk *w, off_t off, size_t length, const struct mimehdr *mh, int depth)
+{
+	off_t end = off + length, delim, next, start, stop;
+	size_t blen = strlen(mh->boundary), first = w->count, before, n;
+	bool alternative = !strcmp(mh->type, "multipart/alternative"), chosen = false;
+	struct mimehdr plain;
+	char *mem;
+
+	/* without any delimiter, show whatever it is as text */
+	if ((delim = find_delimiter(w, off, end, mh->boundary, blen)) < 0) {
+		init_mimehdr(&plain);
+		walk_body(w, off, length, &plain, depth);
+		return;
+	}
+	for (;;) {
+		start = delim + 2 + blen;
+		/* the close delimiter has two more dashes */
+		if (end - start >= 2 && window(w, start, start + 2, &mem) == 2
+		&& mem[0] == '-' && mem[1] == '-') break;
+		if ((start = find_line_end(w, start, end)) < 0) break;
+		start++;
+
+		next = find_delimiter(w, start, end, mh->boundary, blen);
+		stop = next >= 0 ? next : end;
+		/* the line break in front of a delimiter belongs to it */
+		if (next >= 0 && stop > start) {
+			n = window(w, stop - 2 > start ? stop - 2 : start, stop, &mem);
+			if (mem[n - 1] == '\n') n--, stop--;
+			if (n && mem[n - 1] == '\r') stop--;
+		}
+
+		before = w->count;
+		walk_entity(w, start, stop - start, depth + 1);
+		/* Only show the first alternative that has some text,
+		 * and don't save the others either. */
+		if (alternative) {
+			if (chosen) {
+				w->count = before;
+			} else if (has_text(w, before)) {
+				memmove(w->parts + first, w->parts + before, (w->count - before) * sizeof *w->parts);
+				w->count = first + (w->count - before);
+				chosen = true;
+			}
+		}
+
+		if (next < 0) break;
+		delim = next;
+	}
+}
+
+static void
+walk_body(struct mimewalk *w, off_t off, size_t length, const struct mimehdr *mh, int depth)
+{
+	struct part *part;
+
+	if (!strncmp(mh->type, "multipart/", 10) && mh->boundary && depth < MAX_MIME_DEPTH) {
+		walk_multipart(w, off, length, mh, depth);
+		return;
+	}
+	if (w->count == w->max) return;
+	part = &w->parts[w->count++];
+	part->mem      = NULL;
+	part->length   = length;
+	part->offset   = off;
+	part->tenc     = mh->tenc;
+	part->charset  = mh->charset;
+	part->filename = mh->filename;
+	/* HTML is never shown as it is, but offered as an attachment */
+	part->text = !mh->attachment && (!*mh->type
+		|| (!strncmp(mh->type, "text/", 5) && strcmp(mh->type, "text/html")));
+}
+
+size_t
+split_mime(char *base, char *body, size_t length, const struct mimehdr *mh, struct part *parts, size_t max)
+{
+	struct mimewalk w = { base, -1, NULL, parts, max, 0 };
+	walk_body(&w, body - base, length, mh, 0);
+	return w.count;
+}
+
+size_t
+split_mime_file(int fd, off_t offset, size_t length, const struct mimehdr *mh, struct part *parts, size_t max)
+{
+	struct mimewalk w = { NULL, fd, NULL, parts, max, 0 };
+
+	if (!(w.buf = malloc(STREAM_CHUNK)))
+		die("malloc():");
+	walk_body(&w, offset, length, mh, 0);
+	free(w.buf);
+	return w.count;
+}
+
+/* values of the hex digits, or -1 for anything else */
+static const signed char hex_value[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+
 char *
 decode_qprintable(char *rhead, char *whead, size_t length)
 {
-	char *end = rhead + length, *eq;
+	char *end = rhead + length;
+	size_t run;
 	int lo, hi;
 
-	while ((eq = memchr(rhead, '=', end - rhead))) {
-		memmove(whead, rhead, eq - rhead);
-		whead  += eq - rhead;
-		rhead   = eq + 1;
+	for (;;) {
+		/* non-ASCII text often has one escape right after another */
+		if (rhead < end && *rhead != '=') {
+			run = qp_run(rhead, end - rhead, whead);
+			whead += run;
+			rhead += run;
+		}
+		if (rhead == end) break;
+		rhead++; /* skip the '=' */
 
 		if (end - rhead >= 2
-		&& (hi = decode_hex_digit(rhead[0])) >= 0
-		&& (lo = decode_hex_digit(rhead[1])) >= 0) {
+		&& (hi = hex_value[(unsigned char) rhead[0]]) >= 0
+		&& (lo = hex_value[(unsigned char) rhead[1]]) >= 0) {
 			*whead++ = hi * 16 + lo;
 			rhead += 2;
 		} else if (end - rhead >= 2 && rhead[0] == '\r' && rhead[1] == '\n') {
@@ -220,8 +528,6 @@ decode_qprintable(char *rhead, char *whead, size_t length)
 			rhead += 1;
 		} else return NULL;
 	}
-	memmove(whead, rhead, end - rhead);
-	whead += end - rhead;
 	return whead;
 }
 
@@ -236,16 +542,27 @@ decode_base64_digit(char c)
 	return -1;
 }
 
-char *
-decode_base64(char *rhead, char *whead, size_t length)
+static char *
+decode_base64_part(struct bodydec *dec, char *rhead, char *whead, size_t length)
 {
-	/* This implementation is inefficient, but it will suffice for now. */
-
 	char *end = rhead + length;
-	unsigned long value = 0;
-	int digit, bits = 0;
-
-	while (rhead < end && *rhead != '=') {
+	unsigned long value = dec->value;
+	int digit, bits = dec->bits;
+	size_t run;
+
+	while (rhead < end && !dec->done) {
+		/* Most of the input are whole lines of complete groups,
+		 * which base64_run() decodes much faster than this loop. */
+		if (!bits) {
+			run = base64_run(rhead, end - rhead, whead);
+			rhead += run;
+			whead += run / 4 * 3;
+			if (rhead == end) break;
+		}
+		if (*rhead == '=') {
+			dec->done = true;
+			break;
+		}
 		if (is_ws(*rhead)) {
 			rhead++;
 			continue;
@@ -262,24 +579,53 @@ decode_base64(char *rhead, char *whead, size_t length)
 		}
 		rhead++;
 	}
+	dec->value = value;
+	dec->bits  = bits;
 	return whead;
 }
 
+char *
+decode_base64(char *rhead, char *whead, size_t length)
+{
+	struct bodydec dec = { .tenc = 'B' };
+	return decode_base64_part(&dec, rhead, whead, length);
+}
+
+char *
+decode_piece(struct bodydec *dec, char *mem, size_t length, bool last, size_t *rest)
+{
+	const char *eq;
+
+	*rest = 0;
+	switch (dec->tenc) {
+	case 'Q':
+		/* hold back an escape that continues in the next piece */
+		if (!last && length && (eq = memchr(mem + (length > 2 ? length - 2 : 0), '=', length > 2 ? 2 : length)))
+			*rest = mem + length - eq;
+		return decode_qprintable(mem, mem, length - *rest);
+	case 'B':
+		return decode_base64_part(dec, mem, mem, length);
+	default:
+		return mem + length;
+	}
+}
+
 char *
 decode_encword(char *rhead, char *whead, size_t length)
 {
-	char *start = rhead, *mark, *c;
+	char *start = rhead, *end = rhead + length, *mark, *c;
 	char enc;
 
-	if (!(mark = strchr(rhead, '?'))) return NULL;
+	if (!(mark = memchr(rhead, '?', length))) return NULL;
 	rhead = mark + 1;
 
+	if (end - rhead < 2) return NULL;
 	enc = *rhead++;
 	if (*rhead != '?') return NULL;
 	rhead++;
 
 	if (enc == 'Q' || enc == 'q') {
-		for (c = rhead; c < mark; c++) {
+		for (c = rhead; c < end; c++) {
 			if (*c == '_') *c = ' ';
 		}
 		return decode_qprintable(rhead, whead, length - (rhead - start));
@@ -291,12 +637,14 @@ decode_encword(char *rhead, char *whead, size_t length)
 }
 
 /* Convert any 'Encoded Words' of the form =?charset?encoding?content?=
- * that may appear in header fields to UTF-8. See RFC 2047.
+ * that may appear in header fields to UTF-8. See RFC 2047 and charset.h.
  * The resulting string is allocated in the aether memory. */
 char *
 convert_encwords(char *str)
 {
-	char *output, *rhead, *whead, *mark;
+	char *output, *rhead, *whead, *mark, *text, *wstart;
+	char charset[64];
+	const struct charset *cs;
 	size_t length;
 
 	rhead = str;
@@ -309,13 +657,29 @@ convert_encwords(char *str)
 		whead += length;
 		rhead = mark + 2;
 
-		if (!(mark = strstr(rhead, "?="))) return NULL;
+		/* the encoded text itself may start with "?=", as in "?Q?=C3" */
+		if (!(mark = strchr(rhead, '?')) || !mark[1] || !(text = strchr(mark + 2, '?')))
+			return NULL;
+		length = mark - rhead < (ptrdiff_t) sizeof charset ? mark - rhead : sizeof charset - 1;
+		memcpy(charset, rhead, length);
+		charset[length] = '\0';
+		if (!(mark = strstr(text + 1, "?="))) return NULL;
+
 		length = mark - rhead;
 		if (MAX_AETHER_MEMORY - (whead - aether_base) < length)
 			return NULL;
+		wstart = whead;
 		whead = decode_encword(rhead, whead, length);
 		if (!whead) return NULL;
 		rhead = mark + 2;
+
+		/* convert behind the decoded text, then move it into place;
+		 * if there is no room for that, it stays as it is */
+		if ((cs = find_charset(charset)) && must_convert(cs, wstart, whead - wstart)
+		&& convert_all(cs, wstart, whead - wstart, whead, MAX_AETHER_MEMORY - (whead - aether_base), &length)) {
+			memmove(wstart, whead, length);
+			whead = wstart + length;
+		}
 	}
 	length = strlen(rhead);
 	if (MAX_AETHER_MEMORY - (whead - aether_base) < length + 1)
@@ -327,6 +691,59 @@ convert_encwords(char *str)
 	return output;
 }
 
+/* Reduces a Message-ID to the part between the angle brackets and
+ * lowercases its domain. Writes at most length bytes to out and
+ * returns the length of the result. */
+size_t
+normalize_msgid(const char *id, size_t length, char *out)
+{
+	const char *end = id + length, *lt, *gt;
+	char *whead = out;
+	bool domain = false;
+
+	if ((lt = memchr(id, '<', length)) && (gt = memchr(lt, '>', end - lt))) {
+		id  = lt + 1;
+		end = gt;
+	}
+	for (; id < end; id++) {
+		if (is_ws(*id)) continue;
+		if (*id == '@') domain = true;
+		*whead++ = domain && *id >= 'A' && *id <= 'Z' ? *id - 'A' + 'a' : *id;
+	}
+	return whead - out;
+}
+
+size_t
+normalize_address(const char *from, size_t length, char *out)
+{
+	const char *end = from + length, *lt, *gt;
+	char *whead = out;
+
+	if ((lt = memrchr(from, '<', length)) && (gt = memchr(lt, '>', end - lt))) {
+		from = lt + 1;
+		end  = gt;
+	}
+	for (; from < end; from++) {
+		if (is_ws(*from)) continue;
+		*whead++ = *from >= 'A' && *from <= 'Z' ? *from - 'A' + 'a' : *from;
+	}
+	return whead - out;
+}
+
+/* Finds the next Message-ID in angle brackets in a header like References.
+ * Returns a pointer behind it, or NULL if there is none left. */
+const char *
+next_msgid(const char *str, const char **id, size_t *length)
+{
+	const char *lt, *gt;
+
+	if (!(lt = strchr(str, '<')) || !(gt = strchr(lt, '>')))
+		return NULL;
+	*id = lt;
+	*length = gt + 1 - lt;
+	return gt + 1;
+}
+
 static bool
 read_decimal(const char *atom, int min, int max, int *value)
 {
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 struct tm;
 
@@ -24,13 +25,86 @@ void collapse_ws(char *str);
 
 int tokenize(struct token *token);
 
+/* What the MIME header fields of a message or of a body part say about
+ * its content. The strings point into the parsed header. */
+struct mimehdr {
+	const char *type;     /* lowercase media type, "" if not given */
+	const char *boundary; /* delimiter of multipart types */
+	const char *filename;
+	const char *charset;  /* "" if not given */
+	char tenc;            /* transfer encoding: 'Q', 'B', or '\0' for none */
+	bool attachment;      /* Content-Disposition is attachment */
+};
+
+/* A leaf part of the body of a message. Text parts are shown on the
+ * page of the message, all other parts are saved as attachments. */
+struct part {
+	char  *mem;      /* decoded content, or NULL if it is still in the file */
+	size_t length;   /* length of mem, or of the encoded content in the file */
+	off_t  offset;   /* where the encoded content starts in the message */
+	char   tenc;
+	bool   text;
+	const char *charset;
+	const char *filename; /* NULL if not given */
+};
+
+struct body {
+	int fd;           /* the file of the message, or -1 if it has none */
+	const char *text; /* the message, if it has no file of its own */
+	struct part *parts;
+	size_t nparts;
+};
+
+/* Sets mh to the defaults of a part without MIME header fields. */
+void init_mimehdr(struct mimehdr *mh);
+/* Handles the header field if it is one of the Content-* fields that MIME
+ * defines. Parses value in place. Returns false if it is malformed. */
+bool parse_mime_field(const char *key, char *value, struct mimehdr *mh);
+/* Splits the body of a message, whose MIME header fields are mh, into its
+ * leaf parts. Walks the multipart structure without copying anything, but
+ * parses the headers of the parts in place. base is the start of the
+ * message, so that the parts can be located in the file. Writes at most
+ * max parts and returns their number. */
+size_t split_mime(char *base, char *body, size_t length, const struct mimehdr *mh, struct part *parts, size_t max);
+/* Same for a message that is not in memory. Its body starts at offset in
+ * the file and is read in pieces of STREAM_CHUNK bytes. The headers of
+ * the parts are read into the aether. */
+size_t split_mime_file(int fd, off_t offset, size_t length, const struct mimehdr *mh, struct part *parts, size_t max);
+
+/* Decoding state of a body that is decoded piece by piece. */
+struct bodydec {
+	char tenc;
+	bool done;
+	int  bits;
+	unsigned long value;
+};
+
 char *decode_qprintable(char *rhead, char *whead, size_t length);
 char *decode_base64(char *rhead, char *whead, size_t length);
+/* Decodes the next piece of a body in place and returns the end of the
+ * decoded data, or NULL on errors. A QP escape may be cut off at the end
+ * of a piece; *rest is set to the number of bytes at the end of mem that
+ * have to be passed again at the start of the next piece. */
+char *decode_piece(struct bodydec *dec, char *mem, size_t length, bool last, size_t *rest);
 char *decode_encword(char *rhead, char *whead, size_t length);
 /* Convert any 'Encoded Words' of the form =?charset?encoding?content?=
- * that may appear in header fields to UTF-8. See RFC 2047.
+ * that may appear in header fields to UTF-8. See RFC 2047 and charset.h.
  * The resulting string is allocated in the aether memory. */
 char *convert_encwords(char *str);
 
+/* Reduces a Message-ID to the part between the angle brackets and
+ * lowercases its domain. Writes at most length bytes to out and
+ * returns the length of the result. */
+size_t normalize_msgid(const char *id, size_t length, char *out);
+
+/* Reduces a From header field to the address between the angle brackets,
+ * or the whole field if there are none, and lowercases it. Writes at most
+ * length bytes to out and returns the length of the result. */
+size_t normalize_address(const char *from, size_t length, char *out);
+
+/* Finds the next Message-ID in angle brackets in a header like References.
+ * Returns a pointer behind it, or NULL if there is none left. */
+const char *next_msgid(const char *str, const char **id, size_t *length);
+
 bool parse_date(char *date, struct tm *tm);
 
@@ -0,0 +1,268 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * mbox files
+ *
+ * An mbox file holds many messages, each one behind a line that starts
+ * with "From ". Lines of a message that would look like that are quoted
+ * with a '>', and so are lines that already start with '>'s followed by
+ * "From " (the mboxrd format), so one '>' is removed from all of them.
+ *
+ * Messages are found with memchr() from line to line, and each one is
+ * mapped into memory on its own, so that memory usage does not depend on
+ * the size of the file. The file is never split up; the messages are read
+ * from it again whenever their pages are regenerated.
+ *
+ * smak/mboxes lists the mbox files that messages were imported from. It
+ * begins with a 24 byte header: the magic "smakmbx\0", a 32 bit format
+ * version, 32 reserved bits and the 64 bit number of files. Their absolute
+ * paths follow, each as a 32 bit length followed by the bytes and a
+ * terminating NUL. The message at offset o of the n-th file (counting
+ * from 1) has the unique name "mbox<n>.<o>".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "mbox.h"
+#include "config.h"
+
+#define MBOXES_MAGIC       "smakmbx"
+#define MBOXES_VERSION     1
+#define MBOXES_HEADER_SIZE 24
+
+static char **paths;
+static size_t npaths;
+static bool loaded;
+static pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+load_mboxes(void)
+{
+	unsigned char *buf, *p, *end;
+	struct stat meta;
+	size_t count, len, i;
+	int fd;
+
+	if (loaded) return;
+	loaded = true;
+	if ((fd = open("smak/mboxes", O_RDONLY)) < 0) {
+		if (errno == ENOENT) return;
+		die("cannot open 'smak/mboxes':");
+	}
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (meta.st_size < MBOXES_HEADER_SIZE)
+		die("'smak/mboxes' is corrupt.");
+	if (!(buf = malloc(meta.st_size)))
+		die("malloc():");
+	for (p = buf; p < buf + meta.st_size; p += check_read(fd, p, buf + meta.st_size - p));
+	close(fd);
+	if (memcmp(buf, MBOXES_MAGIC, 8) || get_le32(buf + 8) != MBOXES_VERSION)
+		die("'smak/mboxes' has an unknown format.");
+
+	count = get_le64(buf + 16);
+	if (!(paths = calloc(count + 1, sizeof *paths)))
+		die("calloc():");
+	end = buf + meta.st_size;
+	for (i = 0, p = buf + MBOXES_HEADER_SIZE; i < count; i++) {
+		if (end - p < 4)
+			die("'smak/mboxes' is corrupt.");
+		len = get_le32(p);
+		if ((size_t) (end - p - 4) < len + 1 || p[4 + len])
+			die("'smak/mboxes' is corrupt.");
+		if (!(paths[i] = strdup((char *) p + 4)))
+			die("strdup():");
+		p += 4 + len + 1;
+	}
+	npaths = count;
+	free(buf);
+}
+
+/* The messages will refer to the new file,
+ * so it has to be on disk before any of them are logged. */
+static void
+save_mboxes(void)
+{
+	unsigned char hdr[MBOXES_HEADER_SIZE] = { 0 }, num[4];
+	size_t i, len;
+	int fd;
+
+	if ((fd = open("smak/mboxes.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot create 'smak/mboxes.tmp':");
+	memcpy(hdr, MBOXES_MAGIC, 8);
+	put_le32(hdr + 8, MBOXES_VERSION);
+	put_le64(hdr + 16, npaths);
+	check_write(fd, hdr, sizeof hdr);
+	for (i = 0; i < npaths; i++) {
+		len = strlen(paths[i]);
+		put_le32(num, len);
+		check_write(fd, num, 4);
+		check_write(fd, paths[i], len + 1);
+	}
+	if (fsync(fd) < 0)
+		die("fsync():");
+	close(fd);
+	if (rename("smak/mboxes.tmp", "smak/mboxes") < 0)
+		die("rename():");
+	flush_dir("smak");
+}
+
+unsigned
+add_mbox(const char *path)
+{
+	size_t i;
+
+	pthread_mutex_lock(&paths_lock);
+	load_mboxes();
+	for (i = 0; i < npaths && strcmp(paths[i], path); i++);
+	if (i == npaths) {
+		if (!(paths = realloc(paths, (npaths + 1) * sizeof *paths)))
+			die("realloc():");
+		if (!(paths[npaths++] = strdup(path)))
+			die("strdup():");
+		save_mboxes();
+	}
+	pthread_mutex_unlock(&paths_lock);
+	return i + 1;
+}
+
+void
+mbox_uniq(char *uniq, size_t size, unsigned id, off_t offset)
+{
+	if (snprintf(uniq, size, "mbox%u.%lld", id, (long long) offset) >= (int) size)
+		die("file path is too long.");
+}
+
+unsigned
+parse_mbox_uniq(const char *uniq, off_t *offset)
+{
+	unsigned long id;
+	long long off;
+	char *end;
+
+	if (strncmp(uniq, "mbox", 4) || uniq[4] < '1' || uniq[4] > '9')
+		return 0;
+	id = strtoul(uniq + 4, &end, 10);
+	if (*end != '.' || end[1] < '0' || end[1] > '9')
+		return 0;
+	off = strtoll(end + 1, &end, 10);
+	if (*end)
+		return 0;
+	pthread_mutex_lock(&paths_lock);
+	load_mboxes();
+	if (id > npaths) id = 0;
+	pthread_mutex_unlock(&paths_lock);
+	*offset = off;
+	return id;
+}
+
+int
+open_mbox(unsigned id)
+{
+	const char *path;
+
+	pthread_mutex_lock(&paths_lock);
+	load_mboxes();
+	path = id && id <= npaths ? paths[id - 1] : NULL;
+	pthread_mutex_unlock(&paths_lock);
+	return path ? open(path, O_RDONLY) : -1;
+}
+
+/* Removes one '>' from every line that consists of '>'s followed by
+ * "From ", and returns the new size. */
+static size_t
+unquote(char *text, size_t size)
+{
+	char *line, *end = text + size, *next, *w = text, *q;
+
+	for (line = text; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		for (q = line; q < next && *q == '>'; q++);
+		if (q > line && next - q >= 5 && !memcmp(q, "From ", 5))
+			line++;
+		if (w != line)
+			memmove(w, line, next - line);
+		w += next - line;
+	}
+	return w - text;
+}
+
+bool
+map_mbox_msg(int fd, off_t size, off_t offset, struct mboxmsg *mm)
+{
+	static long pagesize;
+	off_t start;
+	size_t window = MBOX_WINDOW, skip;
+	char *p, *end, *line, *stop = NULL;
+	bool quoted = false;
+
+	if (!pagesize)
+		pagesize = sysconf(_SC_PAGESIZE);
+	start = offset - offset % pagesize;
+	skip = offset - start;
+	if (offset >= size)
+		return false;
+
+	/* The window grows until it holds the whole message. */
+	for (;;) {
+		if ((off_t) window > size - start)
+			window = size - start;
+		mm->map = mmap(NULL, window, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+		if (mm->map == MAP_FAILED)
+			die("mmap():");
+		mm->maplen = window;
+		p = mm->map + skip;
+		end = mm->map + window;
+		if (end - p < 5 || memcmp(p, "From ", 5)) {
+			munmap(mm->map, window);
+			return false;
+		}
+		if ((line = memchr(p, '\n', end - p))) {
+			mm->text = ++line;
+			/* A "From " line at the end of the window may be cut off,
+			 * so the last few bytes are only looked at in the end. */
+			while ((p = memchr(line, '\n', end - line))) {
+				line = p + 1;
+				if (end - line < 5 && (off_t) window < size - start) break;
+				if (end - line >= 5 && !memcmp(line, "From ", 5)) {
+					stop = line;
+					break;
+				}
+				if (line < end && *line == '>') quoted = true;
+			}
+			if (stop || (off_t) window == size - start) break;
+		} else if ((off_t) window == size - start) {
+			mm->text = end;
+			break;
+		}
+		munmap(mm->map, window);
+		window *= 2;
+	}
+	if (!stop) stop = end;
+
+	mm->next = start + (stop - mm->map);
+	mm->size = stop - mm->text;
+	/* the empty line in front of the next "From " line */
+	if (mm->size >= 2 && mm->text[mm->size - 1] == '\n' && mm->text[mm->size - 2] == '\n')
+		mm->size--;
+	if (quoted || (mm->size && *mm->text == '>'))
+		mm->size = unquote(mm->text, mm->size);
+	return true;
+}
+
+void
+unmap_mbox_msg(struct mboxmsg *mm)
+{
+	munmap(mm->map, mm->maplen);
+}
@@ -0,0 +1,29 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* A message of an mbox file, mapped into memory on its own.
+ * The mapping is private, so the text may be changed in place. */
+struct mboxmsg {
+	char  *text;   /* the message behind its "From " line, unquoted */
+	size_t size;
+	off_t  next;   /* where the next message starts, or the file size */
+	char  *map;
+	size_t maplen;
+};
+
+/* Returns the number of the mbox file at the absolute path,
+ * and lists it in smak/mboxes if it is not yet. */
+unsigned add_mbox(const char *path);
+/* Writes the unique name of the message at offset of mbox number id. */
+void mbox_uniq(char *uniq, size_t size, unsigned id, off_t offset);
+/* If uniq names a message of a listed mbox, returns the mbox number and
+ * sets *offset. Returns zero otherwise. Safe to call from several threads. */
+unsigned parse_mbox_uniq(const char *uniq, off_t *offset);
+/* Opens mbox number id. Returns -1 if it is gone. */
+int open_mbox(unsigned id);
+/* Maps the message whose "From " line starts at offset.
+ * Returns false if there is no such line. */
+bool map_mbox_msg(int fd, off_t size, off_t offset, struct mboxmsg *mm);
+void unmap_mbox_msg(struct mboxmsg *mm);
@@ -0,0 +1,118 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "out.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+void
+out_init(struct outbuf *ob, int fd)
+{
+	ob->fd = fd;
+	ob->fill = ob->start = 0;
+	ob->niov = 0;
+}
+
+/* Turns the bytes that were copied into buf since the last iovec into one.
+ * There is always a free iovec for this; see out_ref(). */
+static void
+seal(struct outbuf *ob)
+{
+	if (ob->fill == ob->start) return;
+	ob->iov[ob->niov++] = (struct iovec) { ob->buf + ob->start, ob->fill - ob->start };
+	ob->start = ob->fill;
+}
+
+void
+out_flush(struct outbuf *ob)
+{
+	struct iovec *iov = ob->iov;
+	int niov;
+	ssize_t ret;
+
+	seal(ob);
+	niov = ob->niov;
+	while (niov) {
+		ret = writev(ob->fd, iov, niov < IOV_MAX ? niov : IOV_MAX);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			die("writev():");
+		}
+		/* skip what has been written, which may end inside an iovec */
+		while (niov && (size_t) ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++, niov--;
+		}
+		if (niov) {
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	ob->fill = ob->start = 0;
+	ob->niov = 0;
+}
+
+void
+out_write(struct outbuf *ob, const void *mem, size_t length)
+{
+	if (length > OUT_BUFSIZE - ob->fill) {
+		if (length >= OUT_BUFSIZE / 4) {
+			out_ref(ob, mem, length);
+			out_flush(ob);
+			return;
+		}
+		out_flush(ob);
+	}
+	memcpy(ob->buf + ob->fill, mem, length);
+	ob->fill += length;
+}
+
+void
+out_ref(struct outbuf *ob, const void *mem, size_t length)
+{
+	if (!length) return;
+	/* one iovec for seal(), one for mem and one left for the next seal() */
+	if (ob->niov + 3 > OUT_MAXIOV)
+		out_flush(ob);
+	seal(ob);
+	ob->iov[ob->niov++] = (struct iovec) { (void *) mem, length };
+}
+
+void
+out_puts(struct outbuf *ob, const char *str)
+{
+	out_write(ob, str, strlen(str));
+}
+
+void
+out_printf(struct outbuf *ob, const char *format, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(ob->buf + ob->fill, OUT_BUFSIZE - ob->fill, format, ap);
+	va_end(ap);
+	if (len < 0)
+		die("vsnprintf():");
+	if ((size_t) len >= OUT_BUFSIZE - ob->fill) {
+		out_flush(ob);
+		if (len >= OUT_BUFSIZE)
+			die("formatted output is too long.");
+		va_start(ap, format);
+		vsnprintf(ob->buf, OUT_BUFSIZE, format, ap);
+		va_end(ap);
+	}
+	ob->fill += len;
+}
@@ -0,0 +1,27 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define OUT_BUFSIZE (64 * 1024)
+#define OUT_MAXIOV  64
+
+/* Output buffer that gathers a whole file and writes it with writev().
+ * Small pieces are copied into the buffer; big ones are only referenced. */
+struct outbuf {
+	int    fd;
+	size_t fill;  /* bytes used in buf */
+	size_t start; /* start of the part of buf that has no iovec yet */
+	int    niov;
+	struct iovec iov[OUT_MAXIOV];
+	char   buf[OUT_BUFSIZE];
+};
+
+void out_init (struct outbuf *ob, int fd);
+void out_write(struct outbuf *ob, const void *mem, size_t length);
+/* Like out_write(), but mem is not copied. It has to stay
+ * unchanged until the next out_flush(). */
+void out_ref  (struct outbuf *ob, const void *mem, size_t length);
+void out_puts (struct outbuf *ob, const char *str);
+void out_printf(struct outbuf *ob, const char *format, ...);
+void out_flush(struct outbuf *ob);
@@ -0,0 +1,747 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Full-text search
+ *
+ * The words of the subject and the text parts of every message are kept in
+ * an inverted index in smak/index/. New postings (pairs of a word and a
+ * message) are collected in memory and written out as a new segment every
+ * INDEX_BATCH postings, and at the end of every run. Segments are never
+ * modified. Instead, the newest two are merged as long as the older one is
+ * at most twice as big, which keeps the number of segments logarithmic in
+ * the size of the archive while every posting is copied only a logarithmic
+ * number of times.
+ *
+ * Since the log only grows, all postings of a segment come after those of
+ * the segments before it, so merging two neighbours simply concatenates the
+ * posting lists of every word.
+ *
+ * A segment smak/index/NNNNNNNN starts with a 48 byte header: the magic
+ * "smakidx\0", a 32 bit format version, 32 reserved bits, the 64 bit number
+ * of words, the 64 bit number of postings, the 64 bit log offset up to which
+ * the segment covers all records, and 64 reserved bits. It is followed by
+ * the words sorted by hash, 24 bytes each: the 64 bit hash of the word, the
+ * 64 bit index of its first posting and the 64 bit number of its postings.
+ * The postings are the MSGs of the messages, 64 bits each.
+ *
+ * Words are only identified by their hashes. With 64 bits, a search for
+ * one word finding messages with another is too unlikely to matter.
+ *
+ * Version 1 split words differently (see collect_words()). Segments of an
+ * older version are removed by the next run, which then indexes the whole
+ * log again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "out.h"
+#include "smakdir.h"
+#include "search.h"
+#include "config.h"
+
+#define IDX_MAGIC    "smakidx"
+#define IDX_VERSION  2
+#define IDX_HEADER   48
+#define WORD_SIZE    24
+/* seed of the word hashes */
+#define WORD_SEED    0x1dc5
+#define MIN_WORD     2
+#define MAX_WORD     64
+
+struct posting {
+	uint64_t hash;
+	MSG      msg;
+};
+
+struct segment {
+	unsigned number;
+	size_t   npostings;
+	MSG      end;
+};
+
+/* a segment mapped into memory */
+struct segmap {
+	unsigned char *base;
+	size_t size;
+	size_t nwords;
+	size_t npostings;
+	MSG    end;
+};
+
+static struct segment *segs;
+static size_t nsegs, capsegs;
+static bool opened;
+
+static struct posting *batch;
+static size_t nbatch, capbatch;
+/* the log offset up to which the batch covers all records */
+static MSG batch_end;
+
+static void
+segment_path(char *path, unsigned number)
+{
+	snprintf(path, 32, "smak/index/%08u", number);
+}
+
+enum segstate { MAPPED, OUTDATED, GONE };
+
+/* A segment is only gone if a run merged it into another
+ * after it was listed, so it is worth listing them again. */
+static enum segstate
+map_segment(unsigned number, struct segmap *m)
+{
+	char path[32];
+	struct stat meta;
+	int fd;
+
+	segment_path(path, number);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno == ENOENT) return GONE;
+		die("cannot open '%s':", path);
+	}
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	m->size = meta.st_size;
+	if (m->size < IDX_HEADER)
+		die("'%s' is corrupted.", path);
+	m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m->base == MAP_FAILED)
+		die("mmap():");
+	close(fd);
+
+	if (memcmp(m->base, IDX_MAGIC, 8) || get_le32(m->base + 8) > IDX_VERSION)
+		die("'%s' is not a search index segment of this version.", path);
+	if (get_le32(m->base + 8) < IDX_VERSION) {
+		munmap(m->base, m->size);
+		return OUTDATED;
+	}
+	m->nwords    = get_le64(m->base + 16);
+	m->npostings = get_le64(m->base + 24);
+	m->end       = get_le64(m->base + 32);
+	if (m->nwords > (m->size - IDX_HEADER) / WORD_SIZE
+	 || m->npostings != (m->size - IDX_HEADER - m->nwords * WORD_SIZE) / 8)
+		die("'%s' is corrupted.", path);
+	return MAPPED;
+}
+
+static void
+unmap_segment(struct segmap *m)
+{
+	munmap(m->base, m->size);
+}
+
+static const unsigned char *
+word_entry(const struct segmap *m, size_t i)
+{
+	return m->base + IDX_HEADER + i * WORD_SIZE;
+}
+
+static const unsigned char *
+postings_of(const struct segmap *m)
+{
+	return m->base + IDX_HEADER + m->nwords * WORD_SIZE;
+}
+
+static void
+put_header(struct outbuf *ob, size_t nwords, size_t npostings, MSG end)
+{
+	unsigned char hdr[IDX_HEADER] = { 0 };
+
+	memcpy(hdr, IDX_MAGIC, 8);
+	put_le32(hdr + 8, IDX_VERSION);
+	put_le64(hdr + 16, nwords);
+	put_le64(hdr + 24, npostings);
+	put_le64(hdr + 32, end);
+	out_write(ob, hdr, sizeof hdr);
+}
+
+static void
+put_word(struct outbuf *ob, uint64_t hash, size_t first, size_t count)
+{
+	unsigned char ent[WORD_SIZE];
+
+	put_le64(ent,      hash);
+	put_le64(ent + 8,  first);
+	put_le64(ent + 16, count);
+	out_write(ob, ent, sizeof ent);
+}
+
+static int
+create_segment(struct outbuf *ob)
+{
+	int fd;
+
+	if ((fd = open("smak/index/tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot create 'smak/index/tmp':");
+	out_init(ob, fd);
+	return fd;
+}
+
+static void
+commit_segment(struct outbuf *ob, unsigned number)
+{
+	char path[32];
+
+	out_flush(ob);
+	close(ob->fd);
+	segment_path(path, number);
+	if (rename("smak/index/tmp", path) < 0)
+		die("rename():");
+}
+
+/* Merges segment i with its successor into segment i. */
+static void
+merge_segments(size_t i)
+{
+	struct segmap a, b;
+	struct outbuf *ob;
+	char path[32];
+	size_t ia, ib, nwords, first;
+	uint64_t ha, hb, hash;
+
+	if (map_segment(segs[i].number, &a) != MAPPED || map_segment(segs[i+1].number, &b) != MAPPED)
+		die("search index is corrupted.");
+	if (!(ob = malloc(sizeof *ob)))
+		die("malloc():");
+
+	/* count the words of both first */
+	for (ia = ib = nwords = 0; ia < a.nwords || ib < b.nwords; nwords++) {
+		ha = ia < a.nwords ? get_le64(word_entry(&a, ia)) : UINT64_MAX;
+		hb = ib < b.nwords ? get_le64(word_entry(&b, ib)) : UINT64_MAX;
+		hash = ha < hb ? ha : hb;
+		if (ia < a.nwords && ha == hash) ia++;
+		if (ib < b.nwords && hb == hash) ib++;
+	}
+	create_segment(ob);
+	put_header(ob, nwords, a.npostings + b.npostings, b.end);
+
+	for (ia = ib = first = 0; ia < a.nwords || ib < b.nwords; ) {
+		ha = ia < a.nwords ? get_le64(word_entry(&a, ia)) : UINT64_MAX;
+		hb = ib < b.nwords ? get_le64(word_entry(&b, ib)) : UINT64_MAX;
+		hash = ha < hb ? ha : hb;
+		nwords = 0;
+		if (ia < a.nwords && ha == hash) nwords += get_le64(word_entry(&a, ia++) + 16);
+		if (ib < b.nwords && hb == hash) nwords += get_le64(word_entry(&b, ib++) + 16);
+		put_word(ob, hash, first, nwords);
+		first += nwords;
+	}
+
+	/* the posting lists of a come before those of b */
+	for (ia = ib = 0; ia < a.nwords || ib < b.nwords; ) {
+		ha = ia < a.nwords ? get_le64(word_entry(&a, ia)) : UINT64_MAX;
+		hb = ib < b.nwords ? get_le64(word_entry(&b, ib)) : UINT64_MAX;
+		hash = ha < hb ? ha : hb;
+		if (ia < a.nwords && ha == hash) {
+			out_write(ob, postings_of(&a) + 8 * get_le64(word_entry(&a, ia) + 8),
+				8 * get_le64(word_entry(&a, ia) + 16));
+			ia++;
+		}
+		if (ib < b.nwords && hb == hash) {
+			out_write(ob, postings_of(&b) + 8 * get_le64(word_entry(&b, ib) + 8),
+				8 * get_le64(word_entry(&b, ib) + 16));
+			ib++;
+		}
+	}
+	commit_segment(ob, segs[i].number);
+	free(ob);
+	unmap_segment(&a);
+	unmap_segment(&b);
+
+	segment_path(path, segs[i+1].number);
+	if (unlink(path) < 0)
+		die("cannot remove '%s':", path);
+	segs[i].npostings += segs[i+1].npostings;
+	segs[i].end = segs[i+1].end;
+	memmove(segs + i + 1, segs + i + 2, (nsegs - i - 2) * sizeof *segs);
+	nsegs--;
+}
+
+static int
+compare_postings(const void *a, const void *b)
+{
+	const struct posting *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return x->msg < y->msg ? -1 : x->msg > y->msg;
+}
+
+static void
+write_batch(void)
+{
+	struct outbuf *ob;
+	unsigned char msg[8];
+	size_t i, j, nwords = 0;
+
+	if (!nbatch) return;
+	qsort(batch, nbatch, sizeof *batch, compare_postings);
+	for (i = 0; i < nbatch; i++) {
+		if (!i || batch[i].hash != batch[i-1].hash) nwords++;
+	}
+
+	if (!(ob = malloc(sizeof *ob)))
+		die("malloc():");
+	create_segment(ob);
+	put_header(ob, nwords, nbatch, batch_end);
+	for (i = 0; i < nbatch; i = j) {
+		for (j = i; j < nbatch && batch[j].hash == batch[i].hash; j++);
+		put_word(ob, batch[i].hash, i, j - i);
+	}
+	for (i = 0; i < nbatch; i++) {
+		put_le64(msg, batch[i].msg);
+		out_write(ob, msg, 8);
+	}
+
+	if (nsegs == capsegs) {
+		capsegs = capsegs ? 2 * capsegs : 16;
+		if (!(segs = realloc(segs, capsegs * sizeof *segs)))
+			die("realloc():");
+	}
+	segs[nsegs] = (struct segment) { nsegs ? segs[nsegs-1].number + 1 : 1, nbatch, batch_end };
+	commit_segment(ob, segs[nsegs].number);
+	nsegs++;
+	free(ob);
+	nbatch = 0;
+
+	while (nsegs >= 2 && segs[nsegs-2].npostings <= 2 * segs[nsegs-1].npostings)
+		merge_segments(nsegs - 2);
+}
+
+static int
+compare_segments(const void *a, const void *b)
+{
+	const struct segment *x = a, *y = b;
+	return (x->number > y->number) - (x->number < y->number);
+}
+
+static void
+list_segments(void)
+{
+	struct dirent *ent;
+	DIR *dir;
+	char *end;
+	unsigned long number;
+
+	nsegs = 0;
+	if (!(dir = opendir("smak/index")))
+		die("cannot open 'smak/index':");
+	while ((errno = 0, ent = readdir(dir))) {
+		number = strtoul(ent->d_name, &end, 10);
+		if (*end || strlen(ent->d_name) != 8) continue;
+		if (nsegs == capsegs) {
+			capsegs = capsegs ? 2 * capsegs : 16;
+			if (!(segs = realloc(segs, capsegs * sizeof *segs)))
+				die("realloc():");
+		}
+		segs[nsegs++].number = number;
+	}
+	if (errno)
+		die("readdir():");
+	closedir(dir);
+	qsort(segs, nsegs, sizeof *segs, compare_segments);
+}
+
+/* Lists the segments. Outdated ones are removed if writable is set. */
+static void
+load_index(bool writable)
+{
+	enum segstate state = MAPPED;
+	struct segmap m;
+	char path[32];
+	size_t i;
+
+	if (opened) return;
+	opened = true;
+
+	if (mkdir("smak/index", 0750) < 0 && errno != EEXIST)
+		die("cannot create 'smak/index':");
+	do {
+		list_segments();
+		for (i = 0; i < nsegs && (state = map_segment(segs[i].number, &m)) == MAPPED; i++) {
+			segs[i].npostings = m.npostings;
+			segs[i].end = m.end;
+			unmap_segment(&m);
+		}
+	} while (i < nsegs && state == GONE);
+	if (i < nsegs) {
+		if (!writable)
+			die("the search index has an older format. The next run of smak rebuilds it.");
+		for (i = 0; i < nsegs; i++) {
+			segment_path(path, segs[i].number);
+			if (unlink(path) < 0 && errno != ENOENT)
+				die("cannot remove '%s':", path);
+		}
+		nsegs = 0;
+	}
+	batch_end = nsegs ? segs[nsegs-1].end : 0;
+}
+
+void
+open_index(void)
+{
+	load_index(true);
+}
+
+void
+flush_index(void)
+{
+	if (opened)
+		write_batch();
+}
+
+void
+close_index(void)
+{
+	if (!opened) return;
+	write_batch();
+	free(batch);
+	free(segs);
+	batch = NULL;
+	segs = NULL;
+	nbatch = capbatch = nsegs = capsegs = 0;
+	opened = false;
+}
+
+MSG
+index_mark(void)
+{
+	open_index();
+	return batch_end ? batch_end : first_in_log();
+}
+
+/* Non-ASCII spaces, punctuation and symbols, which separate words. */
+static const struct { uint32_t lo, hi; } separators[] = {
+	{ 0x0080, 0x00A9 }, { 0x00AB, 0x00B4 }, { 0x00B6, 0x00B9 },
+	{ 0x00BB, 0x00BF }, { 0x00D7, 0x00D7 }, { 0x00F7, 0x00F7 },
+	{ 0x037E, 0x037E }, { 0x0387, 0x0387 }, { 0x055A, 0x055F },
+	{ 0x0589, 0x058A }, { 0x05BE, 0x05BE }, { 0x05C0, 0x05C0 },
+	{ 0x05C3, 0x05C3 }, { 0x05F3, 0x05F4 }, { 0x060C, 0x060D },
+	{ 0x061B, 0x061F }, { 0x066A, 0x066D }, { 0x06D4, 0x06D4 },
+	{ 0x0964, 0x0965 }, { 0x0E4F, 0x0E4F }, { 0x0E5A, 0x0E5B },
+	{ 0x104A, 0x104F }, { 0x1680, 0x1680 }, { 0x17D4, 0x17DA },
+	{ 0x2000, 0x2BFF }, { 0x2E00, 0x2E7F }, { 0x3000, 0x3004 },
+	{ 0x3008, 0x3020 }, { 0x3030, 0x3030 }, { 0x303D, 0x303F },
+	{ 0x30FB, 0x30FB }, { 0xFE10, 0xFE1F }, { 0xFE30, 0xFE6F },
+	{ 0xFEFF, 0xFEFF }, { 0xFF01, 0xFF0F }, { 0xFF1A, 0xFF20 },
+	{ 0xFF3B, 0xFF40 }, { 0xFF5B, 0xFF65 }, { 0x1F000, 0x1FAFF },
+};
+
+/* Scripts that are written without spaces between words: Thai, Lao,
+ * Myanmar, Khmer, Chinese and Japanese. */
+static const struct { uint32_t lo, hi; } unspaced[] = {
+	{ 0x0E00, 0x0EFF }, { 0x1000, 0x109F }, { 0x1780, 0x17FF },
+	{ 0x3005, 0x3007 }, { 0x3021, 0x3029 }, { 0x3031, 0x3035 },
+	{ 0x3040, 0x30FF }, { 0x31F0, 0x31FF }, { 0x3400, 0x4DBF },
+	{ 0x4E00, 0x9FFF }, { 0xF900, 0xFAFF }, { 0xFF66, 0xFF9F },
+	{ 0x20000, 0x3FFFF },
+};
+
+enum { SEPARATOR, LETTER, SYLLABLE };
+
+#define IN_RANGES(cp, r) in_ranges(cp, r, sizeof r / sizeof *r)
+
+static bool
+in_ranges(uint32_t cp, const void *ranges, size_t count)
+{
+	const struct { uint32_t lo, hi; } *r = ranges;
+	size_t lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cp < r[mid].lo) hi = mid;
+		else if (cp > r[mid].hi) lo = mid + 1;
+		else return true;
+	}
+	return false;
+}
+
+static bool
+is_alnum(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+/* Decodes the UTF-8 character at *p and returns its class. A malformed
+ * byte counts as a letter of its own, so that text in an undeclared
+ * charset is split up like before it was converted to UTF-8. */
+static int
+next_char(const unsigned char **p, const unsigned char *end)
+{
+	const unsigned char *c = *p;
+	uint32_t cp;
+	int n, i;
+
+	if (*c < 0x80) {
+		*p = c + 1;
+		return is_alnum(*c) ? LETTER : SEPARATOR;
+	}
+	if (*c >= 0xC2 && *c <= 0xDF) n = 1, cp = *c & 0x1F;
+	else if (*c >= 0xE0 && *c <= 0xEF) n = 2, cp = *c & 0x0F;
+	else if (*c >= 0xF0 && *c <= 0xF4) n = 3, cp = *c & 0x07;
+	else n = 0, cp = 0;
+	if (!n || end - c <= n) {
+		*p = c + 1;
+		return LETTER;
+	}
+	for (i = 1; i <= n; i++) {
+		if ((c[i] & 0xC0) != 0x80) {
+			*p = c + 1;
+			return LETTER;
+		}
+		cp = cp << 6 | (c[i] & 0x3F);
+	}
+	*p = c + n + 1;
+	if (IN_RANGES(cp, separators)) return SEPARATOR;
+	if (IN_RANGES(cp, unspaced)) return SYLLABLE;
+	return LETTER;
+}
+
+static void
+add_word(struct words *w, const unsigned char *start, size_t len)
+{
+	char word[MAX_WORD];
+	size_t i;
+
+	if (len < MIN_WORD) return;
+	for (i = 0; i < len; i++)
+		word[i] = start[i] >= 'A' && start[i] <= 'Z' ? start[i] - 'A' + 'a' : start[i];
+	if (w->count == w->capacity) {
+		w->capacity = w->capacity ? 2 * w->capacity : 256;
+		if (!(w->hashes = realloc(w->hashes, w->capacity * sizeof *w->hashes)))
+			die("realloc():");
+	}
+	w->hashes[w->count++] = hash_bytes(word, len, WORD_SEED);
+}
+
+/* Splits text into words: runs of letters and digits between spaces,
+ * punctuation and symbols, of which only the first MAX_WORD bytes count.
+ * Scripts without spaces are split into every single character and every
+ * pair of neighbouring characters instead, so that a search for a few
+ * characters finds them in the middle of a longer run, too. ASCII letters
+ * are lowercased. */
+void
+collect_words(struct words *w, const char *text, size_t length)
+{
+	const unsigned char *c = (const unsigned char *) text, *end = c + length;
+	const unsigned char *start, *prev, *last;
+	int class;
+
+	while (c < end) {
+		/* most text is ASCII, which needs no decoding */
+		if (*c < 0x80 && !is_alnum(*c)) {
+			c++;
+			continue;
+		}
+		start = c;
+		if ((class = next_char(&c, end)) == SEPARATOR) continue;
+		if (class == SYLLABLE) {
+			add_word(w, start, c - start);
+			while (c < end) {
+				prev = start;
+				start = c;
+				if (next_char(&c, end) != SYLLABLE) {
+					c = start;
+					break;
+				}
+				add_word(w, start, c - start);
+				add_word(w, prev, c - prev);
+			}
+			continue;
+		}
+		for (last = c; c < end; ) {
+			prev = c;
+			if (*c < 0x80 ? !is_alnum(*c++) : next_char(&c, end) != LETTER) {
+				c = prev;
+				break;
+			}
+			if (c - start <= MAX_WORD) last = c;
+		}
+		add_word(w, start, last - start);
+	}
+}
+
+void
+free_words(struct words *w)
+{
+	free(w->hashes);
+	*w = (struct words) { 0 };
+}
+
+static int
+compare_hashes(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+void
+add_to_index(MSG msg, struct words *w)
+{
+	size_t i;
+
+	open_index();
+	qsort(w->hashes, w->count, sizeof *w->hashes, compare_hashes);
+	for (i = 0; i < w->count; i++) {
+		if (i && w->hashes[i] == w->hashes[i-1]) continue;
+		if (nbatch == capbatch) {
+			capbatch = capbatch ? 2 * capbatch : 4096;
+			if (!(batch = realloc(batch, capbatch * sizeof *batch)))
+				die("realloc():");
+		}
+		batch[nbatch++] = (struct posting) { w->hashes[i], msg };
+	}
+	batch_end = next_in_log(msg);
+	if (nbatch >= INDEX_BATCH)
+		write_batch();
+}
+
+/* A sorted list of MSGs, as an operand of a query. */
+struct msglist {
+	MSG   *msgs;
+	size_t count;
+};
+
+static void
+find_word(const struct segmap *maps, uint64_t hash, struct msglist *res)
+{
+	const unsigned char *ent;
+	size_t i, lo, hi, mid, first, count, j;
+
+	res->msgs = NULL;
+	res->count = 0;
+	for (i = 0; i < nsegs; i++) {
+		for (lo = 0, hi = maps[i].nwords; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (get_le64(word_entry(&maps[i], mid)) < hash) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == maps[i].nwords) continue;
+		ent = word_entry(&maps[i], lo);
+		if (get_le64(ent) != hash) continue;
+		first = get_le64(ent + 8);
+		count = get_le64(ent + 16);
+		if (first > maps[i].npostings || count > maps[i].npostings - first)
+			die("search index is corrupted.");
+		if (!(res->msgs = realloc(res->msgs, (res->count + count) * sizeof *res->msgs)))
+			die("realloc():");
+		for (j = 0; j < count; j++) {
+			res->msgs[res->count] = get_le64(postings_of(&maps[i]) + 8 * (first + j));
+			/* a crash during a merge can leave postings in two segments */
+			if (!res->count || res->msgs[res->count] > res->msgs[res->count-1])
+				res->count++;
+		}
+	}
+}
+
+/* Combines two lists: op is '&' for the intersection, '|' for the
+ * union and '-' for the difference. Frees both inputs. */
+static struct msglist
+combine(struct msglist a, struct msglist b, char op)
+{
+	struct msglist r;
+	size_t i = 0, j = 0;
+
+	if (!(r.msgs = malloc((a.count + b.count + 1) * sizeof *r.msgs)))
+		die("malloc():");
+	r.count = 0;
+	while (i < a.count || j < b.count) {
+		if (j == b.count || (i < a.count && a.msgs[i] < b.msgs[j])) {
+			if (op != '&') r.msgs[r.count++] = a.msgs[i];
+			i++;
+		} else if (i == a.count || b.msgs[j] < a.msgs[i]) {
+			if (op == '|') r.msgs[r.count++] = b.msgs[j];
+			j++;
+		} else {
+			if (op != '-') r.msgs[r.count++] = a.msgs[i];
+			i++, j++;
+		}
+	}
+	free(a.msgs);
+	free(b.msgs);
+	return r;
+}
+
+/* All words of one argument have to appear. */
+static struct msglist
+find_argument(const struct segmap *maps, const char *arg)
+{
+	struct words w = { 0 };
+	struct msglist res = { 0 }, next;
+	size_t i;
+
+	collect_words(&w, arg, strlen(arg));
+	if (!w.count)
+		die("'%s' contains no word that can be searched for.", arg);
+	for (i = 0; i < w.count; i++) {
+		find_word(maps, w.hashes[i], &next);
+		res = i ? combine(res, next, '&') : next;
+	}
+	free_words(&w);
+	return res;
+}
+
+MSG *
+search_index(int argc, char *argv[], size_t *count)
+{
+	struct segmap *maps;
+	struct msglist res = { 0 }, excl = { 0 }, clause, next;
+	bool have = false;
+	size_t i;
+	int a;
+
+	/* A run may merge segments meanwhile: it writes the merged one under
+	 * the number of the first, and then removes the second. In between,
+	 * both cover the same records, which their ends give away. */
+	for (;;) {
+		load_index(false);
+		if (!(maps = calloc(nsegs + 1, sizeof *maps)))
+			die("calloc():");
+		for (i = 0; i < nsegs && map_segment(segs[i].number, &maps[i]) == MAPPED; i++) {
+			if (i && maps[i].end <= maps[i-1].end) {
+				unmap_segment(&maps[i]);
+				break;
+			}
+		}
+		if (i == nsegs) break;
+		while (i-- > 0)
+			unmap_segment(&maps[i]);
+		free(maps);
+		close_index();
+	}
+
+	for (a = 0; a < argc; a++) {
+		if (argv[a][0] == '-') {
+			next = find_argument(maps, argv[a] + 1);
+			excl = combine(excl, next, '|');
+			continue;
+		}
+		if (!strcmp(argv[a], "OR"))
+			die("OR has to stand between two words.");
+		clause = find_argument(maps, argv[a]);
+		while (a + 2 < argc && !strcmp(argv[a+1], "OR") && argv[a+2][0] != '-') {
+			next = find_argument(maps, argv[a+2]);
+			clause = combine(clause, next, '|');
+			a += 2;
+		}
+		res = have ? combine(res, clause, '&') : clause;
+		have = true;
+	}
+	if (!have)
+		die("a query needs at least one word that is not excluded.");
+	res = combine(res, excl, '-');
+
+	for (i = 0; i < nsegs; i++)
+		unmap_segment(&maps[i]);
+	free(maps);
+	*count = res.count;
+	return res.msgs;
+}
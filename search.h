@@ -0,0 +1,29 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdint.h>
+
+/* The distinct words of a message. They are collected before taking the
+ * commit lock, so that tokenizing doesn't hold up the other workers. */
+struct words {
+	uint64_t *hashes;
+	size_t    count;
+	size_t    capacity;
+};
+
+void open_index(void);
+/* Writes out the postings that are still in memory. */
+void flush_index(void);
+void close_index(void);
+/* The log offset up to which all records are indexed. */
+MSG  index_mark(void);
+
+void collect_words(struct words *w, const char *text, size_t length);
+void free_words(struct words *w);
+/* Adds the words of a freshly logged message to the index. */
+void add_to_index(MSG msg, struct words *w);
+
+/* Finds the messages that match a query. Words in the same argument
+ * must all appear, "OR" between two arguments allows either of them,
+ * and a leading '-' excludes messages with the word. Returns the MSGs
+ * of the matches in log order; the array has to be freed. */
+MSG *search_index(int argc, char *argv[], size_t *count);
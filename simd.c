@@ -0,0 +1,304 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Vectorized versions of the hottest loops
+ *
+ * Every function has a portable implementation. On x86, there are also
+ * SSE2 (or SSSE3) and AVX2 implementations, and init_simd() picks the best
+ * one that the CPU supports at runtime. All of them give exactly the same
+ * results.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+
+/* characters that have to be escaped in HTML, plus NUL */
+static const unsigned char html_special[256] = {
+	['\0'] = 1, ['"'] = 1, ['&'] = 1, ['<'] = 1, ['>'] = 1,
+};
+
+size_t
+scan_html_scalar(const char *mem, size_t length)
+{
+	const unsigned char *c = (const unsigned char *) mem;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		if (html_special[c[i]]) break;
+	}
+	return i;
+}
+
+/* values of the base64 digits, or 0xFF for anything else */
+static const unsigned char base64_value[256] = {
+	[0 ... 255] = 0xFF,
+	['A'] =  0, ['B'] =  1, ['C'] =  2, ['D'] =  3, ['E'] =  4, ['F'] =  5,
+	['G'] =  6, ['H'] =  7, ['I'] =  8, ['J'] =  9, ['K'] = 10, ['L'] = 11,
+	['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16, ['R'] = 17,
+	['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+	['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29,
+	['e'] = 30, ['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+	['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40, ['p'] = 41,
+	['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+	['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53,
+	['2'] = 54, ['3'] = 55, ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
+	['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+};
+
+size_t
+base64_run_scalar(const char *mem, size_t length, char *out)
+{
+	const unsigned char *c = (const unsigned char *) mem;
+	uint32_t a, b, d, e;
+	size_t i;
+
+	for (i = 0; length - i >= 4; i += 4) {
+		a = base64_value[c[i]];
+		b = base64_value[c[i+1]];
+		d = base64_value[c[i+2]];
+		e = base64_value[c[i+3]];
+		if ((a | b | d | e) & 0x80) break;
+		a = a << 18 | b << 12 | d << 6 | e;
+		*out++ = a >> 16;
+		*out++ = a >> 8;
+		*out++ = a;
+	}
+	return i;
+}
+
+size_t
+qp_run_scalar(const char *mem, size_t length, char *out)
+{
+	const char *eq = memchr(mem, '=', length);
+	size_t run = eq ? (size_t) (eq - mem) : length;
+	memmove(out, mem, run);
+	return run;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static size_t
+sse2_scan_html(const char *mem, size_t length)
+{
+	const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+	const __m128i amp = _mm_set1_epi8('&'), quot = _mm_set1_epi8('"');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v, m;
+	size_t i;
+	int mask;
+
+	for (i = 0; length - i >= 16; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (mem + i));
+		m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nul));
+		if ((mask = _mm_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_html_scalar(mem + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+avx2_scan_html(const char *mem, size_t length)
+{
+	const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>');
+	const __m256i amp = _mm256_set1_epi8('&'), quot = _mm256_set1_epi8('"');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v, m;
+	size_t i;
+	uint32_t mask;
+
+	for (i = 0; length - i >= 32; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (mem + i));
+		m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nul));
+		if ((mask = _mm256_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+	return i + sse2_scan_html(mem + i, length - i);
+}
+
+/* Translates and packs 16 base64 digits into 12 bytes in the low part of
+ * the result. Sets *bad if any of them isn't a valid digit.
+ * See Wojciech Mula's work on base64 decoding with SIMD instructions. */
+__attribute__((target("ssse3")))
+static inline __m128i
+ssse3_unbase64(__m128i v, int *bad)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask = _mm_set1_epi8(0x2F);
+	__m128i hi, lo, roll;
+
+	hi = _mm_and_si128(_mm_srli_epi32(v, 4), mask);
+	lo = _mm_and_si128(v, mask);
+	lo = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+	*bad = _mm_movemask_epi8(_mm_cmpeq_epi8(lo, _mm_setzero_si128())) != 0xFFFF;
+
+	roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask), hi));
+	v = _mm_add_epi8(v, roll);
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(v, _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* The SIMD base64 and QP loops only ever store a whole vector after they
+ * have consumed all of its input, so they never overwrite unread input
+ * when out lies before mem in the same buffer. */
+
+__attribute__((target("ssse3")))
+static size_t
+ssse3_base64_run(const char *mem, size_t length, char *out)
+{
+	__m128i v;
+	size_t i;
+	int bad;
+
+	for (i = 0; length - i >= 16; i += 16) {
+		v = ssse3_unbase64(_mm_loadu_si128((const __m128i *) (mem + i)), &bad);
+		if (bad) break;
+		_mm_storeu_si128((__m128i *) out, v);
+		out += 12;
+	}
+	return i + base64_run_scalar(mem + i, length - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t
+avx2_base64_run(const char *mem, size_t length, char *out)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i mask = _mm256_set1_epi8(0x2F);
+	__m256i v, hi, lo, roll;
+	size_t i;
+
+	for (i = 0; length - i >= 32; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (mem + i));
+		hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask);
+		lo = _mm256_and_si256(v, mask);
+		lo = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi));
+		if (!_mm256_testz_si256(lo, lo)) break;
+
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask), hi));
+		v = _mm256_add_epi8(v, roll);
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack);
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *) out, v);
+		out += 24;
+	}
+	return i + base64_run_scalar(mem + i, length - i, out);
+}
+
+__attribute__((target("sse2")))
+static size_t
+sse2_qp_run(const char *mem, size_t length, char *out)
+{
+	const __m128i eq = _mm_set1_epi8('=');
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for (i = 0; length - i >= 16; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (mem + i));
+		if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, eq)))) {
+			memmove(out + i, mem + i, __builtin_ctz(mask));
+			return i + __builtin_ctz(mask);
+		}
+		_mm_storeu_si128((__m128i *) (out + i), v);
+	}
+	return i + qp_run_scalar(mem + i, length - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+avx2_qp_run(const char *mem, size_t length, char *out)
+{
+	const __m256i eq = _mm256_set1_epi8('=');
+	__m256i v;
+	size_t i;
+	uint32_t mask;
+
+	for (i = 0; length - i >= 32; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (mem + i));
+		if ((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, eq)))) {
+			memmove(out + i, mem + i, __builtin_ctz(mask));
+			return i + __builtin_ctz(mask);
+		}
+		_mm256_storeu_si256((__m256i *) (out + i), v);
+	}
+	return i + sse2_qp_run(mem + i, length - i, out + i);
+}
+
+size_t (*const scan_html_sse2)(const char *, size_t) = sse2_scan_html;
+size_t (*const scan_html_avx2)(const char *, size_t) = avx2_scan_html;
+size_t (*const base64_run_ssse3)(const char *, size_t, char *) = ssse3_base64_run;
+size_t (*const base64_run_avx2)(const char *, size_t, char *) = avx2_base64_run;
+size_t (*const qp_run_sse2)(const char *, size_t, char *) = sse2_qp_run;
+size_t (*const qp_run_avx2)(const char *, size_t, char *) = avx2_qp_run;
+
+#else
+
+size_t (*const scan_html_sse2)(const char *, size_t) = NULL;
+size_t (*const scan_html_avx2)(const char *, size_t) = NULL;
+size_t (*const base64_run_ssse3)(const char *, size_t, char *) = NULL;
+size_t (*const base64_run_avx2)(const char *, size_t, char *) = NULL;
+size_t (*const qp_run_sse2)(const char *, size_t, char *) = NULL;
+size_t (*const qp_run_avx2)(const char *, size_t, char *) = NULL;
+
+#endif
+
+size_t (*scan_html)(const char *, size_t) = scan_html_scalar;
+size_t (*base64_run)(const char *, size_t, char *) = base64_run_scalar;
+size_t (*qp_run)(const char *, size_t, char *) = qp_run_scalar;
+
+void
+init_simd(void)
+{
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_html  = avx2_scan_html;
+		base64_run = avx2_base64_run;
+		qp_run     = avx2_qp_run;
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_html  = sse2_scan_html;
+		qp_run     = sse2_qp_run;
+		if (__builtin_cpu_supports("ssse3"))
+			base64_run = ssse3_base64_run;
+	}
+#endif
+}
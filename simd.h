@@ -0,0 +1,34 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+
+/* Picks the fastest implementations that the CPU supports.
+ * Until it is called, the portable implementations are used. */
+void init_simd(void);
+
+/* Returns the length of the initial run of mem that contains
+ * none of the characters that encode_html() has to escape. */
+extern size_t (*scan_html)(const char *mem, size_t length);
+
+/* The individual implementations behind scan_html. Those that the
+ * CPU or compiler doesn't support are NULL. */
+size_t scan_html_scalar(const char *mem, size_t length);
+extern size_t (*const scan_html_sse2)(const char *mem, size_t length);
+extern size_t (*const scan_html_avx2)(const char *mem, size_t length);
+
+/* Decodes the longest prefix of mem that consists of whole groups of four
+ * base64 digits to out, and returns its length. Writes 3 bytes for every 4
+ * that it consumes. out may lie before mem in the same buffer. */
+extern size_t (*base64_run)(const char *mem, size_t length, char *out);
+
+size_t base64_run_scalar(const char *mem, size_t length, char *out);
+extern size_t (*const base64_run_ssse3)(const char *mem, size_t length, char *out);
+extern size_t (*const base64_run_avx2)(const char *mem, size_t length, char *out);
+
+/* Copies mem to out up to the first '=' and returns the number of bytes
+ * copied. out may lie before mem in the same buffer. */
+extern size_t (*qp_run)(const char *mem, size_t length, char *out);
+
+size_t qp_run_scalar(const char *mem, size_t length, char *out);
+extern size_t (*const qp_run_sse2)(const char *mem, size_t length, char *out);
+extern size_t (*const qp_run_avx2)(const char *mem, size_t length, char *out);
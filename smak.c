@@ -3,6 +3,8 @@
  * A mailing list web archiver
  */
 
+#define _GNU_SOURCE /* ppoll() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,30 +18,144 @@
 #include <strings.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "arg.h"
+#include "charset.h"
 #include "mail.h"
 #include "util.h"
+#include "simd.h"
+#include "stats.h"
+#include "mbox.h"
 #include "smakdir.h"
+#include "author.h"
+#include "feed.h"
+#include "search.h"
+#include "thread.h"
 #include "config.h"
 
-extern void generate_html(const char *uniq, const char *info[], char *body, size_t length);
+extern void init_templates(void);
+extern void generate_html(const char *uniq, const char *info[], const struct threadnav *nav, const struct body *body);
+extern void generate_attachments(const char *uniq, time_t time, const struct body *body, bool replace);
 extern void generate_html_report(const struct report *rpt);
+extern void generate_html_overview(const struct summary *sum);
+extern void generate_html_author(const struct report *rpt, AUTHOR author);
+extern uint64_t page_version(enum pagekind kind);
+extern void page_dir(char *dir, enum layout layout, const char *uniq, time_t time);
 
 char *argv0;
 
-char *aether_base;
-char *aether_cursor;
+/* A parsed message, split into its MIME parts. Normally it is mapped into
+ * memory and the text parts are decoded in place. Messages bigger than
+ * STREAM_THRESHOLD are not mapped: only their header is read, their parts
+ * are found by reading the file piece by piece, and they are decoded
+ * while the page is written. */
+struct message {
+	const char *info[MNUMINFO];
+	const char *references;
+	char  *text;  /* the message, or only its header if it is not mapped */
+	size_t size;
+	struct body body;
+	char  *map;   /* the mapping that holds text, or NULL */
+	size_t maplen;
+};
+
+/* Every thread has its own aether, so workers never contend over it. */
+_Thread_local char *aether_base;
+_Thread_local char *aether_cursor;
+
+/* Report entries of all messages processed during this run.
+ * The monthly reports are only updated once at the very end. */
+static struct repent *pending;
+static size_t npending, cappending;
+
+/* Messages in new/ that are waiting to be picked up by a worker. */
+static char **newnames;
+static size_t nnewnames, nextnewname;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes all updates of the log and the pending report entries,
+ * so that MSG offsets stay consistent. */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Messages that were processed, but are still in new/. They are moved to
+ * cur/ in batches, once everything that was written for them is on disk,
+ * so that a crash can never lose a message. */
+struct done {
+	const char *name;
+	char flag;
+};
+static struct done *batch;
+static size_t nbatch, capbatch;
+static uint64_t batch_started;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes the commits of batches. */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+/* www/ may be a link to another file system, which is flushed separately. */
+static bool separate_www;
+/* The last run was interrupted, so some of the pending report entries
+ * may have made it into the reports already. */
+static bool recovered;
+
+/* Pages to regenerate, which are spread over the jobs just like
+ * the messages in new/ (see rebuild()). */
+static void (*work)(size_t);
+static size_t nwork, nextwork;
+static MSG *rebuild_msgs;
+static size_t nrebuild_msgs, caprebuild_msgs;
+static struct summary rebuild_sum;
+static bool rebuild_attachments;
+
+/* Messages in cur/ that the import command goes through, and which of
+ * them are in the log already. While importing, no message pages are
+ * written until all messages are threaded, so each is written only once. */
+static char **curnames;
+static size_t ncurnames;
+static bool *logged;
+static bool importing;
+
+/* The mbox that import-mbox goes through. Its messages are handed out to
+ * the jobs in order, and each job only maps the message it works on. */
+static const char *mboxpath;
+static unsigned mboxid;
+static int mboxfd;
+static off_t mboxsize, mboxnext;
+/* offsets of its messages that an interrupted import has logged, sorted */
+static off_t *mboxlogged;
+static size_t nmboxlogged;
+
+static int jobs = 1;
+static bool jobs_given;
+/* whether to keep running and watch new/ (-d) */
+static bool watching;
+
+static void
+create_aether(void)
+{
+	aether_base = mmap(NULL, MAX_AETHER_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (aether_base == MAP_FAILED)
+		die("cannot allocate aether:");
+	aether_cursor = aether_base;
+}
+
+static void
+destroy_aether(void)
+{
+	munmap(aether_base, MAX_AETHER_MEMORY);
+}
 
-/* tenc = transfer encoding: \0=raw, Q=quoted-printable, B=base64 */
 bool
-process_header(char *header, const char *info[], char *tenc)
+process_header(char *header, const char *info[], const char **references, struct mimehdr *mh)
 {
 	char *key, *value, *str;
-	struct token token;
 	struct tm tm;
 
-	*tenc = '\0';
+	init_mimehdr(mh);
 	while (*header) {
 		if (!next_header_field(&header, &key, &value))
 			return false;
@@ -55,190 +171,1557 @@ process_header(char *header, const char *info[], char *tenc)
 			if (!parse_date(value, &tm)) return false;
 			if (aether_cursor - aether_base + 32 > MAX_AETHER_MEMORY)
 				die("not enough aether memory.");
-			snprintf(aether_cursor, 32, "%lld", (long long) mkutctime(&tm));
 			info[MTIME] = aether_cursor;
+			aether_cursor += snprintf(aether_cursor, 32, "%lld", (long long) mkutctime(&tm)) + 1;
 		} else if (!strcasecmp(key, "Message-ID")) {
 			collapse_ws(value);
 			info[MMSGID] = value;
 		} else if (!strcasecmp(key, "In-Reply-To")) {
 			collapse_ws(value);
 			info[MINREPLYTO] = value;
-		} else if (!strcasecmp(key, "Content-Transfer-Encoding")) {
-			token = TOKEN_INIT(value);
-			if (tokenize(&token) != TOKEN_ATOM) return false;
-			if (!strcasecmp(token.atom, "7bit")) {
-				*tenc = '\0';
-			} else if (!strcasecmp(token.atom, "8bit")) {
-				*tenc = '\0';
-			} else if (!strcasecmp(token.atom, "binary")) {
-				*tenc = '\0';
-			} else if (!strcasecmp(token.atom, "quoted-printable")) {
-				*tenc = 'Q';
-			} else if (!strcasecmp(token.atom, "base64")) {
-				*tenc = 'B';
-			} else {
-				return false;
-			}
+		} else if (!strcasecmp(key, "References")) {
+			collapse_ws(value);
+			*references = value;
+		} else if (!parse_mime_field(key, value, mh)) {
+			return false;
 		}
 	}
 	return true;
 }
 
-bool
-process_msg(const char *msgpath, const char *uniq)
+/* Converts a decoded text part to UTF-8. The result goes to the aether,
+ * because it can be longer than the original. */
+static void
+convert_part(struct part *part)
 {
-	const char *info[MNUMINFO];
-	struct stat meta;
-	char *text, *ptr;
-	int fd;
-	char *body;
+	const struct charset *cs;
 	size_t length;
-	char tenc;
 
-	memset(info, 0, sizeof info);
-	info[MUNIQ] = uniq;
-	info[MSUBJECT] = "(no subject)";
-	info[MFROM] = "(no sender)";
-	info[MMSGID] = "";
-	info[MINREPLYTO] = "";
-	info[MTIME] = "-1";
+	if (!(cs = find_charset(part->charset)) || !must_convert(cs, part->mem, part->length))
+		return;
+	/* if the aether is full, the text stays as it is, like that of an unknown charset */
+	if (!convert_all(cs, part->mem, part->length, aether_cursor,
+		MAX_AETHER_MEMORY - (aether_cursor - aether_base), &length))
+		return;
+	part->mem = aether_cursor;
+	part->length = length;
+	aether_cursor += length;
+}
+
+/* Reads the header of a message that is not mapped into the aether. */
+static bool
+read_header(struct message *m, char **body)
+{
+	char *buf = aether_cursor;
+	size_t fill = 0, n;
+
+	do {
+		n = m->size - fill < STREAM_CHUNK ? m->size - fill : STREAM_CHUNK;
+		if (!n || MAX_AETHER_MEMORY - (aether_cursor - aether_base) - fill < n)
+			return false;
+		fill += check_read(m->body.fd, buf + fill, n);
+	} while (!split_header_from_body(buf, fill, body));
+	aether_cursor += *body - buf;
+	m->text = buf;
+	return true;
+}
+
+/* Splits the message into its parts and decodes them. */
+static bool
+parse_msg(const char *uniq, struct message *m)
+{
+	struct mimehdr mh;
+	struct part *part;
+	char *body, *ptr;
+	uint64_t start;
+	size_t i;
+
+	memset(m->info, 0, sizeof m->info);
+	m->info[MUNIQ] = uniq;
+	m->info[MSUBJECT] = "(no subject)";
+	m->info[MFROM] = "(no sender)";
+	m->info[MMSGID] = "";
+	m->info[MINREPLYTO] = "";
+	m->info[MTIME] = "-1";
+	m->references = "";
+	count_stat(CTLOADED, m->size);
+
+	start = start_span();
+	if (m->map ? !split_header_from_body(m->text, m->size, &body) : !read_header(m, &body))
+		return false;
+
+	if (!process_header(m->text, m->info, &m->references, &mh))
+		return false;
+
+	m->body.parts = aether_alloc(MAX_MIME_PARTS * sizeof *m->body.parts);
+	if (m->map)
+		m->body.nparts = split_mime(m->text, body, m->size - (body - m->text), &mh, m->body.parts, MAX_MIME_PARTS);
+	else
+		m->body.nparts = split_mime_file(m->body.fd, body - m->text, m->size - (body - m->text), &mh, m->body.parts, MAX_MIME_PARTS);
+	end_span(STPARSE, start);
+	if (m->size > STREAM_THRESHOLD)
+		return true;
+
+	start = start_span();
+	for (i = 0; i < m->body.nparts; i++) {
+		part = &m->body.parts[i];
+		if (!part->text) continue;
+		part->mem = m->text + part->offset;
+		switch (part->tenc) {
+		case 'Q':
+			ptr = decode_qprintable(part->mem, part->mem, part->length);
+			if (!ptr) return false;
+			part->length = ptr - part->mem;
+			break;
+
+		case 'B':
+			ptr = decode_base64(part->mem, part->mem, part->length);
+			if (!ptr) return false;
+			part->length = ptr - part->mem;
+			break;
+		}
+		count_stat(CTDECODED, part->length);
+		convert_part(part);
+	}
+	end_span(STDECODE, start);
+	return true;
+}
+
+static void
+unload_msg(struct message *m)
+{
+	if (m->map)
+		munmap(m->map, m->maplen);
+	if (m->body.fd >= 0)
+		close(m->body.fd);
+}
+
+static bool
+load_msg(const char *msgpath, const char *uniq, struct message *m)
+{
+	struct stat meta;
+	int fd;
 
 	if ((fd = open(msgpath, O_RDONLY)) < 0)
 		die("cannot open '%s':", msgpath);
 
 	if (fstat(fd, &meta) < 0)
 		die("cannot stat '%s':", msgpath);
+	if (!meta.st_size) {
+		close(fd);
+		return false;
+	}
 
-	text = mmap(NULL, meta.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-	if (text == MAP_FAILED)
-		die("mmap():");
-	close(fd);
+	/* The file stays open, so that attachments can be copied from it. */
+	m->size = meta.st_size;
+	m->map = NULL;
+	if (m->size <= STREAM_THRESHOLD) {
+		m->text = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (m->text == MAP_FAILED)
+			die("mmap():");
+		m->map = m->text;
+		m->maplen = m->size;
+	}
+	m->body.fd = fd;
+	m->body.text = NULL;
+	if (!parse_msg(uniq, m)) {
+		unload_msg(m);
+		return false;
+	}
+	return true;
+}
 
-	if (!split_header_from_body(text, meta.st_size, &body))
+/* Takes over the mapping of a message of an mbox. Its parts are read from
+ * the mapping, since unquoting may have moved them within the message. */
+static bool
+load_mbox_msg(struct mboxmsg *mm, const char *uniq, struct message *m)
+{
+	m->text = mm->text;
+	m->size = mm->size;
+	m->map = mm->map;
+	m->maplen = mm->maplen;
+	m->body.fd = -1;
+	m->body.text = m->text;
+	if (!m->size || !parse_msg(uniq, m)) {
+		unload_msg(m);
 		return false;
-	length = meta.st_size - (body - text);
+	}
+	return true;
+}
+
+/* Loads an archived message, from cur/ or from the mbox it was imported
+ * from. Returns false if it is gone. */
+static bool
+load_archived(const char *uniq, struct message *m)
+{
+	char curpath[MAX_FILENAME_LENGTH];
+	struct mboxmsg mm;
+	struct stat meta;
+	off_t offset;
+	unsigned id;
+	bool found;
+	int fd;
 
-	if (!process_header(text, info, &tenc))
+	if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,a", uniq) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	if (!access(curpath, R_OK))
+		return load_msg(curpath, uniq, m);
+	if (!(id = parse_mbox_uniq(uniq, &offset)) || (fd = open_mbox(id)) < 0)
 		return false;
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	found = map_mbox_msg(fd, meta.st_size, offset, &mm);
+	close(fd);
+	return found && load_mbox_msg(&mm, uniq, m);
+}
 
-	switch (tenc) {
-	case 'Q':
-		ptr = decode_qprintable(body, body, length);
-		if (!ptr) return false;
-		length = ptr - body;
-		break;
-	
-	case 'B':
-		ptr = decode_base64(body, body, length);
-		if (!ptr) return false;
-		length = ptr - body;
-		break;
+/* The unique part of a maildir file name, in front of the info. */
+static size_t
+uniq_length(const char *name)
+{
+	const char *colon = strrchr(name, ':');
+	return colon ? (size_t) (colon - name) : strlen(name);
+}
+
+static int
+compare_uniqs(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	return c ? c : (alen > blen) - (alen < blen);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	const char *x = *(char *const *) a, *y = *(char *const *) b;
+	return compare_uniqs(x, uniq_length(x), y, uniq_length(y));
+}
+
+/* Returns the index of the name with the given unique part
+ * in the sorted names, or count if there is none. */
+static size_t
+find_name(char **names, size_t count, const struct field *uniq)
+{
+	size_t lo = 0, hi = count, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = compare_uniqs(uniq->str, uniq->len, names[mid], uniq_length(names[mid]));
+		if (!cmp) return mid;
+		if (cmp < 0) hi = mid; else lo = mid + 1;
 	}
+	return count;
+}
 
-	generate_html(uniq, info, body, length);
-	MSG msg = add_to_log(info);
+static uint64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	time_t time = atoll(info[MTIME]);
-	struct tm *tm = gmtime(&time);
-	struct report rpt;
+static void
+add_pending(time_t time, MSG msg)
+{
+	if (npending == cappending) {
+		cappending = cappending ? 2 * cappending : 64;
+		if (!(pending = realloc(pending, cappending * sizeof *pending)))
+			die("realloc():");
+	}
+	pending[npending++] = (struct repent) { time, msg };
+}
 
-	/* TODO generate reports later on; only regenerate dirty reports once; only map log once. */
+/* Collects the words of the subject and of the text parts. Streamed
+ * bodies are not in memory, so only their subject is searchable. */
+static void
+collect_msg_words(const struct message *m, struct words *w)
+{
+	size_t i;
+
+	collect_words(w, m->info[MSUBJECT], strlen(m->info[MSUBJECT]));
+	for (i = 0; i < m->body.nparts; i++) {
+		if (m->body.parts[i].text && m->body.parts[i].mem)
+			collect_words(w, m->body.parts[i].mem, m->body.parts[i].length);
+	}
+}
+
+/* Archives a loaded message, and unloads it. Returns 'a' if it was
+ * archived, and 'd' if it is a duplicate. */
+static char
+archive_msg(const char *uniq, struct message *m)
+{
+	struct threadnav nav;
+	struct words words = { 0 };
+	uint64_t start;
+	NODE node;
+	MSG msg;
+
+	collect_msg_words(m, &words);
+
+	start = start_span();
+	pthread_mutex_lock(&commit_lock);
+	end_span(STWAIT, start);
+	start = start_span();
+	if (*m->info[MMSGID] && lookup_msgid(m->info[MMSGID]) != NO_MSG) {
+		pthread_mutex_unlock(&commit_lock);
+		end_span(STCOMMIT, start);
+		free_words(&words);
+		unload_msg(m);
+		return 'd';
+	}
+	msg = add_to_log(m->info);
+	node = add_to_threads(msg, m->info[MMSGID], m->references, m->info[MINREPLYTO]);
+	add_to_index(msg, &words);
+	if (!importing)
+		thread_nav(node, &nav);
+	add_pending(atoll(m->info[MTIME]), msg);
+	add_to_feed(atoll(m->info[MTIME]), uniq, m->info[MSUBJECT], m->info[MFROM]);
+	pthread_mutex_unlock(&commit_lock);
+	end_span(STCOMMIT, start);
+	free_words(&words);
+
+	start = start_span();
+	if (!importing)
+		generate_html(uniq, m->info, &nav, &m->body);
+	generate_attachments(uniq, atoll(m->info[MTIME]), &m->body, true);
+	end_span(STRENDER, start);
+
+	unload_msg(m);
+	return 'a';
+}
+
+/* Returns the maildir flag that the message gets in cur/:
+ * 'a' if it was archived, 'd' if it is a duplicate, and 'e' on errors. */
+char
+process_msg(const char *msgpath, const char *uniq)
+{
+	struct message m;
+
+	if (!load_msg(msgpath, uniq, &m))
+		return 'e';
+	return archive_msg(uniq, &m);
+}
+
+/* Regenerate the pages of all messages whose thread context changed,
+ * i.e. whose parent or replies are different now. */
+void
+update_threads(void)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	struct message m;
+	struct threadnav nav;
+	struct record rec;
+	NODE *dirty;
+	size_t count, i;
+
+	dirty = take_dirty_threads(&count);
 	map_log();
-	read_report(&rpt, tm->tm_year + 1900, tm->tm_mon + 1);
-	add_to_report(&rpt, time, msg);
-	write_report(&rpt);
-	generate_html_report(&rpt);
-	close_report(&rpt);
+	for (i = 0; i < count; i++) {
+		read_from_log(thread_msg(dirty[i]), &rec);
+		if (rec.info[MUNIQ].len >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		memcpy(uniq, rec.info[MUNIQ].str, rec.info[MUNIQ].len + 1);
+		/* the message may have been removed from cur/ since */
+		if (!load_archived(uniq, &m))
+			continue;
+
+		thread_nav(dirty[i], &nav);
+		generate_html(uniq, m.info, &nav, &m.body);
+		generate_attachments(uniq, atoll(m.info[MTIME]), &m.body, false);
+		unload_msg(&m);
+
+		note_aether();
+		aether_cursor = aether_base;
+	}
+	free(dirty);
+}
+
+/* Index the records that the search index is missing, e.g. because
+ * an earlier run was interrupted or smak was upgraded. */
+static void
+catch_up_index(void)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	struct message m;
+	struct record rec;
+	struct words words = { 0 };
+	MSG msg;
+
+	map_log();
+	for (msg = index_mark(); msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		if (rec.info[MUNIQ].len >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		memcpy(uniq, rec.info[MUNIQ].str, rec.info[MUNIQ].len + 1);
+		/* without the message, at least its subject can be found */
+		if (!load_archived(uniq, &m)) {
+			collect_words(&words, rec.info[MSUBJECT].str, rec.info[MSUBJECT].len);
+		} else {
+			collect_msg_words(&m, &words);
+			unload_msg(&m);
+		}
+		add_to_index(msg, &words);
+		words.count = 0;
+
+		note_aether();
+		aether_cursor = aether_base;
+	}
+	free_words(&words);
+}
+
+static int
+compare_repents(const void *a, const void *b)
+{
+	const struct repent *x = a, *y = b;
+	if (x->time != y->time) return x->time < y->time ? -1 : 1;
+	return x->msg < y->msg ? -1 : x->msg > y->msg;
+}
+
+/* Prints the messages that match the query, newest first. */
+static void
+search(int argc, char *argv[])
+{
+	struct record rec;
+	struct repent *found;
+	struct tm tm;
+	char date[32];
+	MSG *msgs;
+	size_t count, i;
+
+	msgs = search_index(argc, argv, &count);
+	if (!(found = calloc(count + 1, sizeof *found)))
+		die("calloc():");
+	map_log();
+	for (i = 0; i < count; i++) {
+		read_from_log(msgs[i], &rec);
+		found[i] = (struct repent) { rec.time, msgs[i] };
+	}
+	qsort(found, count, sizeof *found, compare_repents);
+	for (i = count; i-- > 0; ) {
+		read_from_log(found[i].msg, &rec);
+		gmtime_r(&rec.time, &tm);
+		strftime(date, sizeof date, "%Y-%m-%d %H:%M", &tm);
+		printf("%s\t%s\t%s\n", date, rec.info[MUNIQ].str, rec.info[MSUBJECT].str);
+	}
 	unmap_log();
+	free(found);
+	free(msgs);
+}
 
-	munmap(text, meta.st_size);
-	return true;
+/* Merge all pending entries into their monthly reports.
+ * Each dirty report is updated and rendered exactly once.
+ * The overview page is regenerated if any counters changed. */
+void
+update_reports(void)
+{
+	struct report rpt;
+	struct summary sum;
+	struct tm tm;
+	time_t now = time(NULL);
+	size_t i, j, count;
+	int year, month;
+
+	load_summary(&sum);
+	if (!npending && !sum.changed) {
+		save_summary(&sum);
+		return;
+	}
+
+	/* sorting by time groups the entries by month as well */
+	qsort(pending, npending, sizeof *pending, compare_repents);
+
+	map_log();
+	for (i = 0; i < npending; i = j) {
+		gmtime_r(&pending[i].time, &tm);
+		year  = tm.tm_year + 1900;
+		month = tm.tm_mon + 1;
+
+		for (j = i; j < npending; j++) {
+			gmtime_r(&pending[j].time, &tm);
+			if (tm.tm_year + 1900 != year || tm.tm_mon + 1 != month) break;
+		}
+		open_report(&rpt, year, month);
+		count = j - i;
+		if (recovered)
+			count = drop_merged(&rpt, &pending[i], count);
+		merge_into_report(&rpt, &pending[i], count);
+		update_summary(&sum, &rpt, now);
+		generate_html_report(&rpt);
+		close_report(&rpt);
+	}
+
+	if (sum.changed)
+		generate_html_overview(&sum);
+	save_summary(&sum);
+
+	free(pending);
+	pending = NULL;
+	npending = cappending = 0;
 }
 
+/* Files the messages of this run under their authors
+ * and regenerates the pages of the authors that got new ones. */
 void
-process_new_dir(void)
+update_author_pages(void)
+{
+	struct report rpt;
+	AUTHOR *touched;
+	size_t count, i;
+
+	touched = update_authors(recovered, &count);
+	for (i = 0; i < count; i++) {
+		open_author_report(&rpt, touched[i]);
+		generate_html_author(&rpt, touched[i]);
+		close_report(&rpt);
+	}
+	free(touched);
+}
+
+/* Flushes everything that was written for a batch of processed messages
+ * to disk, and then moves them to cur/. One flush for many messages is
+ * much cheaper than one per message. */
+static void
+commit_batch(void)
 {
-	DIR *dir;
-	struct dirent *ent;
 	char uniq[MAX_FILENAME_LENGTH];
 	char newpath[MAX_FILENAME_LENGTH];
 	char curpath[MAX_FILENAME_LENGTH];
-	char *colon;
+	struct done *done;
+	uint64_t start;
+	size_t count, len, i;
+
+	pthread_mutex_lock(&sync_lock);
+	pthread_mutex_lock(&batch_lock);
+	done = batch;
+	count = nbatch;
+	batch = NULL;
+	nbatch = capbatch = 0;
+	pthread_mutex_unlock(&batch_lock);
+
+	if (count) {
+		start = start_span();
+		flush_fs("smak");
+		if (separate_www)
+			flush_fs("www");
+		end_span(STSYNC, start);
+
+		start = start_span();
+		for (i = 0; i < count; i++) {
+			if ((len = uniq_length(done[i].name)) >= MAX_FILENAME_LENGTH)
+				die("file path is too long.");
+			memcpy(uniq, done[i].name, len);
+			uniq[len] = '\0';
+			if (snprintf(newpath, MAX_FILENAME_LENGTH, "new/%s", done[i].name) >= MAX_FILENAME_LENGTH)
+				die("file path is too long.");
+			if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,%c", uniq, done[i].flag) >= MAX_FILENAME_LENGTH)
+				die("file path is too long.");
+			rename(newpath, curpath);
+		}
+		flush_dir("new");
+		flush_dir("cur");
+		end_span(STRENAME, start);
+	}
+	pthread_mutex_unlock(&sync_lock);
+	free(done);
+}
+
+/* Adds a processed message to the batch, and commits the batch
+ * if it is full or its oldest message has waited long enough. */
+static void
+queue_done(const char *name, char flag)
+{
+	bool due;
 
-	if (!(dir = opendir("new")))
-		die("cannot open directory 'new':");
+	pthread_mutex_lock(&batch_lock);
+	if (nbatch == capbatch) {
+		capbatch = capbatch ? 2 * capbatch : 64;
+		if (!(batch = realloc(batch, capbatch * sizeof *batch)))
+			die("realloc():");
+	}
+	batch[nbatch++] = (struct done) { name, flag };
+	if (nbatch == 1)
+		batch_started = monotonic_ms();
+	due = nbatch >= COMMIT_BATCH || monotonic_ms() - batch_started >= COMMIT_LATENCY;
+	pthread_mutex_unlock(&batch_lock);
+	if (due)
+		commit_batch();
+}
+
+static void
+process_new_msg(const char *name)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	char newpath[MAX_FILENAME_LENGTH];
+	size_t len;
+	char flag;
+
+	if ((len = uniq_length(name)) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	memcpy(uniq, name, len);
+	uniq[len] = '\0';
+
+	if (snprintf(newpath, MAX_FILENAME_LENGTH, "new/%s", name) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	flag = process_msg(newpath, uniq);
+	count_stat(CTMESSAGES, 1);
+	if (flag == 'e') count_stat(CTREJECTED, 1);
+	if (flag == 'd') count_stat(CTDUPLICATES, 1);
+	queue_done(name, flag);
+
+	/* clear aether after every message */
+	note_aether();
+	aether_cursor = aether_base;
+}
+
+static const char *
+next_new_msg(void)
+{
+	const char *name = NULL;
+	pthread_mutex_lock(&queue_lock);
+	if (nextnewname < nnewnames)
+		name = newnames[nextnewname++];
+	pthread_mutex_unlock(&queue_lock);
+	return name;
+}
+
+static void *
+worker(void *arg)
+{
+	const char *name;
+
+	(void) arg;
+	create_aether();
+	while ((name = next_new_msg()))
+		process_new_msg(name);
+	close_charsets();
+	destroy_aether();
+	merge_stats();
+	return NULL;
+}
+
+/* Runs fn in each of the jobs, and waits for all of them to finish. */
+static void
+run_workers(void *(*fn)(void *))
+{
+	pthread_t *threads;
+	int t, err;
+
+	if (!(threads = calloc(jobs, sizeof *threads)))
+		die("calloc():");
+	for (t = 0; t < jobs; t++) {
+		if ((err = pthread_create(&threads[t], NULL, fn, NULL))) {
+			errno = err;
+			die("pthread_create():");
+		}
+	}
+	for (t = 0; t < jobs; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+}
+
+/* Collects the names of the messages in new/ or cur/. */
+static void
+list_dir(const char *path, char ***names, size_t *count)
+{
+	DIR *dir;
+	struct dirent *ent;
+	size_t cap = 0;
+
+	if (!(dir = opendir(path)))
+		die("cannot open directory '%s':", path);
 
 	while ((errno = 0, ent = readdir(dir))) {
 		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
 			continue;
-
-		colon = strrchr(ent->d_name, ':');
-		if (colon) {
-			/* FIXME potential buffer overrun */
-			memcpy(uniq, ent->d_name, colon - ent->d_name);
-			uniq[colon - ent->d_name] = '\0';
-		} else {
-			/* FIXME snprintf() is overkill */
-			snprintf(uniq, MAX_FILENAME_LENGTH, "%s", ent->d_name);
+		if (*count == cap) {
+			cap = cap ? 2 * cap : 64;
+			if (!(*names = realloc(*names, cap * sizeof **names)))
+				die("realloc():");
 		}
+		if (!((*names)[(*count)++] = strdup(ent->d_name)))
+			die("strdup():");
+	}
+	if (errno)
+		die("readdir():");
 
-		if (snprintf(newpath, MAX_FILENAME_LENGTH, "new/%s", ent->d_name) >= MAX_FILENAME_LENGTH)
+	closedir(dir);
+}
+
+static void
+free_names(char **names, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+/* Finishes the run that was interrupted, e.g. by a crash. Its messages
+ * whose records made it into the log are moved to cur/, the others stay
+ * in new/ and are simply processed again. Since some of its pages, report
+ * entries and feed entries may have been lost, they are all redone. */
+static void
+recover(MSG start)
+{
+	char newpath[MAX_FILENAME_LENGTH];
+	char curpath[MAX_FILENAME_LENGTH];
+	struct record rec;
+	size_t i, n;
+	bool *moved;
+	MSG msg;
+
+	qsort(newnames, nnewnames, sizeof *newnames, compare_names);
+	if (!(moved = calloc(nnewnames + 1, sizeof *moved)))
+		die("calloc():");
+	map_log();
+	for (msg = start; msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		add_pending(rec.time, msg);
+		add_to_feed(rec.time, rec.info[MUNIQ].str, rec.info[MSUBJECT].str, rec.info[MFROM].str);
+		touch_thread(msg);
+
+		i = find_name(newnames, nnewnames, &rec.info[MUNIQ]);
+		if (i == nnewnames || moved[i]) continue;
+		if (snprintf(newpath, MAX_FILENAME_LENGTH, "new/%s", newnames[i]) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,a", rec.info[MUNIQ].str) >= MAX_FILENAME_LENGTH)
 			die("file path is too long.");
-		if (process_msg(newpath, uniq)) {
-			if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,a", uniq) >= MAX_FILENAME_LENGTH)
-				die("file path is too long.");
-		} else {
-			if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,e", uniq) >= MAX_FILENAME_LENGTH)
-				die("file path is too long.");
-		}
 		rename(newpath, curpath);
+		moved[i] = true;
+	}
+	flush_dir("new");
+	flush_dir("cur");
+
+	for (i = n = 0; i < nnewnames; i++) {
+		if (moved[i])
+			free(newnames[i]);
+		else
+			newnames[n++] = newnames[i];
+	}
+	nnewnames = n;
+	free(moved);
+	recovered = true;
+}
+
+void
+process_new_dir(void)
+{
+	size_t i;
+
+	if (jobs == 1 || nnewnames == 1) {
+		for (i = 0; i < nnewnames; i++)
+			process_new_msg(newnames[i]);
+	} else {
+		run_workers(worker);
+	}
+	commit_batch();
+
+	free_names(newnames, nnewnames);
+	newnames = NULL;
+	nnewnames = nextnewname = 0;
+}
+
+/* Makes sure that the pages about to be written go where the others are.
+ * The pages of a new archive are all written from now on, so it gets its
+ * manifest right away. */
+static void
+check_layout(void)
+{
+	struct manifest mf;
+	int k;
 
-		/* clear aether after every message */
+	map_log();
+	if (!load_manifest(&mf) && log_size() <= first_in_log()) {
+		for (k = 0; k < NUMPAGEKINDS; k++)
+			mf.version[k] = page_version(k);
+		mf.layout = LAYOUT;
+		save_manifest(&mf);
+	}
+	if (mf.layout != LAYOUT)
+		die("The pages in www/ have another layout. Run the relayout command first.");
+}
+
+/* Notes in the manifest that the pages written by this run are current.
+ * It wrote the message pages of all records from first on, so if those
+ * before were current already, all of them are now. */
+static void
+update_manifest(MSG first)
+{
+	struct manifest mf;
+
+	map_log();
+	load_manifest(&mf);
+	if (mf.version[PMESSAGES] == page_version(PMESSAGES) && mf.mark >= first)
+		mf.mark = log_size();
+	save_manifest(&mf);
+}
+
+static size_t
+next_work(void)
+{
+	size_t i;
+	pthread_mutex_lock(&queue_lock);
+	i = nextwork < nwork ? nextwork++ : (size_t) -1;
+	pthread_mutex_unlock(&queue_lock);
+	return i;
+}
+
+static void *
+work_worker(void *arg)
+{
+	size_t i;
+
+	(void) arg;
+	create_aether();
+	while ((i = next_work()) != (size_t) -1) {
+		work(i);
+		note_aether();
 		aether_cursor = aether_base;
 	}
-	if (errno)
-		die("readdir():");
+	close_charsets();
+	destroy_aether();
+	merge_stats();
+	return NULL;
+}
 
-	closedir(dir);
+/* Calls fn for every index below count, spread over all jobs. */
+static void
+spread_work(void (*fn)(size_t), size_t count)
+{
+	size_t i;
+
+	work = fn;
+	nwork = count;
+	nextwork = 0;
+	if (jobs == 1) {
+		for (i = 0; i < count; i++) {
+			fn(i);
+			note_aether();
+			aether_cursor = aether_base;
+		}
+		return;
+	}
+	run_workers(work_worker);
+}
+
+static void
+add_rebuild_msg(MSG msg)
+{
+	if (nrebuild_msgs == caprebuild_msgs) {
+		caprebuild_msgs = caprebuild_msgs ? 2 * caprebuild_msgs : 1024;
+		if (!(rebuild_msgs = realloc(rebuild_msgs, caprebuild_msgs * sizeof *rebuild_msgs)))
+			die("realloc():");
+	}
+	rebuild_msgs[nrebuild_msgs++] = msg;
+}
+
+static void
+free_rebuild_msgs(void)
+{
+	free(rebuild_msgs);
+	rebuild_msgs = NULL;
+	nrebuild_msgs = caprebuild_msgs = 0;
+}
+
+static void
+rebuild_message(size_t i)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	struct message m;
+	struct threadnav nav = { 0 };
+	struct record rec;
+	NODE node;
+
+	read_from_log(rebuild_msgs[i], &rec);
+	if (rec.info[MUNIQ].len >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	memcpy(uniq, rec.info[MUNIQ].str, rec.info[MUNIQ].len + 1);
+	if (!load_archived(uniq, &m))
+		return;
+	if ((node = find_thread(rebuild_msgs[i])))
+		thread_nav(node, &nav);
+	generate_html(uniq, m.info, &nav, &m.body);
+	/* pages written by an older smak may link attachments by other names */
+	generate_attachments(uniq, atoll(m.info[MTIME]), &m.body, rebuild_attachments);
+	unload_msg(&m);
+}
+
+static void
+rebuild_report(size_t i)
+{
+	struct report rpt;
+
+	if (!rebuild_sum.months[i].count) return;
+	open_report(&rpt, rebuild_sum.months[i].year, rebuild_sum.months[i].month);
+	generate_html_report(&rpt);
+	close_report(&rpt);
+}
+
+static void
+rebuild_author(size_t i)
+{
+	struct report rpt;
+
+	open_author_report(&rpt, i + 1);
+	generate_html_author(&rpt, i + 1);
+	close_report(&rpt);
+}
+
+/* Regenerates the pages whose version in the manifest is outdated, and the
+ * message pages that the last runs did not write, or every page with full.
+ * Only the log, the reports and the messages in cur/ are read, and none of
+ * them are changed. */
+static void
+rebuild(bool full)
+{
+	struct manifest mf;
+	uint64_t version[NUMPAGEKINDS];
+	MSG msg;
+	int k;
+
+	if (!access("smak/journal", F_OK))
+		die("The last run was interrupted. Run smak on the maildir first.");
+	check_layout();
+	load_manifest(&mf);
+	for (k = 0; k < NUMPAGEKINDS; k++)
+		version[k] = page_version(k);
+	if (full || mf.version[PMESSAGES] != version[PMESSAGES])
+		mf.mark = first_in_log();
+	/* the workers only ever read these */
+	open_authors();
+	catch_up_threads();
+
+	map_log();
+	for (msg = mf.mark; msg < log_size(); msg = next_in_log(msg))
+		add_rebuild_msg(msg);
+	rebuild_attachments = full;
+	spread_work(rebuild_message, nrebuild_msgs);
+	free_rebuild_msgs();
+	mf.version[PMESSAGES] = version[PMESSAGES];
+	mf.mark = msg;
+	save_manifest(&mf);
+
+	load_summary(&rebuild_sum);
+	if (full || mf.version[PREPORTS] != version[PREPORTS]) {
+		spread_work(rebuild_report, rebuild_sum.count);
+		mf.version[PREPORTS] = version[PREPORTS];
+		save_manifest(&mf);
+	}
+	if (full || mf.version[PAUTHORS] != version[PAUTHORS]) {
+		spread_work(rebuild_author, count_authors());
+		mf.version[PAUTHORS] = version[PAUTHORS];
+		save_manifest(&mf);
+	}
+	if (full || mf.version[POVERVIEW] != version[POVERVIEW]) {
+		generate_html_overview(&rebuild_sum);
+		mf.version[POVERVIEW] = version[POVERVIEW];
+		save_manifest(&mf);
+	}
+	save_summary(&rebuild_sum);
+	if (full || mf.version[PFEED] != version[PFEED]) {
+		rebuild_feed();
+		mf.version[PFEED] = version[PFEED];
+		save_manifest(&mf);
+	}
+
+	close_threads();
+	close_authors();
+	close_smakdir();
+}
+
+/* Removes the directory of an old page and the one above it, unless
+ * there is still something in them. */
+static void
+remove_page_dir(const char *dir)
+{
+	char path[MAX_FILENAME_LENGTH];
+	char *slash;
+
+	snprintf(path, sizeof path, "www/%s", dir);
+	while ((slash = strrchr(path, '/')) && slash > path + 3) {
+		*slash = '\0';
+		if (rmdir(path) < 0) break;
+	}
+}
+
+/* Moves the pages and attachments of all messages from the layout that
+ * www/ has to LAYOUT, and then rebuilds the pages that link to them. If
+ * it is interrupted, the files that were not moved yet are still where
+ * the manifest says, so it can simply be started again. */
+static void
+relayout(void)
+{
+	static const char *const exts[] = { ".html", ".gph", "" };
+	char olddir[PAGE_DIR_MAX], newdir[PAGE_DIR_MAX];
+	char oldpath[MAX_FILENAME_LENGTH], newpath[MAX_FILENAME_LENGTH];
+	struct manifest mf;
+	struct record rec;
+	MSG msg;
+	size_t e;
+
+	if (!access("smak/journal", F_OK))
+		die("The last run was interrupted. Run smak on the maildir first.");
+	map_log();
+	/* a new archive has no pages to move */
+	if (!load_manifest(&mf) && log_size() <= first_in_log())
+		mf.layout = LAYOUT;
+	if (mf.layout != LAYOUT) {
+		for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) {
+			read_from_log(msg, &rec);
+			page_dir(olddir, mf.layout, rec.info[MUNIQ].str, rec.time);
+			page_dir(newdir, LAYOUT, rec.info[MUNIQ].str, rec.time);
+			if (*newdir) {
+				snprintf(newpath, sizeof newpath, "www/%s", newdir);
+				newpath[strlen(newpath) - 1] = '\0';
+				make_dir(newpath);
+			}
+			/* the pages of all backends and the attachment directory */
+			for (e = 0; e < sizeof exts / sizeof *exts; e++) {
+				if (snprintf(oldpath, sizeof oldpath, "www/%s%s%s", olddir, rec.info[MUNIQ].str, exts[e]) >= (int) sizeof oldpath
+				 || snprintf(newpath, sizeof newpath, "www/%s%s%s", newdir, rec.info[MUNIQ].str, exts[e]) >= (int) sizeof newpath)
+					die("file path is too long.");
+				if (rename(oldpath, newpath) < 0 && errno != ENOENT)
+					die("cannot move '%s':", oldpath);
+			}
+		}
+		for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) {
+			read_from_log(msg, &rec);
+			page_dir(olddir, mf.layout, rec.info[MUNIQ].str, rec.time);
+			if (*olddir)
+				remove_page_dir(olddir);
+		}
+		/* the manifest must not point to files that are not there yet */
+		flush_fs("www");
+		mf.layout = LAYOUT;
+	}
+	save_manifest(&mf);
+	/* all links to message pages are stale now */
+	rebuild(false);
+}
+
+/* Looks for the messages in cur/ that are in the log already. Those that
+ * an interrupted import did not get to rename yet are renamed now, and
+ * their pages are rendered along with those of the imported messages. */
+static void
+find_logged(void)
+{
+	char oldpath[MAX_FILENAME_LENGTH];
+	char curpath[MAX_FILENAME_LENGTH];
+	struct record rec;
+	size_t i;
+	MSG msg;
+
+	qsort(curnames, ncurnames, sizeof *curnames, compare_names);
+	if (!(logged = calloc(ncurnames + 1, sizeof *logged)))
+		die("calloc():");
+	map_log();
+	for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		if ((i = find_name(curnames, ncurnames, &rec.info[MUNIQ])) == ncurnames)
+			continue;
+		logged[i] = true;
+		if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,a", rec.info[MUNIQ].str) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		if (!strcmp(curpath + 4, curnames[i])) continue;
+		if (snprintf(oldpath, MAX_FILENAME_LENGTH, "cur/%s", curnames[i]) >= MAX_FILENAME_LENGTH)
+			die("file path is too long.");
+		rename(oldpath, curpath);
+		add_rebuild_msg(msg);
+	}
+}
+
+static void
+import_msg(size_t i)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	char oldpath[MAX_FILENAME_LENGTH];
+	char curpath[MAX_FILENAME_LENGTH];
+	size_t len;
+	char flag;
+
+	if (logged[i]) return;
+	if ((len = uniq_length(curnames[i])) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	memcpy(uniq, curnames[i], len);
+	uniq[len] = '\0';
+
+	if (snprintf(oldpath, MAX_FILENAME_LENGTH, "cur/%s", curnames[i]) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	flag = process_msg(oldpath, uniq);
+	count_stat(CTMESSAGES, 1);
+	if (flag == 'e') count_stat(CTREJECTED, 1);
+	if (flag == 'd') count_stat(CTDUPLICATES, 1);
+	if (snprintf(curpath, MAX_FILENAME_LENGTH, "cur/%s:2,%c", uniq, flag) >= MAX_FILENAME_LENGTH)
+		die("file path is too long.");
+	if (strcmp(oldpath, curpath))
+		rename(oldpath, curpath);
+}
+
+/* Archives the messages in cur/ that are not in the log yet, e.g. the
+ * history of a list from before it was archived. The messages are parsed
+ * and logged by all jobs, but their pages are only rendered afterwards,
+ * and their report entries are sorted and merged just as those of new/. */
+static void
+import_cur(void)
+{
+	list_dir("cur", &curnames, &ncurnames);
+	find_logged();
+	spread_work(import_msg, ncurnames);
+	flush_dir("cur");
+
+	free_names(curnames, ncurnames);
+	free(logged);
+	curnames = NULL;
+	logged = NULL;
+	ncurnames = 0;
+}
+
+static int
+compare_offsets(const void *a, const void *b)
+{
+	off_t x = *(const off_t *) a, y = *(const off_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+find_logged_offsets(void)
+{
+	struct record rec;
+	size_t cap = 0;
+	off_t offset;
+	MSG msg;
+
+	map_log();
+	for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		if (parse_mbox_uniq(rec.info[MUNIQ].str, &offset) != mboxid)
+			continue;
+		if (nmboxlogged == cap) {
+			cap = cap ? 2 * cap : 64;
+			if (!(mboxlogged = realloc(mboxlogged, cap * sizeof *mboxlogged)))
+				die("realloc():");
+		}
+		mboxlogged[nmboxlogged++] = offset;
+	}
+	if (nmboxlogged)
+		qsort(mboxlogged, nmboxlogged, sizeof *mboxlogged, compare_offsets);
+}
+
+/* Maps the next message of the mbox that is not in the log yet. */
+static bool
+next_mbox_msg(struct mboxmsg *mm, off_t *offset)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&queue_lock);
+	while (!found && mboxnext < mboxsize) {
+		*offset = mboxnext;
+		if (!map_mbox_msg(mboxfd, mboxsize, mboxnext, mm))
+			die("'%s' is not an mbox file.", mboxpath);
+		mboxnext = mm->next;
+		found = !nmboxlogged || !bsearch(offset, mboxlogged, nmboxlogged, sizeof *mboxlogged, compare_offsets);
+		if (!found)
+			unmap_mbox_msg(mm);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return found;
+}
+
+static void
+import_mbox_msg(struct mboxmsg *mm, off_t offset)
+{
+	char uniq[MAX_FILENAME_LENGTH];
+	struct message m;
+	char flag;
+
+	mbox_uniq(uniq, sizeof uniq, mboxid, offset);
+	flag = load_mbox_msg(mm, uniq, &m) ? archive_msg(uniq, &m) : 'e';
+	count_stat(CTMESSAGES, 1);
+	if (flag == 'e') count_stat(CTREJECTED, 1);
+	if (flag == 'd') count_stat(CTDUPLICATES, 1);
+	note_aether();
+	aether_cursor = aether_base;
+}
+
+static void *
+mbox_worker(void *arg)
+{
+	struct mboxmsg mm;
+	off_t offset;
+
+	(void) arg;
+	create_aether();
+	while (next_mbox_msg(&mm, &offset))
+		import_mbox_msg(&mm, offset);
+	close_charsets();
+	destroy_aether();
+	merge_stats();
+	return NULL;
+}
+
+/* Archives the messages of an mbox file, which stays as it is. Like the
+ * import of cur/, the pages are only rendered once all of the messages are
+ * threaded. An interrupted import can be started again, and then skips
+ * the messages that it logged before. */
+static void
+import_mbox(void)
+{
+	struct mboxmsg mm;
+	struct stat meta;
+	off_t offset;
+
+	if ((mboxfd = open(mboxpath, O_RDONLY)) < 0)
+		die("cannot open '%s':", mboxpath);
+	if (fstat(mboxfd, &meta) < 0)
+		die("cannot stat '%s':", mboxpath);
+	mboxsize = meta.st_size;
+	mboxid = add_mbox(mboxpath);
+	find_logged_offsets();
+
+	if (jobs == 1) {
+		while (next_mbox_msg(&mm, &offset))
+			import_mbox_msg(&mm, offset);
+	} else {
+		run_workers(mbox_worker);
+	}
+	close(mboxfd);
+	free(mboxlogged);
+	mboxlogged = NULL;
+	nmboxlogged = 0;
+}
+
+static int
+compare_msgs(const void *a, const void *b)
+{
+	MSG x = *(const MSG *) a, y = *(const MSG *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Renders the pages of all imported messages, and of all others whose
+ * thread context changed, now that the thread forest is complete. */
+static void
+render_imported(void)
+{
+	NODE *dirty;
+	size_t count, i, n;
+
+	catch_up_threads();
+	dirty = take_dirty_threads(&count);
+	for (i = 0; i < count; i++)
+		add_rebuild_msg(thread_msg(dirty[i]));
+	free(dirty);
+	for (i = 0; i < npending; i++)
+		add_rebuild_msg(pending[i].msg);
+
+	qsort(rebuild_msgs, nrebuild_msgs, sizeof *rebuild_msgs, compare_msgs);
+	for (i = n = 0; i < nrebuild_msgs; i++) {
+		if (!n || rebuild_msgs[i] != rebuild_msgs[n-1])
+			rebuild_msgs[n++] = rebuild_msgs[i];
+	}
+	rebuild_attachments = false;
+	spread_work(rebuild_message, n);
+	free_rebuild_msgs();
+}
+
+/* Processes the messages in new/ that were listed, or imports, and is done
+ * once everything that it wrote is on disk. */
+static void
+run(void)
+{
+	uint64_t start;
+	MSG first;
+	bool interrupted;
+
+	/* nothing may read the log before it is repaired */
+	if ((interrupted = open_journal(&first)))
+		repair_log(first);
+	recovered = false;
+	if (interrupted) {
+		start = start_span();
+		recover(first);
+		end_span(STRECOVER, start);
+	}
+	/* after recover(), which moves the messages that it indexes to cur/ */
+	open_index();
+	start = start_span();
+	catch_up_index();
+	end_span(STCATCHUP, start);
+	if (importing) {
+		/* new/ is left to the next run */
+		free_names(newnames, nnewnames);
+		newnames = NULL;
+		nnewnames = 0;
+		start = start_span();
+		if (mboxpath)
+			import_mbox();
+		else
+			import_cur();
+		end_span(STIMPORT, start);
+		start = start_span();
+		render_imported();
+		end_span(STTHREADS, start);
+	} else {
+		start = start_span();
+		process_new_dir();
+		end_span(STNEW, start);
+		start = start_span();
+		update_threads();
+		end_span(STTHREADS, start);
+	}
+	start = start_span();
+	update_author_pages();
+	end_span(STAUTHORS, start);
+	start = start_span();
+	update_reports();
+	end_span(STREPORTS, start);
+	start = start_span();
+	update_feed();
+	end_span(STFEED, start);
+	start = start_span();
+	update_manifest(first);
+	flush_index();
+	flush_fs("smak");
+	if (separate_www)
+		flush_fs("www");
+	close_journal();
+	end_span(STCLOSE, start);
+}
+
+#ifdef __linux__
+static volatile sig_atomic_t stopping;
+
+static void
+stop(int sig)
+{
+	(void) sig;
+	stopping = 1;
+}
+
+/* Waits for messages to arrive in new/, and then for more of them until
+ * DAEMON_LATENCY milliseconds passed since the first one, or until there
+ * are COMMIT_BATCH of them. Returns false once the daemon has to stop. */
+static bool
+wait_for_mail(int fd, const sigset_t *unblocked)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct timespec ts, *timeout = NULL;
+	struct inotify_event *ev;
+	uint64_t first = 0, waited;
+	size_t count = 0;
+	ssize_t len;
+	char *p;
+	int ret;
+
+	while (!stopping && count < COMMIT_BATCH) {
+		if (count) {
+			if ((waited = monotonic_ms() - first) >= DAEMON_LATENCY)
+				break;
+			ts.tv_sec = (DAEMON_LATENCY - waited) / 1000;
+			ts.tv_nsec = (DAEMON_LATENCY - waited) % 1000 * 1000000;
+			timeout = &ts;
+		}
+		/* the signals only come through in here,
+		 * so that a run is never cut short */
+		if ((ret = ppoll(&pfd, 1, timeout, unblocked)) < 0) {
+			if (errno == EINTR) continue;
+			die("ppoll():");
+		}
+		if (!ret) break;
+		if ((len = read(fd, u.buf, sizeof u.buf)) < 0) {
+			if (errno == EINTR) continue;
+			die("read():");
+		}
+		for (p = u.buf; p < u.buf + len; p += sizeof *ev + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (!count++)
+				first = monotonic_ms();
+		}
+	}
+	return !stopping;
+}
+
+/* Runs once, and then again whenever messages arrive in new/, until it gets
+ * SIGINT or SIGTERM. Everything stays open and mapped in between. */
+static void
+watch_new(void)
+{
+	struct sigaction sa = { 0 };
+	sigset_t block, unblocked;
+	int fd;
+
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &unblocked);
+
+	/* messages that arrive during a run are noticed afterwards */
+	if ((fd = inotify_init1(IN_CLOEXEC)) < 0)
+		die("inotify_init1():");
+	if (inotify_add_watch(fd, "new", IN_CREATE | IN_MOVED_TO) < 0)
+		die("cannot watch 'new':");
+	list_dir("new", &newnames, &nnewnames);
+	run();
+	while (wait_for_mail(fd, &unblocked)) {
+		list_dir("new", &newnames, &nnewnames);
+		if (nnewnames)
+			run();
+	}
+	close(fd);
+	pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+}
+#else
+static void
+watch_new(void)
+{
+	die("-d needs inotify, which only Linux has.");
+}
+#endif
+
+/* Checks the arguments of a command. */
+static bool
+check_args(const char *command, int argc, char *argv[])
+{
+	if (!command)
+		return true;
+	if (!strcmp(command, "search"))
+		return argc > 0;
+	if (!strcmp(command, "rebuild"))
+		return !argc || (argc == 1 && !strcmp(*argv, "--full"));
+	if (!strcmp(command, "import-mbox"))
+		return argc == 1;
+	return !argc;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [maildir]\n", argv0);
+	fprintf(stderr, "usage: %s [-d] [-j jobs] [--stats[=json]] [maildir [command [args...]]]\n", argv0);
 }
 
 int
 main(int argc, char **argv)
 {
 	struct stat meta;
+	char *end, *maildir = NULL, *command = NULL;
+	dev_t dev;
+	int i, j;
+
+	/* arg.h only knows single-letter options */
+	for (i = j = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			while (i < argc) argv[j++] = argv[i++];
+			break;
+		}
+		if (!strcmp(argv[i], "--stats"))
+			enable_stats(false);
+		else if (!strcmp(argv[i], "--stats=json"))
+			enable_stats(true);
+		else
+			argv[j++] = argv[i];
+	}
+	argv[argc = j] = NULL;
 
 	ARGBEGIN {
+	case 'd':
+		watching = true;
+		break;
+	case 'j':
+		jobs = strtol(EARGF(usage()), &end, 10);
+		if (*end || jobs < 1)
+			die("invalid number of jobs.");
+		jobs_given = true;
+		break;
 	default:
 		usage();
 		exit(1);
 	} ARGEND
 	if (argc) {
-		if (chdir(*argv) < 0)
-			die("cannot go to directory:");
+		maildir = *argv;
 		argc--, argv++;
 	}
 	if (argc) {
+		command = *argv;
+		argc--, argv++;
+	}
+	if ((watching && command) || !check_args(command, argc, argv)) {
 		usage();
 		exit(1);
 	}
+	/* the path is relative to where smak was started */
+	if (command && !strcmp(command, "import-mbox") && !(mboxpath = realpath(*argv, NULL)))
+		die("cannot find '%s':", *argv);
+	if (maildir && chdir(maildir) < 0)
+		die("cannot go to directory:");
 
-	aether_base = mmap(NULL, MAX_AETHER_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	aether_cursor = aether_base;
+	init_simd();
+	init_templates();
+	create_aether();
 
-	init_smakdir();
+	/* rebuilds and imports use all cores by default */
+	importing = command && (!strcmp(command, "import") || !strcmp(command, "import-mbox"));
+	if ((importing || (command && (!strcmp(command, "rebuild") || !strcmp(command, "relayout"))))
+	&& !jobs_given && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jobs = 1;
 
-	if (stat("www", &meta) < 0 || !S_ISDIR(meta.st_mode))
-		die("You need to create or link a 'www/' subdirectory.");
+	if (!command || importing) {
+		init_smakdir();
+		lock_smakdir();
 
-	process_new_dir();
+		if (stat("www", &meta) < 0 || !S_ISDIR(meta.st_mode))
+			die("You need to create or link a 'www/' subdirectory.");
+		dev = meta.st_dev;
+		if (stat("smak", &meta) < 0)
+			die("cannot stat 'smak':");
+		separate_www = meta.st_dev != dev;
 
-	munmap(aether_base, MAX_AETHER_MEMORY);
+		check_layout();
+		if (watching) {
+			watch_new();
+		} else {
+			list_dir("new", &newnames, &nnewnames);
+			run();
+		}
+		close_threads();
+		close_authors();
+		close_index();
+		close_smakdir();
+	} else if (!strcmp(command, "rebuild")) {
+		init_smakdir();
+		lock_smakdir();
+		if (stat("www", &meta) < 0 || !S_ISDIR(meta.st_mode))
+			die("You need to create or link a 'www/' subdirectory.");
+		rebuild(argc > 0);
+	} else if (!strcmp(command, "relayout")) {
+		init_smakdir();
+		lock_smakdir();
+		if (stat("www", &meta) < 0 || !S_ISDIR(meta.st_mode))
+			die("You need to create or link a 'www/' subdirectory.");
+		relayout();
+	} else if (!strcmp(command, "migrate")) {
+		lock_smakdir();
+		migrate_smakdir();
+	} else if (!strcmp(command, "search")) {
+		init_smakdir();
+		search(argc, argv);
+	} else {
+		usage();
+		exit(1);
+	}
+
+	close_charsets();
+	destroy_aether();
+	print_stats();
 	return 0;
 }
 
@@ -1,31 +1,147 @@
-/* See LICENSE file for copyright and license details. */
+/* See LICENSE file for copyright and license details.
+ *
+ * On-disk formats
+ *
+ * All integers in smak/ are stored in little-endian byte order, so the
+ * files can be moved between machines of different architectures.
+ *
+ * smak/log begins with a 16 byte header: the magic "smaklog\0", a 32 bit
+ * format version and 32 reserved bits. After that come the records, one
+ * per message. A MSG is the file offset of its record. Each record holds
+ * its own 32 bit length, the 64 bit signed Date of the message, and then
+ * all other info fields in order, each one as a 32 bit length followed by
+ * the bytes and a terminating NUL.
+ *
+ * smak/report/YYYY-MM begins with a 24 byte header: the magic "smakrpt\0",
+ * a 32 bit format version, 32 reserved bits and the 64 bit entry count.
+ * The entries follow sorted by time, each one a 64 bit signed time and a
+ * 64 bit MSG. Report files are mapped into memory and grow geometrically,
+ * so there may be unused space at the end.
+ *
+ * smak/months summarizes the reports for the overview page. It begins with
+ * a 16 byte header: the magic "smakmon\0", a 32 bit format version and 32
+ * reserved bits. One entry per month follows, sorted by month: the 32 bit
+ * year, the 32 bit month, the 64 bit entry count of its report and the 64
+ * bit signed time at which the report last changed.
+ *
+ * Other sorted lists of messages, like those of the authors (see author.c),
+ * are stored in the same format as reports.
+ *
+ * smak/msgid is a hash table (see hashtab.c) that maps the hashes of
+ * normalized Message-IDs to MSGs. Its mark is the log offset up to which
+ * all records have been indexed.
+ *
+ * smak/manifest records what the pages in www/ were generated from. It
+ * begins with a 16 byte header: the magic "smakdep\0", a 32 bit format
+ * version and 32 reserved bits. Then follow the 64 bit log offset up to
+ * which the message pages are current, and one 64 bit version per kind of
+ * page (see enum pagekind), which is a hash of everything besides the
+ * records and reports that went into the pages of that kind. The 64 bit
+ * layout of the message pages (see enum layout) comes last; manifests
+ * without it are from before pages were put into subdirectories, so their
+ * layout is flat.
+ *
+ * smak/journal only exists while a run is in progress. It is 24 bytes
+ * long: the magic "smakjnl\0", a 32 bit format version, 32 reserved bits
+ * and the 64 bit log offset of the first record of the run. If it is
+ * still there when smak starts, the last run was interrupted, and its
+ * records are taken care of once more (see recover() in smak.c).
+ *
+ * smak/lock is empty. Every smak that changes the archive holds an
+ * exclusive flock() on it until it exits, so that no other one mistakes
+ * its journal for that of an interrupted run.
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "util.h"
+#include "mail.h"
+#include "hashtab.h"
 #include "smakdir.h"
 #include "config.h"
 
-extern char *aether_base;
-extern char *aether_cursor;
+#define FORMAT_VERSION     1
+#define LOG_MAGIC          "smaklog"
+#define LOG_HEADER_SIZE    16
+#define LOG_RESERVE        (1 << 20)
+#define RECORD_HEADER_SIZE 12
+#define REPORT_MAGIC       "smakrpt"
+#define REPORT_HEADER_SIZE 24
+#define REPENT_SIZE        16
+#define MIN_REPENTS        64
+#define SUMMARY_MAGIC      "smakmon"
+#define SUMMARY_HEADER_SIZE 16
+#define MONTHSUM_SIZE      24
+#define MANIFEST_MAGIC     "smakdep"
+#define MANIFEST_SIZE      (32 + 8 * NUMPAGEKINDS)
+#define JOURNAL_MAGIC      "smakjnl"
+#define JOURNAL_SIZE       24
+
+#define REPENT(rpt, i) ((rpt)->base + REPORT_HEADER_SIZE + (i) * REPENT_SIZE)
+
+extern _Thread_local char *aether_cursor;
 
 static char  *log_base;
-static size_t log_length;
+static size_t log_length;   /* of the records that can be read */
+static size_t log_capacity; /* of the mapping, which reaches beyond the file */
+
+static struct hashtab msgids;
+static bool msgids_open;
+
+static void
+put_header(unsigned char *hdr, const char *magic)
+{
+	memcpy(hdr, magic, 8);
+	put_le32(hdr + 8, FORMAT_VERSION);
+	put_le32(hdr + 12, 0);
+}
+
+static bool
+check_header(const unsigned char *hdr, const char *magic)
+{
+	return !memcmp(hdr, magic, 8) && get_le32(hdr + 8) == FORMAT_VERSION;
+}
+
+/* Returns false if the central log was written by an older smak. */
+static bool
+log_is_current(void)
+{
+	unsigned char hdr[LOG_HEADER_SIZE];
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open("smak/log", O_RDONLY)) < 0) {
+		if (errno == ENOENT) return true;
+		die("cannot open central log:");
+	}
+	while ((ret = read(fd, hdr, sizeof hdr)) < 0 && errno == EINTR);
+	if (ret < 0)
+		die("read():");
+	close(fd);
+	return !ret || (ret == sizeof hdr && check_header(hdr, LOG_MAGIC));
+}
 
 void
 init_smakdir(void)
 {
 	struct stat meta;
 
-	if (stat("smak", &meta) >= 0 && S_ISDIR(meta.st_mode))
+	if (stat("smak", &meta) >= 0 && S_ISDIR(meta.st_mode)) {
+		if (!log_is_current())
+			die("central log file has an outdated format. Run 'smak <maildir> migrate' first.");
 		return;
+	}
 
 	if (mkdir("smak", 0750) < 0)
 		die("mkdir():");
@@ -33,41 +149,84 @@ init_smakdir(void)
 		die("mkdir():");
 }
 
-size_t
-add_to_log(const char *info[])
+void
+lock_smakdir(void)
 {
-	struct stat meta;
-	int fd, i;
-	if ((fd = open("smak/log", O_WRONLY | O_APPEND | O_CREAT, 0640)) < 0)
-		die("cannot open central log file.");
-	if (fstat(fd, &meta) < 0)
-		die("fstat():");
-	/* TODO reduce amount of syscalls */
-	check_write(fd, info[0], strlen(info[0]));
-	for (i = 1; i < MNUMINFO; i++) {
-		check_write(fd, "\t", 1);
-		check_write(fd, info[i], strlen(info[i]));
+	int fd;
+
+	if ((fd = open("smak/lock", O_RDWR | O_CREAT, 0640)) < 0)
+		die("cannot open 'smak/lock':");
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		if (errno == EWOULDBLOCK)
+			die("another smak is already working on this maildir.");
+		die("flock():");
 	}
-	check_write(fd, "\n", 1);
-	close(fd);
-	return meta.st_size;
+	/* the lock is released when the process exits */
+}
+
+static size_t
+record_size(const char *info[])
+{
+	size_t size = RECORD_HEADER_SIZE;
+	int i;
+	for (i = 0; i < MNUMINFO; i++) {
+		if (i != MTIME) size += 4 + strlen(info[i]) + 1;
+	}
+	return size;
 }
 
+static unsigned char *
+encode_record(unsigned char *p, size_t size, const char *info[])
+{
+	size_t len;
+	int i;
+
+	put_le32(p, size);
+	put_le64(p + 4, atoll(info[MTIME]));
+	p += RECORD_HEADER_SIZE;
+	for (i = 0; i < MNUMINFO; i++) {
+		if (i == MTIME) continue;
+		len = strlen(info[i]);
+		put_le32(p, len);
+		memcpy(p + 4, info[i], len + 1);
+		p += 4 + len + 1;
+	}
+	return p;
+}
+
+/* Maps size bytes of the log, and room for the records that are
+ * appended later, so that they need no new mapping. */
+static void
+remap_log(int fd, size_t size)
+{
+	unmap_log();
+	if (!size) return;
+	log_capacity = 2 * size + LOG_RESERVE;
+	log_base = mmap(NULL, log_capacity, PROT_READ, MAP_SHARED, fd, 0);
+	if (log_base == MAP_FAILED)
+		die("mmap():");
+	log_length = size;
+}
+
+/* Maps the central log, or extends an existing mapping
+ * to cover the records that were appended since. */
 void
 map_log(void)
 {
 	struct stat meta;
 	int fd;
 
-	if ((fd = open("smak/log", O_RDONLY)) < 0)
+	if ((fd = open("smak/log", O_RDONLY)) < 0) {
+		if (errno == ENOENT) return;
 		die("cannot open central log:");
+	}
 	if (fstat(fd, &meta) < 0)
 		die("cannot stat central log:");
 
-	log_base = mmap(NULL, meta.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (log_base == MAP_FAILED)
-		die("mmap():");
-	log_length = meta.st_size;
+	if (log_base && (size_t) meta.st_size >= log_length && (size_t) meta.st_size <= log_capacity)
+		log_length = meta.st_size;
+	else if ((size_t) meta.st_size != log_length)
+		remap_log(fd, meta.st_size);
 
 	close(fd);
 }
@@ -75,86 +234,812 @@ map_log(void)
 void
 unmap_log(void)
 {
-	munmap(log_base, log_length);
+	if (log_base)
+		munmap(log_base, log_capacity);
+	log_base = NULL;
+	log_length = log_capacity = 0;
 }
 
-static void *
-aether_alloc(size_t size)
+/* The records of the mapped log can be visited with
+ * for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) */
+size_t
+log_size(void)
 {
-	void *ptr = aether_cursor;
-	if (size > MAX_AETHER_MEMORY - (aether_cursor - aether_base))
-		die("not enough aether memory.");
-	aether_cursor += size;
-	return ptr;
+	return log_length;
 }
 
-void
-read_from_log(MSG msg, const char *info[])
+MSG
+first_in_log(void)
 {
-	char *cursor = log_base + msg;
-	char *end, *buf;
+	return LOG_HEADER_SIZE;
+}
+
+MSG
+next_in_log(MSG msg)
+{
+	if (msg < LOG_HEADER_SIZE || log_length - msg < 4)
+		die("invalid log record.");
+	return msg + get_le32((const unsigned char *) log_base + msg);
+}
+
+static bool
+parse_record(const unsigned char *p, size_t avail, struct record *rec)
+{
+	const unsigned char *end;
+	size_t len;
 	int i;
+
+	if (avail < RECORD_HEADER_SIZE)
+		return false;
+	len = get_le32(p);
+	if (len > avail || len < RECORD_HEADER_SIZE)
+		return false;
+	end = p + len;
+
+	rec->time = (int64_t) get_le64(p + 4);
+	p += RECORD_HEADER_SIZE;
 	for (i = 0; i < MNUMINFO; i++) {
-		end = memchr(cursor,
-			i == MNUMINFO-1 ? '\n' : '\t',
-			log_length - (cursor - log_base));
-		if (!end)
-			die("central log file is corrupt.");
-		buf = aether_alloc(end - cursor + 1);
-		memcpy(buf, cursor, end - cursor);
-		buf[end - cursor] = '\0';
-		info[i] = buf;
-		cursor = end + 1;
+		if (i == MTIME) {
+			rec->info[i] = (struct field) { "", 0 };
+			continue;
+		}
+		if (end - p < 5 || (len = get_le32(p)) > (size_t) (end - p) - 5)
+			return false;
+		rec->info[i] = (struct field) { (const char *) p + 4, len };
+		p += 4 + len + 1;
 	}
+	return true;
+}
+
+static void
+decode_record(const unsigned char *p, size_t avail, struct record *rec)
+{
+	if (!parse_record(p, avail, rec))
+		die("invalid log record.");
 }
 
 void
-read_report(struct report *rpt, int year, int month)
+read_from_log(MSG msg, struct record *rec)
+{
+	if (msg < LOG_HEADER_SIZE || msg >= log_length)
+		die("invalid log record.");
+	decode_record((const unsigned char *) log_base + msg, log_length - msg, rec);
+}
+
+/* Returns the hash of a Message-ID, or 0 if it is empty.
+ * The normalized form is allocated in the aether. */
+static uint64_t
+hash_msgid(const char *id, size_t len, char **norm, size_t *normlen)
+{
+	*norm = aether_alloc(len + 1);
+	*normlen = normalize_msgid(id, len, *norm);
+	(*norm)[*normlen] = '\0';
+	return *normlen ? hash_bytes(*norm, *normlen, 0) : 0;
+}
+
+static void
+index_msgid(MSG msg, const char *id, size_t len)
+{
+	char *checkpoint = aether_cursor, *norm;
+	size_t normlen;
+	uint64_t hash;
+
+	if ((hash = hash_msgid(id, len, &norm, &normlen)))
+		hashtab_insert(&msgids, hash, msg);
+	aether_cursor = checkpoint;
+}
+
+/* Opens the Message-ID index on first use. Records that were appended
+ * while there was no index (e.g. by an older smak) are indexed first. */
+static void
+open_msgids(void)
+{
+	struct record rec;
+	MSG msg;
+
+	if (msgids_open) return;
+	hashtab_open(&msgids, "smak/msgid");
+	msgids_open = true;
+
+	map_log();
+	if (!(msg = hashtab_mark(&msgids)))
+		msg = first_in_log();
+	if (msg >= log_size())
+		return;
+	for (; msg < log_size(); msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		index_msgid(msg, rec.info[MMSGID].str, rec.info[MMSGID].len);
+	}
+	hashtab_set_mark(&msgids, msg);
+}
+
+/* Looks up a message by its Message-ID. Returns NO_MSG if it is not in the log. */
+MSG
+lookup_msgid(const char *msgid)
+{
+	struct htiter it = HTITER_INIT;
+	struct record rec;
+	char *checkpoint = aether_cursor, *norm, *other;
+	size_t normlen, otherlen;
+	uint64_t hash, value;
+	MSG found = NO_MSG;
+
+	open_msgids();
+	if (!(hash = hash_msgid(msgid, strlen(msgid), &norm, &normlen)))
+		goto out;
+	while (hashtab_find(&msgids, hash, &it, &value)) {
+		if (value >= log_length)
+			map_log();
+		/* left behind by a record that was cut off by repair_log() */
+		if (value >= log_length)
+			continue;
+		read_from_log(value, &rec);
+		hash_msgid(rec.info[MMSGID].str, rec.info[MMSGID].len, &other, &otherlen);
+		if (otherlen == normlen && !memcmp(other, norm, normlen)) {
+			found = value;
+			break;
+		}
+	}
+out:
+	aether_cursor = checkpoint;
+	return found;
+}
+
+/* The mapping of the log covers the new record right away, so that
+ * it can be read without calling map_log() for every message. */
+MSG
+add_to_log(const char *info[])
 {
-	char filename[100];
 	struct stat meta;
-	rpt->year = year;
-	rpt->month = month;
+	unsigned char *buf, *p;
+	size_t size, end;
+	int fd;
+
+	size = record_size(info);
+	p = buf = aether_alloc(LOG_HEADER_SIZE + size);
+	open_msgids();
+
+	if ((fd = open("smak/log", O_RDWR | O_APPEND | O_CREAT, 0640)) < 0)
+		die("cannot open central log file.");
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (!meta.st_size) {
+		put_header(p, LOG_MAGIC);
+		p += LOG_HEADER_SIZE;
+		meta.st_size = LOG_HEADER_SIZE;
+	}
+	p = encode_record(p, size, info);
+	check_write(fd, buf, p - buf);
+	end = meta.st_size + size;
+	if (log_base && end <= log_capacity)
+		log_length = end;
+	else
+		remap_log(fd, end);
+	close(fd);
+
+	index_msgid(meta.st_size, info[MMSGID], strlen(info[MMSGID]));
+	hashtab_set_mark(&msgids, end);
+	return meta.st_size;
+}
+
+/* Returns true if the last run was interrupted. Then *start is the offset
+ * of its first record, and the journal stays. Otherwise, a new journal is
+ * written for this run, which starts at *start. */
+bool
+open_journal(MSG *start)
+{
+	unsigned char buf[JOURNAL_SIZE];
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open("smak/journal", O_RDONLY)) >= 0) {
+		while ((ret = read(fd, buf, sizeof buf)) < 0 && errno == EINTR);
+		if (ret < 0)
+			die("read():");
+		close(fd);
+		/* a torn journal was never renamed into place */
+		if (ret != sizeof buf || !check_header(buf, JOURNAL_MAGIC))
+			die("'smak/journal' has an unknown format.");
+		*start = get_le64(buf + 16);
+		return true;
+	}
+	if (errno != ENOENT)
+		die("cannot open 'smak/journal':");
+
+	map_log();
+	*start = log_size() ? log_size() : first_in_log();
+	put_header(buf, JOURNAL_MAGIC);
+	put_le64(buf + 16, *start);
+	if ((fd = open("smak/journal.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot open 'smak/journal.tmp':");
+	check_write(fd, buf, sizeof buf);
+	if (fsync(fd) < 0)
+		die("fsync():");
+	close(fd);
+	if (rename("smak/journal.tmp", "smak/journal") < 0)
+		die("rename():");
+	flush_dir("smak");
+	return false;
+}
+
+/* Removes the journal. Everything of the run has to be on disk by now. */
+void
+close_journal(void)
+{
+	if (unlink("smak/journal") < 0)
+		die("cannot remove 'smak/journal':");
+	flush_dir("smak");
+}
+
+/* Cuts off the log behind the last complete record from start on. Only
+ * an interrupted run can leave a partly written record behind. */
+void
+repair_log(MSG start)
+{
+	struct record rec;
+	MSG msg;
+	int fd;
+
+	map_log();
+	if (!log_size() || start < first_in_log())
+		return;
+	for (msg = start; msg < log_size(); msg += get_le32((const unsigned char *) log_base + msg)) {
+		if (!parse_record((const unsigned char *) log_base + msg, log_size() - msg, &rec))
+			break;
+	}
+	if (msg >= log_size())
+		return;
+
+	unmap_log();
+	if ((fd = open("smak/log", O_WRONLY)) < 0)
+		die("cannot open central log:");
+	if (ftruncate(fd, msg) < 0 || fsync(fd) < 0)
+		die("cannot repair central log:");
+	close(fd);
+	map_log();
+}
+
+void
+close_smakdir(void)
+{
+	if (msgids_open)
+		hashtab_close(&msgids);
+	msgids_open = false;
+	unmap_log();
+}
+
+static void
+write_entries(int fd, const struct repent *entries, size_t count)
+{
+	unsigned char *buf, *p;
+	size_t i;
+
+	if (!(buf = malloc(REPORT_HEADER_SIZE + count * REPENT_SIZE)))
+		die("malloc():");
+	put_header(buf, REPORT_MAGIC);
+	put_le64(buf + 16, count);
+	p = buf + REPORT_HEADER_SIZE;
+	for (i = 0; i < count; i++, p += REPENT_SIZE) {
+		put_le64(p, entries[i].time);
+		put_le64(p + 8, entries[i].msg);
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		die("lseek():");
+	check_write(fd, buf, p - buf);
+	free(buf);
+}
+
+static void
+map_report(struct report *rpt, size_t capacity)
+{
+	if (rpt->base)
+		munmap(rpt->base, REPORT_HEADER_SIZE + rpt->capacity * REPENT_SIZE);
+	rpt->base = mmap(NULL, REPORT_HEADER_SIZE + capacity * REPENT_SIZE,
+		PROT_READ | PROT_WRITE, MAP_SHARED, rpt->fd, 0);
+	if (rpt->base == MAP_FAILED)
+		die("mmap():");
+	rpt->capacity = capacity;
+}
+
+/* Makes room for at least count entries, doubling the file size as needed. */
+static void
+reserve_report(struct report *rpt, size_t count)
+{
+	size_t capacity = rpt->capacity;
+
+	if (count <= capacity) return;
+	if (capacity < MIN_REPENTS)
+		capacity = MIN_REPENTS;
+	while (capacity < count)
+		capacity *= 2;
+	if (ftruncate(rpt->fd, REPORT_HEADER_SIZE + capacity * REPENT_SIZE) < 0)
+		die("ftruncate():");
+	map_report(rpt, capacity);
+}
+
+void
+open_report(struct report *rpt, int year, int month)
+{
+	char filename[100];
+
 	snprintf(filename, sizeof filename,
 		"smak/report/%04d-%02d", year, month);
+	open_report_file(rpt, filename);
+	rpt->year = year;
+	rpt->month = month;
+}
+
+void
+open_report_file(struct report *rpt, const char *filename)
+{
+	unsigned char hdr[REPORT_HEADER_SIZE] = { 0 };
+	struct stat meta;
+
+	rpt->year = 0;
+	rpt->month = 0;
+	rpt->base = NULL;
+	rpt->capacity = 0;
 	if ((rpt->fd = open(filename, O_RDWR | O_CREAT, 0640)) < 0)
 		die("open():");
 	if (fstat(rpt->fd, &meta) < 0)
 		die("fstat():");
-	if (!(rpt->entries = malloc(meta.st_size)))
+	if (!meta.st_size) {
+		put_header(hdr, REPORT_MAGIC);
+		check_write(rpt->fd, hdr, sizeof hdr);
+		meta.st_size = sizeof hdr;
+	}
+	if (meta.st_size < REPORT_HEADER_SIZE)
+		die("report file '%s' is corrupt.", filename);
+
+	map_report(rpt, (meta.st_size - REPORT_HEADER_SIZE) / REPENT_SIZE);
+	if (!check_header(rpt->base, REPORT_MAGIC))
+		die("report file '%s' has an unknown format.", filename);
+	rpt->count = get_le64(rpt->base + 16);
+	if (rpt->count > rpt->capacity)
+		die("report file '%s' is corrupt.", filename);
+}
+
+void
+close_report(struct report *rpt)
+{
+	munmap(rpt->base, REPORT_HEADER_SIZE + rpt->capacity * REPENT_SIZE);
+	close(rpt->fd);
+}
+
+time_t
+report_time(const struct report *rpt, size_t idx)
+{
+	return (int64_t) get_le64(REPENT(rpt, idx));
+}
+
+MSG
+report_msg(const struct report *rpt, size_t idx)
+{
+	return get_le64(REPENT(rpt, idx) + 8);
+}
+
+bool
+report_contains(const struct report *rpt, time_t time, MSG msg)
+{
+	size_t lo = 0, hi = rpt->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (report_time(rpt, mid) < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < rpt->count && report_time(rpt, lo) == time; lo++) {
+		if (report_msg(rpt, lo) == msg) return true;
+	}
+	return false;
+}
+
+size_t
+drop_merged(const struct report *rpt, struct repent *entries, size_t count)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!report_contains(rpt, entries[i].time, entries[i].msg))
+			entries[n++] = entries[i];
+	}
+	return n;
+}
+
+static void
+set_repent(struct report *rpt, size_t idx, time_t time, MSG msg)
+{
+	put_le64(REPENT(rpt, idx), time);
+	put_le64(REPENT(rpt, idx) + 8, msg);
+}
+
+static void
+set_count(struct report *rpt, size_t count)
+{
+	rpt->count = count;
+	put_le64(rpt->base + 16, count);
+}
+
+/* Merges a batch of entries that is sorted by time into the report. The
+ * merge runs backwards from the end, so only the entries behind the first
+ * insertion point are touched; a batch that is newer than everything in the
+ * report (the usual case) is simply appended. */
+void
+merge_into_report(struct report *rpt, const struct repent *batch, size_t count)
+{
+	size_t i = rpt->count, j = count, k = rpt->count + count;
+
+	reserve_report(rpt, rpt->count + count);
+	while (j) {
+		if (i && report_time(rpt, i - 1) > batch[j - 1].time) {
+			i--;
+			memcpy(REPENT(rpt, --k), REPENT(rpt, i), REPENT_SIZE);
+		} else {
+			j--;
+			set_repent(rpt, --k, batch[j].time, batch[j].msg);
+		}
+	}
+	set_count(rpt, rpt->count + count);
+}
+
+/* Returns false if there is no manifest yet. Then all versions are zero,
+ * which no pages have, and the layout is flat, as smak had it before it
+ * wrote manifests. */
+bool
+load_manifest(struct manifest *mf)
+{
+	unsigned char buf[MANIFEST_SIZE];
+	uint64_t layout = LAYOUT_FLAT;
+	ssize_t ret;
+	int fd, i;
+
+	memset(mf, 0, sizeof *mf);
+	mf->mark = first_in_log();
+	if ((fd = open("smak/manifest", O_RDONLY)) < 0) {
+		if (errno == ENOENT) return false;
+		die("cannot open 'smak/manifest':");
+	}
+	while ((ret = read(fd, buf, sizeof buf)) < 0 && errno == EINTR);
+	if (ret < 0)
+		die("read():");
+	close(fd);
+	if ((ret != sizeof buf && ret != sizeof buf - 8) || !check_header(buf, MANIFEST_MAGIC))
+		die("'smak/manifest' has an unknown format.");
+	mf->mark = get_le64(buf + 16);
+	for (i = 0; i < NUMPAGEKINDS; i++)
+		mf->version[i] = get_le64(buf + 24 + 8 * i);
+	if (ret == sizeof buf)
+		layout = get_le64(buf + 24 + 8 * NUMPAGEKINDS);
+	if (layout > LAYOUT_MONTH)
+		die("'smak/manifest' has an unknown format.");
+	mf->layout = layout;
+	return true;
+}
+
+void
+save_manifest(const struct manifest *mf)
+{
+	unsigned char buf[MANIFEST_SIZE];
+	int fd, i;
+
+	put_header(buf, MANIFEST_MAGIC);
+	put_le64(buf + 16, mf->mark);
+	for (i = 0; i < NUMPAGEKINDS; i++)
+		put_le64(buf + 24 + 8 * i, mf->version[i]);
+	put_le64(buf + 24 + 8 * NUMPAGEKINDS, mf->layout);
+	if ((fd = open("smak/manifest.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot open 'smak/manifest.tmp':");
+	check_write(fd, buf, sizeof buf);
+	close(fd);
+	if (rename("smak/manifest.tmp", "smak/manifest") < 0)
+		die("rename():");
+}
+
+static int
+compare_monthsums(const void *a, const void *b)
+{
+	const struct monthsum *x = a, *y = b;
+	if (x->year != y->year) return x->year < y->year ? -1 : 1;
+	return (x->month > y->month) - (x->month < y->month);
+}
+
+static struct monthsum *
+add_monthsum(struct summary *sum)
+{
+	if (sum->count == sum->capacity) {
+		sum->capacity = sum->capacity ? 2 * sum->capacity : 64;
+		if (!(sum->months = realloc(sum->months, sum->capacity * sizeof *sum->months)))
+			die("realloc():");
+	}
+	return &sum->months[sum->count++];
+}
+
+/* Builds the summary of an archive that has none yet from its reports. */
+static void
+summarize_reports(struct summary *sum)
+{
+	struct report rpt;
+	struct monthsum *m;
+	struct stat meta;
+	DIR *dir;
+	struct dirent *ent;
+	int year, month;
+	char end;
+
+	if (!(dir = opendir("smak/report")))
+		die("cannot open directory 'smak/report':");
+	while ((errno = 0, ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "%4d-%2d%c", &year, &month, &end) != 2) continue;
+		open_report(&rpt, year, month);
+		if (fstat(rpt.fd, &meta) < 0)
+			die("fstat():");
+		m = add_monthsum(sum);
+		*m = (struct monthsum) { year, month, rpt.count, meta.st_mtime };
+		close_report(&rpt);
+	}
+	if (errno)
+		die("readdir():");
+	closedir(dir);
+	qsort(sum->months, sum->count, sizeof *sum->months, compare_monthsums);
+	sum->changed = true;
+}
+
+void
+load_summary(struct summary *sum)
+{
+	unsigned char *buf, *p;
+	struct stat meta;
+	size_t i;
+	int fd;
+
+	*sum = (struct summary) { 0 };
+	if ((fd = open("smak/months", O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			die("cannot open 'smak/months':");
+		summarize_reports(sum);
+		return;
+	}
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (meta.st_size < SUMMARY_HEADER_SIZE || (meta.st_size - SUMMARY_HEADER_SIZE) % MONTHSUM_SIZE)
+		die("'smak/months' is corrupt.");
+	if (!(buf = malloc(meta.st_size)))
 		die("malloc():");
-	check_read(rpt->fd, rpt->entries, meta.st_size);
-	rpt->count = meta.st_size / sizeof *rpt->entries;
+	for (p = buf; p < buf + meta.st_size; p += check_read(fd, p, buf + meta.st_size - p));
+	close(fd);
+	if (!check_header(buf, SUMMARY_MAGIC))
+		die("'smak/months' has an unknown format.");
+
+	sum->count = sum->capacity = (meta.st_size - SUMMARY_HEADER_SIZE) / MONTHSUM_SIZE;
+	if (!(sum->months = calloc(sum->capacity + 1, sizeof *sum->months)))
+		die("calloc():");
+	for (i = 0, p = buf + SUMMARY_HEADER_SIZE; i < sum->count; i++, p += MONTHSUM_SIZE) {
+		sum->months[i].year    = get_le32(p);
+		sum->months[i].month   = get_le32(p + 4);
+		sum->months[i].count   = get_le64(p + 8);
+		sum->months[i].updated = (int64_t) get_le64(p + 16);
+	}
+	free(buf);
 }
 
+/* Records the entry count of a report after it was committed. */
 void
-write_report(const struct report *rpt)
+update_summary(struct summary *sum, const struct report *rpt, time_t now)
 {
-	lseek(rpt->fd, 0, SEEK_SET);
-	check_write(rpt->fd, rpt->entries, rpt->count * sizeof *rpt->entries);
+	struct monthsum key = { rpt->year, rpt->month, 0, 0 }, *m;
+
+	m = bsearch(&key, sum->months, sum->count, sizeof *sum->months, compare_monthsums);
+	if (!m) {
+		m = add_monthsum(sum);
+		*m = key;
+		qsort(sum->months, sum->count, sizeof *sum->months, compare_monthsums);
+		m = bsearch(&key, sum->months, sum->count, sizeof *sum->months, compare_monthsums);
+	}
+	if (m->count == rpt->count) return;
+	m->count = rpt->count;
+	m->updated = now;
+	sum->changed = true;
 }
 
+/* Writes the summary back if it changed. */
 void
-close_report(struct report *rpt)
+save_summary(struct summary *sum)
 {
-	free(rpt->entries);
-	close(rpt->fd);
+	unsigned char *buf, *p;
+	size_t i;
+	int fd;
+
+	if (sum->changed) {
+		if (!(buf = malloc(SUMMARY_HEADER_SIZE + sum->count * MONTHSUM_SIZE)))
+			die("malloc():");
+		put_header(buf, SUMMARY_MAGIC);
+		for (i = 0, p = buf + SUMMARY_HEADER_SIZE; i < sum->count; i++, p += MONTHSUM_SIZE) {
+			put_le32(p,      sum->months[i].year);
+			put_le32(p + 4,  sum->months[i].month);
+			put_le64(p + 8,  sum->months[i].count);
+			put_le64(p + 16, sum->months[i].updated);
+		}
+		if ((fd = open("smak/months.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+			die("cannot create 'smak/months.tmp':");
+		check_write(fd, buf, p - buf);
+		close(fd);
+		if (rename("smak/months.tmp", "smak/months") < 0)
+			die("rename():");
+		free(buf);
+	}
+	free(sum->months);
+	*sum = (struct summary) { 0 };
+}
+
+/* Maps MSG offsets of the old TSV log to offsets in the new log.
+ * Both arrays are ascending, since records keep their order. */
+static MSG   *old_msgs, *new_msgs;
+static size_t num_msgs;
+
+static int
+compare_msgs(const void *a, const void *b)
+{
+	MSG x = *(const MSG *) a, y = *(const MSG *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+migrate_log(void)
+{
+	const char *info[MNUMINFO];
+	struct stat meta;
+	char *tsv, *line, *end, *tab;
+	unsigned char *buf;
+	size_t cap = 0, size, offset;
+	int fd, i;
+
+	if ((fd = open("smak/log.tsv", O_RDONLY)) < 0)
+		die("cannot open 'smak/log.tsv':");
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	tsv = mmap(NULL, meta.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (tsv == MAP_FAILED)
+		die("mmap():");
+	close(fd);
+
+	if ((fd = open("smak/log.new", O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+		die("cannot create 'smak/log.new':");
+	buf = aether_alloc(LOG_HEADER_SIZE);
+	put_header(buf, LOG_MAGIC);
+	check_write(fd, buf, LOG_HEADER_SIZE);
+	offset = LOG_HEADER_SIZE;
+
+	for (line = tsv; line < tsv + meta.st_size; line = end + 1) {
+		if (!(end = memchr(line, '\n', tsv + meta.st_size - line)))
+			die("'smak/log.tsv' is corrupt.");
+		*end = '\0';
+		info[0] = line;
+		for (i = 1; i < MNUMINFO; i++) {
+			if (!(tab = strchr(info[i-1], '\t')))
+				die("'smak/log.tsv' is corrupt.");
+			*tab = '\0';
+			info[i] = tab + 1;
+		}
+
+		size = record_size(info);
+		buf = aether_alloc(size);
+		encode_record(buf, size, info);
+		check_write(fd, buf, size);
+		aether_cursor = (char *) buf;
+
+		if (num_msgs == cap) {
+			cap = cap ? 2 * cap : 1024;
+			if (!(old_msgs = realloc(old_msgs, cap * sizeof *old_msgs)))
+				die("realloc():");
+			if (!(new_msgs = realloc(new_msgs, cap * sizeof *new_msgs)))
+				die("realloc():");
+		}
+		old_msgs[num_msgs] = line - tsv;
+		new_msgs[num_msgs] = offset;
+		num_msgs++;
+		offset += size;
+	}
+
+	close(fd);
+	munmap(tsv, meta.st_size);
+	if (rename("smak/log.new", "smak/log") < 0)
+		die("rename():");
 }
 
+static void
+migrate_report(const char *name)
+{
+	/* This is how struct repent used to be written out verbatim. */
+	struct { time_t time; size_t msg; } *legacy;
+	char filename[MAX_FILENAME_LENGTH];
+	char tmppath[MAX_FILENAME_LENGTH];
+	struct repent *entries;
+	struct stat meta;
+	MSG *idx;
+	size_t count, i;
+	int fd;
+
+	if (snprintf(filename, sizeof filename, "smak/report/%s", name) >= (int) sizeof filename)
+		die("file path is too long.");
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		die("cannot open '%s':", filename);
+	if (fstat(fd, &meta) < 0)
+		die("fstat():");
+	if (meta.st_size >= REPORT_HEADER_SIZE) {
+		unsigned char hdr[8];
+		check_read(fd, hdr, sizeof hdr);
+		if (!memcmp(hdr, REPORT_MAGIC, sizeof hdr)) {
+			/* converted before an earlier migration got interrupted */
+			close(fd);
+			return;
+		}
+		lseek(fd, 0, SEEK_SET);
+	}
+
+	count = meta.st_size / sizeof *legacy;
+	if (!(legacy = malloc(meta.st_size + 1)) || !(entries = malloc(count * sizeof *entries + 1)))
+		die("malloc():");
+	check_read(fd, legacy, meta.st_size);
+	close(fd);
+	for (i = 0; i < count; i++) {
+		idx = bsearch(&legacy[i].msg, old_msgs, num_msgs, sizeof *old_msgs, compare_msgs);
+		if (!idx)
+			die("report '%s' refers to a message that is not in the log.", filename);
+		entries[i] = (struct repent) { legacy[i].time, new_msgs[idx - old_msgs] };
+	}
+
+	strcpy(tmppath, "smak/report/.tmp_XXXXXX");
+	if ((fd = mkstemp(tmppath)) < 0)
+		die("cannot create temporary file:");
+	if (fchmod(fd, 0640) < 0)
+		die("fchmod():");
+	write_entries(fd, entries, count);
+	close(fd);
+	if (rename(tmppath, filename) < 0)
+		die("rename():");
+
+	free(legacy);
+	free(entries);
+}
+
+/* Converts a log and reports written by smak 0.4 or earlier.
+ * The old log is kept as smak/log.tsv until all reports are converted,
+ * so an interrupted migration can simply be started again. */
 void
-add_to_report(struct report *rpt, time_t time, MSG msg)
+migrate_smakdir(void)
 {
-	size_t idx;
+	struct stat meta;
+	DIR *dir;
+	struct dirent *ent;
+
+	if (stat("smak/log.tsv", &meta) < 0) {
+		if (errno != ENOENT)
+			die("cannot stat 'smak/log.tsv':");
+		if (log_is_current())
+			die("nothing to migrate.");
+		if (rename("smak/log", "smak/log.tsv") < 0)
+			die("rename():");
+	}
 
-	if (!(rpt->entries = realloc(rpt->entries, (rpt->count + 1) * sizeof *rpt->entries)))
-		die("realloc():");
+	migrate_log();
+	/* rebuilt from the new log on first use */
+	if (unlink("smak/msgid") < 0 && errno != ENOENT)
+		die("unlink():");
 
-	for (idx = 0; idx < rpt->count; idx++) {
-		if (rpt->entries[idx].time > time) break;
+	if (!(dir = opendir("smak/report")))
+		die("cannot open directory 'smak/report':");
+	while ((errno = 0, ent = readdir(dir))) {
+		if (ent->d_name[0] == '.') continue;
+		migrate_report(ent->d_name);
 	}
-	memmove(&rpt->entries[idx + 1], &rpt->entries[idx],
-		(rpt->count - idx) * sizeof *rpt->entries);
-	rpt->entries[idx] = (struct repent) { time, msg };
-	rpt->count++;
+	if (errno)
+		die("readdir():");
+	closedir(dir);
+
+	free(old_msgs);
+	free(new_msgs);
+	if (unlink("smak/log.tsv") < 0)
+		die("unlink():");
 }
- 
@@ -1,6 +1,8 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 enum {
 	MUNIQ,
@@ -14,30 +16,136 @@ enum {
 
 typedef size_t MSG;
 
+#define NO_MSG ((MSG) -1)
+
+/* A string inside the mapped central log. It is never copied; the bytes
+ * are followed by a NUL so that it can be used as a C string, too. */
+struct field {
+	const char *str;
+	size_t      len;
+};
+
+/* A record of the central log. The time is stored as a number,
+ * so info[MTIME] is always empty. */
+struct record {
+	time_t       time;
+	struct field info[MNUMINFO];
+};
+
 /* entry in a report */
 struct repent {
 	time_t time;
 	MSG    msg;
 };
 
-/* monthly report page */
+/* monthly report page, or another sorted list of entries
+ * (then year and month are zero), mapped into memory */
 struct report {
 	int year;
 	int month;
 	int fd;
 	size_t count;
-	struct repent *entries;
+	size_t capacity;
+	unsigned char *base;
+};
+
+/* entry count and time of the last change of a monthly report */
+struct monthsum {
+	int    year;
+	int    month;
+	size_t count;
+	time_t updated;
+};
+
+/* smak/months, loaded into memory */
+struct summary {
+	struct monthsum *months; /* sorted by month */
+	size_t count;
+	size_t capacity;
+	bool   changed;
+};
+
+/* The kinds of pages in www/. */
+enum pagekind {
+	PMESSAGES,
+	PREPORTS,
+	PAUTHORS,
+	POVERVIEW,
+	PFEED,
+	NUMPAGEKINDS
+};
+
+/* Where in www/ the pages of messages and their attachments are
+ * (see LAYOUT in config.h and page_dir() in html.c). */
+enum layout {
+	LAYOUT_FLAT,
+	LAYOUT_HASH,
+	LAYOUT_MONTH
+};
+
+/* longest directory that page_dir() writes, with its NUL */
+#define PAGE_DIR_MAX 32
+
+/* smak/manifest: what the pages in www/ were generated from.
+ * The pages of a kind are stale if their version differs from the
+ * current one (see page_version() in html.c). */
+struct manifest {
+	uint64_t    version[NUMPAGEKINDS];
+	MSG         mark;   /* the message pages of all records before it are current */
+	enum layout layout; /* where the message pages are */
 };
 
 void init_smakdir(void);
-size_t add_to_log(const char *info[]);
+/* Makes sure that no other smak changes the archive until this one exits.
+ * Dies if one already does. */
+void lock_smakdir(void);
+/* Converts a log and reports written by smak 0.4 or earlier. */
+void migrate_smakdir(void);
+/* Appends a record to the central log and returns where it starts.
+ * The mapped log covers it right away. */
+MSG add_to_log(const char *info[]);
+/* Looks up a message by its Message-ID. Returns NO_MSG if it is not in the log. */
+MSG lookup_msgid(const char *msgid);
+void close_smakdir(void);
+
+/* Returns true if the last run was interrupted, and where its records
+ * begin in *start. Otherwise, records the start of this run. */
+bool open_journal(MSG *start);
+/* Marks the run as complete. */
+void close_journal(void);
+/* Cuts off a record that an interrupted run only wrote partly. */
+void repair_log(MSG start);
 
+/* Maps the central log, or extends an existing mapping
+ * to cover the records that were appended since. */
 void map_log(void);
 void unmap_log(void);
-void read_from_log(MSG msg, const char *info[]);
+void read_from_log(MSG msg, struct record *rec);
+/* The records of the mapped log can be visited with
+ * for (msg = first_in_log(); msg < log_size(); msg = next_in_log(msg)) */
+size_t log_size(void);
+MSG first_in_log(void);
+MSG next_in_log(MSG msg);
+
+void   open_report (struct report *rpt, int year, int month);
+/* Opens a sorted list of entries that is not a monthly report. */
+void   open_report_file(struct report *rpt, const char *filename);
+void   close_report(struct report *rpt);
+time_t report_time (const struct report *rpt, size_t idx);
+MSG    report_msg  (const struct report *rpt, size_t idx);
+bool   report_contains(const struct report *rpt, time_t time, MSG msg);
+/* Drops the entries that an interrupted run has merged into the report
+ * already. Returns how many are left. */
+size_t drop_merged(const struct report *rpt, struct repent *entries, size_t count);
+/* Merges a batch of entries that is sorted by time into the report. */
+void   merge_into_report(struct report *rpt, const struct repent *batch, size_t count);
+
+bool load_manifest(struct manifest *mf);
+void save_manifest(const struct manifest *mf);
 
-void read_report  (struct report *rpt, int year, int month);
-void write_report (const struct report *rpt);
-void close_report (struct report *rpt);
-void add_to_report(struct report *rpt, time_t time, MSG msg);
+void load_summary(struct summary *sum);
+/* Records the entry count of a report after it was committed. */
+void update_summary(struct summary *sum, const struct report *rpt, time_t now);
+/* Writes the summary back if it changed, and frees it. */
+void save_summary(struct summary *sum);
 
@@ -0,0 +1,208 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Run statistics
+ *
+ * With --stats, smak measures how long each stage of a run takes and
+ * counts what went through it. Every thread accumulates into its own
+ * copy of the numbers, which is only merged into the totals when the
+ * thread is done, so the measurements never contend over a lock.
+ *
+ * The kernel already counts the system calls that read and write, and
+ * the peak RSS, so these are taken from /proc/self/io and getrusage()
+ * at the end, if available.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "stats.h"
+
+struct stats {
+	uint64_t ns[NUMSTAGES];
+	uint64_t spans[NUMSTAGES];
+	uint64_t counts[NUMCOUNTERS];
+};
+
+extern _Thread_local char *aether_base;
+extern _Thread_local char *aether_cursor;
+
+static const char *stage_names[NUMSTAGES] = {
+	[STPARSE]   = "parse",
+	[STDECODE]  = "decode",
+	[STWAIT]    = "lock_wait",
+	[STCOMMIT]  = "commit",
+	[STRENDER]  = "render",
+	[STSYNC]    = "sync",
+	[STRENAME]  = "rename",
+	[STCATCHUP] = "index_catchup",
+	[STRECOVER] = "recover",
+	[STNEW]     = "new",
+	[STIMPORT]  = "import",
+	[STTHREADS] = "threads",
+	[STAUTHORS] = "authors",
+	[STREPORTS] = "reports",
+	[STFEED]    = "feed",
+	[STCLOSE]   = "close",
+};
+
+static const char *counter_names[NUMCOUNTERS] = {
+	[CTMESSAGES]   = "messages",
+	[CTREJECTED]   = "rejected",
+	[CTDUPLICATES] = "duplicates",
+	[CTLOADED]     = "bytes_loaded",
+	[CTDECODED]    = "bytes_decoded",
+	[CTAETHER]     = "aether_peak",
+};
+
+static bool enabled, json;
+static uint64_t began;
+
+static _Thread_local struct stats local;
+static struct stats totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+enable_stats(bool as_json)
+{
+	enabled = true;
+	json = as_json;
+	began = now();
+}
+
+uint64_t
+start_span(void)
+{
+	return enabled ? now() : 0;
+}
+
+void
+end_span(enum stage stage, uint64_t start)
+{
+	if (!enabled) return;
+	local.ns[stage] += now() - start;
+	local.spans[stage]++;
+}
+
+void
+count_stat(enum counter counter, uint64_t n)
+{
+	if (enabled) local.counts[counter] += n;
+}
+
+void
+note_aether(void)
+{
+	uint64_t used;
+
+	if (!enabled) return;
+	used = aether_cursor - aether_base;
+	if (used > local.counts[CTAETHER])
+		local.counts[CTAETHER] = used;
+}
+
+void
+merge_stats(void)
+{
+	int i;
+
+	if (!enabled) return;
+	pthread_mutex_lock(&totals_lock);
+	for (i = 0; i < NUMSTAGES; i++) {
+		totals.ns[i] += local.ns[i];
+		totals.spans[i] += local.spans[i];
+	}
+	for (i = 0; i < NUMCOUNTERS; i++) {
+		if (i == CTAETHER)
+			totals.counts[i] = local.counts[i] > totals.counts[i] ? local.counts[i] : totals.counts[i];
+		else
+			totals.counts[i] += local.counts[i];
+	}
+	pthread_mutex_unlock(&totals_lock);
+	memset(&local, 0, sizeof local);
+}
+
+/* Reads the number of read and write system calls of the process.
+ * Returns false if the kernel doesn't tell. */
+static bool
+count_syscalls(uint64_t *reads, uint64_t *writes)
+{
+	FILE *file;
+	char line[64];
+	unsigned long long n;
+	int found = 0;
+
+	if (!(file = fopen("/proc/self/io", "r")))
+		return false;
+	while (fgets(line, sizeof line, file)) {
+		if (sscanf(line, "syscr: %llu", &n) == 1) *reads = n, found++;
+		if (sscanf(line, "syscw: %llu", &n) == 1) *writes = n, found++;
+	}
+	fclose(file);
+	return found == 2;
+}
+
+void
+print_stats(void)
+{
+	struct rusage usage;
+	uint64_t wall, reads = 0, writes = 0;
+	bool syscalls;
+	int i;
+
+	if (!enabled) return;
+	merge_stats();
+	wall = now() - began;
+	syscalls = count_syscalls(&reads, &writes);
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		die("getrusage():");
+
+	if (json) {
+		fprintf(stderr, "{\"seconds\":%.6f,\"stages\":{", wall / 1e9);
+		for (i = 0; i < NUMSTAGES; i++) {
+			fprintf(stderr, "%s\"%s\":{\"seconds\":%.6f,\"count\":%llu}", i ? "," : "",
+				stage_names[i], totals.ns[i] / 1e9, (unsigned long long) totals.spans[i]);
+		}
+		fprintf(stderr, "},\"counters\":{");
+		for (i = 0; i < NUMCOUNTERS; i++) {
+			fprintf(stderr, "%s\"%s\":%llu", i ? "," : "",
+				counter_names[i], (unsigned long long) totals.counts[i]);
+		}
+		if (syscalls) {
+			fprintf(stderr, ",\"read_syscalls\":%llu,\"write_syscalls\":%llu",
+				(unsigned long long) reads, (unsigned long long) writes);
+		}
+		fprintf(stderr, ",\"max_rss\":%llu}}\n", (unsigned long long) usage.ru_maxrss * 1024);
+		return;
+	}
+
+	fprintf(stderr, "%-16s %12s %10s\n", "stage", "seconds", "count");
+	for (i = 0; i < NUMSTAGES; i++) {
+		fprintf(stderr, "%-16s %12.6f %10llu\n", stage_names[i],
+			totals.ns[i] / 1e9, (unsigned long long) totals.spans[i]);
+	}
+	fprintf(stderr, "%-16s %12.6f\n\n", "total", wall / 1e9);
+	for (i = 0; i < NUMCOUNTERS; i++) {
+		fprintf(stderr, "%-16s %12llu\n", counter_names[i],
+			(unsigned long long) totals.counts[i]);
+	}
+	if (syscalls) {
+		fprintf(stderr, "%-16s %12llu\n", "read_syscalls", (unsigned long long) reads);
+		fprintf(stderr, "%-16s %12llu\n", "write_syscalls", (unsigned long long) writes);
+	}
+	fprintf(stderr, "%-16s %12llu\n", "max_rss", (unsigned long long) usage.ru_maxrss * 1024);
+}
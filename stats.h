@@ -0,0 +1,52 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Spans of time that are measured separately. The per-message stages are
+ * summed over all jobs, so with -j they can add up to more than the wall
+ * clock time of the run. */
+enum stage {
+	STPARSE,    /* splitting the header, the fields and the MIME parts */
+	STDECODE,   /* transfer and charset decoding of the text parts */
+	STWAIT,     /* waiting for the commit lock */
+	STCOMMIT,   /* log, thread, search index and feed updates */
+	STRENDER,   /* message pages and attachments */
+	STSYNC,     /* flushing a batch of messages to disk */
+	STRENAME,   /* moving messages to cur/ */
+	STCATCHUP,  /* indexing records that the search index is missing */
+	STRECOVER,  /* finishing an interrupted run */
+	STNEW,      /* processing new/ as a whole */
+	STIMPORT,   /* processing cur/ as a whole, see the import command */
+	STTHREADS,  /* regenerating the pages of changed threads */
+	STAUTHORS,  /* author reports and pages */
+	STREPORTS,  /* monthly reports, their pages and the overview */
+	STFEED,     /* smak/feed and the Atom feed */
+	STCLOSE,    /* writing back the remaining cache files */
+	NUMSTAGES
+};
+
+enum counter {
+	CTMESSAGES,   /* messages taken from new/ */
+	CTREJECTED,   /* messages that got the flag 'e' */
+	CTDUPLICATES, /* messages that got the flag 'd' */
+	CTLOADED,     /* bytes of all messages that were loaded */
+	CTDECODED,    /* bytes of text after transfer decoding */
+	CTAETHER,     /* the most aether memory a message needed */
+	NUMCOUNTERS
+};
+
+/* Turns on the measurements. Without it, all of the functions below
+ * return right away. */
+void enable_stats(bool json);
+/* Returns the start of a span, to be passed to end_span(). */
+uint64_t start_span(void);
+void end_span(enum stage stage, uint64_t start);
+void count_stat(enum counter counter, uint64_t n);
+/* Notes how much of the aether of the calling thread is in use. */
+void note_aether(void);
+/* Adds the numbers of the calling thread to the totals.
+ * Every thread but the main thread has to call it before it ends. */
+void merge_stats(void);
+/* Prints the totals to stderr, as a table or as JSON. */
+void print_stats(void);
@@ -0,0 +1,497 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Threading
+ *
+ * Messages are sorted into threads following Jamie Zawinski's algorithm
+ * (https://www.jwz.org/doc/threading.html), except that the thread forest
+ * is kept on disk and updated one message at a time, instead of being
+ * rebuilt from scratch on every run.
+ *
+ * Every Message-ID that we have heard of gets a node, even if its message
+ * has not arrived (yet). Such an empty node is filled in once the message
+ * shows up, so late parents automatically adopt the replies that were
+ * waiting for them. Since empty nodes have no page, the navigation of a
+ * page links to the closest non-empty ancestor and descendants instead.
+ * Whenever those change for a message, its page is marked dirty.
+ *
+ * smak/thread starts with a 32 byte header: the magic "smakthr\0", a 32 bit
+ * format version, 32 reserved bits, the 64 bit number of nodes (counting
+ * the header as node zero) and 64 reserved bits. Each node is 32 bytes:
+ * the 64 bit MSG (all ones for empty nodes), a 64 bit check hash of the
+ * Message-ID, and the 32 bit parent, first child and next sibling nodes,
+ * with zero meaning none, followed by 32 reserved bits.
+ *
+ * smak/threadid is a hash table (see hashtab.c) that maps Message-IDs to
+ * nodes. Its mark is the log offset up to which all records are threaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "mail.h"
+#include "hashtab.h"
+#include "smakdir.h"
+#include "thread.h"
+
+#define THR_MAGIC    "smakthr"
+#define THR_VERSION  1
+#define NODE_SIZE    32
+#define MIN_NODES    1024
+/* seed of the check hash, so it is independent of the table hash */
+#define CHECK_SEED   0x5eed
+
+#define NODEP(n)     (nodes + (size_t) (n) * NODE_SIZE)
+#define PARENT(n)    get_le32(NODEP(n) + 16)
+#define CHILD(n)     get_le32(NODEP(n) + 20)
+#define NEXT(n)      get_le32(NODEP(n) + 24)
+#define CHECK(n)     get_le64(NODEP(n) + 8)
+#define IS_EMPTY(n)  (get_le64(NODEP(n)) == UINT64_MAX)
+
+extern _Thread_local char *aether_cursor;
+
+static unsigned char *nodes;
+static size_t capacity;
+static int nodes_fd = -1;
+static struct hashtab ids;
+
+static NODE  *dirty;
+static size_t ndirty, capdirty;
+/* the node that is being filed right now; its page is rendered anyway */
+static NODE   filing;
+
+static size_t
+num_nodes(void)
+{
+	return get_le64(nodes + 16);
+}
+
+static void
+set_link(NODE n, int offset, NODE value)
+{
+	put_le32(NODEP(n) + offset, value);
+}
+
+static void
+map_nodes(size_t count)
+{
+	if (nodes)
+		munmap(nodes, capacity * NODE_SIZE);
+	nodes = mmap(NULL, count * NODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, nodes_fd, 0);
+	if (nodes == MAP_FAILED)
+		die("mmap():");
+	capacity = count;
+}
+
+static NODE
+new_node(uint64_t check)
+{
+	NODE n = num_nodes();
+
+	if (n == capacity) {
+		if (ftruncate(nodes_fd, 2 * capacity * NODE_SIZE) < 0)
+			die("ftruncate():");
+		map_nodes(2 * capacity);
+	}
+	memset(NODEP(n), 0, NODE_SIZE);
+	put_le64(NODEP(n), UINT64_MAX);
+	put_le64(NODEP(n) + 8, check);
+	put_le64(nodes + 16, n + 1);
+	return n;
+}
+
+/* Returns the node of a Message-ID, creating an empty one if needed.
+ * Returns zero for empty Message-IDs. */
+static NODE
+get_node(const char *id, size_t len)
+{
+	struct htiter it = HTITER_INIT;
+	char *checkpoint = aether_cursor, *norm;
+	uint64_t hash, check, value;
+	NODE n = 0;
+
+	norm = aether_alloc(len);
+	if (!(len = normalize_msgid(id, len, norm)))
+		goto out;
+	hash  = hash_bytes(norm, len, 0);
+	check = hash_bytes(norm, len, CHECK_SEED);
+	while (hashtab_find(&ids, hash, &it, &value)) {
+		if (CHECK(value) == check) {
+			n = value;
+			goto out;
+		}
+	}
+	n = new_node(check);
+	hashtab_insert(&ids, hash, n);
+out:
+	aether_cursor = checkpoint;
+	return n;
+}
+
+static void
+mark_dirty(NODE n)
+{
+	if (!n || n == filing) return;
+	if (ndirty == capdirty) {
+		capdirty = capdirty ? 2 * capdirty : 64;
+		if (!(dirty = realloc(dirty, capdirty * sizeof *dirty)))
+			die("realloc():");
+	}
+	dirty[ndirty++] = n;
+}
+
+static NODE
+real_ancestor(NODE n)
+{
+	do n = PARENT(n); while (n && IS_EMPTY(n));
+	return n;
+}
+
+/* Visits the closest non-empty descendants, i.e. the replies shown on a page. */
+static void
+visit_replies(NODE n, void (*visit)(NODE, void *), void *arg)
+{
+	NODE c;
+	for (c = CHILD(n); c; c = NEXT(c)) {
+		if (IS_EMPTY(c))
+			visit_replies(c, visit, arg);
+		else
+			visit(c, arg);
+	}
+}
+
+static void
+mark_dirty_visit(NODE n, void *arg)
+{
+	(void) arg;
+	mark_dirty(n);
+}
+
+static bool
+is_ancestor(NODE a, NODE n)
+{
+	for (; n; n = PARENT(n)) {
+		if (n == a) return true;
+	}
+	return false;
+}
+
+static void
+unlink_node(NODE n)
+{
+	NODE p = PARENT(n), c;
+
+	if (!p) return;
+	if (CHILD(p) == n) {
+		set_link(p, 20, NEXT(n));
+	} else {
+		for (c = CHILD(p); NEXT(c) != n; c = NEXT(c));
+		set_link(c, 24, NEXT(n));
+	}
+	set_link(n, 16, 0);
+	set_link(n, 24, 0);
+}
+
+/* Makes n a child of p. Replies are kept in the order they were filed. */
+static void
+link_node(NODE n, NODE p)
+{
+	NODE before, after, c;
+
+	if (n == p || PARENT(n) == p || is_ancestor(n, p))
+		return;
+
+	before = real_ancestor(n);
+	unlink_node(n);
+	set_link(n, 16, p);
+	if (!(c = CHILD(p))) {
+		set_link(p, 20, n);
+	} else {
+		while (NEXT(c)) c = NEXT(c);
+		set_link(c, 24, n);
+	}
+	after = real_ancestor(n);
+
+	if (before == after) return;
+	mark_dirty(before);
+	mark_dirty(after);
+	if (IS_EMPTY(n))
+		visit_replies(n, mark_dirty_visit, NULL);
+	else
+		mark_dirty(n);
+}
+
+static NODE
+thread_record(MSG msg, const char *msgid, const char *references, const char *inreplyto)
+{
+	const char *cursor, *id, *last = NULL;
+	size_t len, lastlen = 0;
+	NODE n, ref, prev = 0;
+
+	n = get_node(msgid, strlen(msgid));
+	if (!n || !IS_EMPTY(n))
+		n = new_node(0);
+	filing = n;
+
+	/* The message has arrived, so the page of its closest ancestor
+	 * and those of the replies that waited for it have to change. */
+	put_le64(NODEP(n), msg);
+	mark_dirty(real_ancestor(n));
+	visit_replies(n, mark_dirty_visit, NULL);
+
+	/* Each message in References is the parent of the next one,
+	 * unless some earlier message already knew better. */
+	for (cursor = references; (cursor = next_msgid(cursor, &id, &len));) {
+		if (!(ref = get_node(id, len))) continue;
+		if (prev && !PARENT(ref))
+			link_node(ref, prev);
+		prev = ref;
+		last = id;
+		lastlen = len;
+	}
+	/* In-Reply-To only counts if References did not already end with it. */
+	if (next_msgid(inreplyto, &id, &len) && (len != lastlen || memcmp(id, last, len))
+	&& (ref = get_node(id, len))) {
+		if (prev && !PARENT(ref))
+			link_node(ref, prev);
+		prev = ref;
+	}
+	/* The message itself has the final say about its parent. */
+	if (prev)
+		link_node(n, prev);
+
+	filing = 0;
+	return n;
+}
+
+/* Files the records in front of limit that were logged while there was no
+ * thread forest yet. Only In-Reply-To is in the log, so the References of
+ * those messages are lost. Their pages were never rendered with navigation
+ * in the first place, so they are not marked dirty either. */
+static void
+catch_up(MSG limit)
+{
+	struct record rec;
+	size_t keep = ndirty;
+	MSG msg;
+
+	if (!(msg = hashtab_mark(&ids)))
+		msg = first_in_log();
+	if (msg >= limit)
+		return;
+	map_log();
+	for (; msg < limit; msg = next_in_log(msg)) {
+		read_from_log(msg, &rec);
+		thread_record(msg, rec.info[MMSGID].str, "", rec.info[MINREPLYTO].str);
+	}
+	hashtab_set_mark(&ids, msg);
+	ndirty = keep;
+}
+
+void
+open_threads(void)
+{
+	unsigned char hdr[NODE_SIZE] = { 0 };
+	struct stat meta;
+
+	if (nodes) return;
+
+	if ((nodes_fd = open("smak/thread", O_RDWR | O_CREAT, 0640)) < 0)
+		die("cannot open 'smak/thread':");
+	if (fstat(nodes_fd, &meta) < 0)
+		die("fstat():");
+	if (!meta.st_size) {
+		memcpy(hdr, THR_MAGIC, 8);
+		put_le32(hdr + 8, THR_VERSION);
+		put_le64(hdr + 16, 1);
+		check_write(nodes_fd, hdr, sizeof hdr);
+		if (ftruncate(nodes_fd, MIN_NODES * NODE_SIZE) < 0)
+			die("ftruncate():");
+		meta.st_size = MIN_NODES * NODE_SIZE;
+	}
+	if (meta.st_size < NODE_SIZE || meta.st_size % NODE_SIZE)
+		die("'smak/thread' is corrupt.");
+	map_nodes(meta.st_size / NODE_SIZE);
+	if (memcmp(nodes, THR_MAGIC, 8) || get_le32(nodes + 8) != THR_VERSION)
+		die("'smak/thread' has an unknown format.");
+	if (num_nodes() < 1 || num_nodes() > capacity)
+		die("'smak/thread' is corrupt.");
+
+	hashtab_open(&ids, "smak/threadid");
+}
+
+void
+close_threads(void)
+{
+	if (!nodes) return;
+	munmap(nodes, capacity * NODE_SIZE);
+	nodes = NULL;
+	capacity = 0;
+	close(nodes_fd);
+	nodes_fd = -1;
+	hashtab_close(&ids);
+	free(dirty);
+	dirty = NULL;
+	ndirty = capdirty = 0;
+}
+
+/* Files a freshly logged message into the thread forest. */
+NODE
+add_to_threads(MSG msg, const char *msgid, const char *references, const char *inreplyto)
+{
+	NODE n;
+
+	open_threads();
+	catch_up(msg);
+	n = thread_record(msg, msgid, references, inreplyto);
+	hashtab_set_mark(&ids, next_in_log(msg));
+	return n;
+}
+
+/* Files all records that the thread forest is missing. */
+void
+catch_up_threads(void)
+{
+	open_threads();
+	map_log();
+	catch_up(log_size());
+}
+
+/* Returns the node of a logged message, or zero if it cannot be found,
+ * because the message has no Message-ID or shares it with another one.
+ * Only reads the thread forest, so several threads may call it at once. */
+NODE
+find_thread(MSG msg)
+{
+	struct htiter it = HTITER_INIT;
+	struct record rec;
+	char *checkpoint = aether_cursor, *norm;
+	uint64_t hash, check, value;
+	size_t len;
+	NODE n = 0;
+
+	read_from_log(msg, &rec);
+	norm = aether_alloc(rec.info[MMSGID].len);
+	if (!(len = normalize_msgid(rec.info[MMSGID].str, rec.info[MMSGID].len, norm)))
+		goto out;
+	hash  = hash_bytes(norm, len, 0);
+	check = hash_bytes(norm, len, CHECK_SEED);
+	while (hashtab_find(&ids, hash, &it, &value)) {
+		if (CHECK(value) == check) {
+			if (!IS_EMPTY(value) && get_le64(NODEP(value)) == msg)
+				n = value;
+			break;
+		}
+	}
+out:
+	aether_cursor = checkpoint;
+	return n;
+}
+
+/* Marks the page of a logged message dirty, e.g. because an interrupted
+ * run may have lost it, and so are those of its parent and replies, whose
+ * links it changed when it was filed. */
+void
+touch_thread(MSG msg)
+{
+	NODE n;
+
+	open_threads();
+	catch_up(next_in_log(msg));
+	if ((n = find_thread(msg))) {
+		mark_dirty(n);
+		mark_dirty(real_ancestor(n));
+		visit_replies(n, mark_dirty_visit, NULL);
+	}
+}
+
+MSG
+thread_msg(NODE node)
+{
+	return IS_EMPTY(node) ? NO_MSG : get_le64(NODEP(node));
+}
+
+static char *
+copy_field(const struct field *f)
+{
+	char *str = aether_alloc(f->len + 1);
+	memcpy(str, f->str, f->len + 1);
+	return str;
+}
+
+static void
+make_link(NODE n, struct navlink *link)
+{
+	struct record rec;
+
+	read_from_log(thread_msg(n), &rec);
+	link->uniq    = copy_field(&rec.info[MUNIQ]);
+	link->subject = copy_field(&rec.info[MSUBJECT]);
+	link->time    = rec.time;
+}
+
+static void
+count_visit(NODE n, void *arg)
+{
+	(void) n;
+	((struct threadnav *) arg)->nreplies++;
+}
+
+static void
+link_visit(NODE n, void *arg)
+{
+	struct threadnav *nav = arg;
+	make_link(n, &nav->replies[nav->nreplies++]);
+}
+
+/* Reads the mapped log, which has to cover the thread.
+ * The strings are copied to the aether. */
+void
+thread_nav(NODE node, struct threadnav *nav)
+{
+	NODE p;
+
+	memset(nav, 0, sizeof *nav);
+	if ((p = real_ancestor(node)))
+		make_link(p, &nav->parent);
+
+	visit_replies(node, count_visit, nav);
+	nav->replies = aether_alloc(nav->nreplies * sizeof *nav->replies);
+	nav->nreplies = 0;
+	visit_replies(node, link_visit, nav);
+}
+
+static int
+compare_nodes(const void *a, const void *b)
+{
+	NODE x = *(const NODE *) a, y = *(const NODE *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Hands out the messages whose thread context changed since the last call,
+ * i.e. the messages whose pages have to be regenerated. */
+NODE *
+take_dirty_threads(size_t *count)
+{
+	NODE *list = dirty;
+	size_t i, j;
+
+	if (ndirty)
+		qsort(dirty, ndirty, sizeof *dirty, compare_nodes);
+	for (i = j = 0; i < ndirty; i++) {
+		if (!j || dirty[i] != list[j-1])
+			list[j++] = dirty[i];
+	}
+	*count = j;
+	dirty = NULL;
+	ndirty = capdirty = 0;
+	return list;
+}
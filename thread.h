@@ -0,0 +1,39 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdint.h>
+#include <time.h>
+
+typedef uint32_t NODE;
+
+/* A link to another message, for the thread navigation of a page. */
+struct navlink {
+	const char *uniq;
+	const char *subject;
+	time_t      time;
+};
+
+/* The neighbours of a message in its thread. */
+struct threadnav {
+	struct navlink  parent; /* parent.uniq is NULL for thread roots */
+	struct navlink *replies;
+	size_t          nreplies;
+};
+
+void open_threads(void);
+void close_threads(void);
+/* Files a freshly logged message into the thread forest. */
+NODE add_to_threads(MSG msg, const char *msgid, const char *references, const char *inreplyto);
+/* Files all records that the thread forest is missing. */
+void catch_up_threads(void);
+/* Returns the node of a logged message, or zero if it has none that can
+ * be found. Safe to call from several threads. */
+NODE find_thread(MSG msg);
+/* Marks the pages of a logged message and of its neighbours dirty. */
+void touch_thread(MSG msg);
+/* Reads the mapped log, which has to cover the thread.
+ * The strings are copied to the aether. */
+void thread_nav(NODE node, struct threadnav *nav);
+MSG thread_msg(NODE node);
+/* Hands out the messages whose thread context changed since the last call,
+ * i.e. the messages whose pages have to be regenerated. */
+NODE *take_dirty_threads(size_t *count);
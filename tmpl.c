@@ -0,0 +1,84 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Output templates
+ *
+ * Pages are described by templates instead of code, so that their layout
+ * can be changed in config.h and the same pages can be generated in other
+ * formats. Templates are parsed into segments only once, at startup, so
+ * rendering is a loop that hands literals and slot contents to the output
+ * buffer, which writes them out with writev().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "out.h"
+#include "tmpl.h"
+
+/* Literals at least this long are referenced instead of being copied. */
+#define REF_THRESHOLD 512
+
+static struct segment *
+add_segment(struct template *t, size_t *cap)
+{
+	if (t->nsegs == *cap) {
+		*cap = *cap ? 2 * *cap : 16;
+		if (!(t->segs = realloc(t->segs, *cap * sizeof *t->segs)))
+			die("realloc():");
+	}
+	return &t->segs[t->nsegs++];
+}
+
+void
+compile_template(struct template *t, const char *src, const char *const names[], int nnames)
+{
+	const char *open, *close;
+	size_t cap = 0, len;
+	int slot;
+
+	t->segs = NULL;
+	t->nsegs = 0;
+	while (*src) {
+		if (!(open = strstr(src, "{{")))
+			open = src + strlen(src);
+		if (open > src)
+			*add_segment(t, &cap) = (struct segment) { src, open - src, -1 };
+		if (!*open) break;
+
+		open += 2;
+		if (!(close = strstr(open, "}}")))
+			die("unterminated slot in template: '%.20s'", open - 2);
+		len = close - open;
+		for (slot = 0; slot < nnames; slot++) {
+			if (strlen(names[slot]) == len && !memcmp(names[slot], open, len)) break;
+		}
+		if (slot == nnames)
+			die("unknown slot in template: '%.*s'", (int) len, open);
+		*add_segment(t, &cap) = (struct segment) { NULL, 0, slot };
+		src = close + 2;
+	}
+}
+
+void
+render_template(struct outbuf *ob, const struct template *t, const struct slot *slots,
+	encoder encode, const void *ctx)
+{
+	const struct segment *seg, *end = t->segs + t->nsegs;
+	const struct slot *s;
+
+	for (seg = t->segs; seg < end; seg++) {
+		if (seg->slot < 0) {
+			if (seg->len >= REF_THRESHOLD)
+				out_ref(ob, seg->lit, seg->len);
+			else
+				out_write(ob, seg->lit, seg->len);
+			continue;
+		}
+		s = &slots[seg->slot];
+		if (s->render)
+			s->render(ob, ctx, s->arg);
+		else if (s->str)
+			encode(ob, s->str, s->len);
+	}
+}
@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+
+struct outbuf;
+
+/* Writes a string into the output, escaped for the output format. */
+typedef void (*encoder)(struct outbuf *ob, const char *mem, size_t length);
+
+/* A template is parsed once into a flat array of segments. Each one is
+ * either a literal piece of the template text or a slot, written {{name}}
+ * in the template, that is filled in when the template is rendered. */
+struct segment {
+	const char *lit;  /* points into the template text */
+	size_t      len;
+	int         slot; /* -1 for literals */
+};
+
+struct template {
+	struct segment *segs;
+	size_t nsegs;
+};
+
+/* What goes into a slot: either a string that is escaped with the encoder,
+ * or a function that writes the content itself, like a list of items. */
+struct slot {
+	const char *str;
+	size_t      len;
+	void (*render)(struct outbuf *ob, const void *ctx, const void *arg);
+	const void *arg;
+};
+
+/* names[i] is the name of slot i. The template text has to stay around. */
+void compile_template(struct template *t, const char *src, const char *const names[], int nnames);
+/* Slots that are not set stay empty. ctx is passed on to render functions. */
+void render_template(struct outbuf *ob, const struct template *t, const struct slot *slots,
+	encoder encode, const void *ctx);
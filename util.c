@@ -1,5 +1,7 @@
 /* See LICENSE file for copyright and license details. */
 
+#define _GNU_SOURCE /* syncfs() */
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +9,15 @@
 #include <time.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "util.h"
+#include "config.h"
+
+extern _Thread_local char *aether_base;
+extern _Thread_local char *aether_cursor;
 
 void
 die(const char *format, ...)
@@ -28,6 +36,17 @@ die(const char *format, ...)
 	exit(1);
 }
 
+/* Allocates size bytes in the aether of the calling thread. */
+void *
+aether_alloc(size_t size)
+{
+	void *ptr = aether_cursor;
+	if (size > MAX_AETHER_MEMORY - (aether_cursor - aether_base))
+		die("not enough aether memory.");
+	aether_cursor += size;
+	return ptr;
+}
+
 /* Like strcspn(), but takes explicit maximum lengths instead of relying on NUL termination. */
 size_t
 mem_cspn(const char *hay, size_t haylen, const char *needle, size_t needlelen)
@@ -43,6 +62,19 @@ mem_cspn(const char *hay, size_t haylen, const char *needle, size_t needlelen)
 	return chr - (BYTEP) hay;
 }
 
+/* 64 bit FNV-1a hash. Different seeds give independent hashes. */
+uint64_t
+hash_bytes(const void *mem, size_t length, uint64_t seed)
+{
+	const unsigned char *c = mem;
+	uint64_t hash = 0xcbf29ce484222325 ^ seed;
+	while (length--) {
+		hash ^= *c++;
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
 /* Same as write(), but calls die() if the write fails. Also deals with EINTR */
 ssize_t
 check_write(int fd, const void *buf, size_t n)
@@ -75,6 +107,54 @@ check_read(int fd, void *buf, size_t n)
 	return r;
 }
 
+/* Flushes everything that was written to the file system that contains
+ * path to disk. Elsewhere than on Linux, all file systems are flushed. */
+void
+flush_fs(const char *path)
+{
+#ifdef __linux__
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("cannot open '%s':", path);
+	if (syncfs(fd) < 0)
+		die("syncfs():");
+	close(fd);
+#else
+	(void) path;
+	sync();
+#endif
+}
+
+/* Flushes a directory to disk, so that the renames inside of it persist. */
+void
+flush_dir(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("cannot open '%s':", path);
+	if (fsync(fd) < 0)
+		die("fsync():");
+	close(fd);
+}
+
+/* Makes a directory, and the ones above it that are missing. */
+void
+make_dir(char *path)
+{
+	char *slash;
+
+	if (!mkdir(path, 0750) || errno == EEXIST) return;
+	if (errno != ENOENT || !(slash = strrchr(path, '/')))
+		die("cannot create directory '%s':", path);
+	*slash = '\0';
+	make_dir(path);
+	*slash = '/';
+	if (mkdir(path, 0750) < 0 && errno != EEXIST)
+		die("cannot create directory '%s':", path);
+}
+
 /* Similar to the GNU extension timegm(). Unlike timegm() it doesn't modify its input. */
 time_t
 mkutctime(const struct tm *tm)
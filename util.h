@@ -1,19 +1,61 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 struct tm;
 
 void die(const char *format, ...);
 
+/* Allocates size bytes in the aether of the calling thread. */
+void *aether_alloc(size_t size);
+
 /* Like strcspn(), but takes explicit maximum lengths instead of relying on NUL termination. */
 size_t mem_cspn(const char *hay, size_t haylen, const char *needle, size_t needlelen);
 
+/* 64 bit FNV-1a hash. Different seeds give independent hashes. */
+uint64_t hash_bytes(const void *mem, size_t length, uint64_t seed);
+
 /* Same as write(), but calls die() if the write fails. Also deals with EINTR */
 ssize_t check_write(int fd, const void *buf, size_t n);
 /* Same as read(), but calls die() if the read fails. Also deals with EINTR */
 ssize_t check_read(int fd, void *buf, size_t n);
 
+/* Flushes the file system that contains path to disk. */
+void flush_fs(const char *path);
+/* Flushes a directory to disk, so that the renames inside of it persist. */
+void flush_dir(const char *path);
+/* Makes a directory, and the ones above it that are missing.
+ * path is changed in between, but restored. */
+void make_dir(char *path);
+
 /* Similar to the GNU extension timegm(). Unlike timegm() it doesn't modify its input. */
 time_t mkutctime(const struct tm *tm);
+
+/* Everything under smak/ is stored in little-endian byte order,
+ * regardless of the host architecture. */
+static inline uint32_t
+get_le32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t
+get_le64(const unsigned char *p)
+{
+	return (uint64_t) get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+static inline void
+put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void
+put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}